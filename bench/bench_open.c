@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../mlbuf.h"
+
+// Time buffer_open for each open strategy over a range of file sizes to find
+// where mmapping starts to beat reading. Usage: bench_open [dir] [iters]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int make_file(char* path, size_t size) {
+    FILE* fp;
+    size_t i;
+    if (!(fp = fopen(path, "wb"))) return 0;
+    for (i = 0; i < size; i++) {
+        fputc(i % 64 == 63 ? '\n' : 'a' + (i % 26), fp);
+    }
+    fclose(fp);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    char* dir;
+    char path[1024];
+    int iters;
+    int i;
+    int s;
+    size_t size;
+    double t;
+    buffer_t* buf;
+    int strategies[3] = { MLBUF_OPEN_STRATEGY_READ, MLBUF_OPEN_STRATEGY_MMAP, MLBUF_OPEN_STRATEGY_MMAP_COPY };
+
+    dir = argc > 1 ? argv[1] : "/tmp";
+    iters = argc > 2 ? atoi(argv[2]) : 20;
+    snprintf(path, sizeof(path), "%s/mlbuf-bench-open", dir);
+
+    printf("%12s %12s %12s %12s\n", "bytes", "read_us", "mmap_us", "mmap_copy_us");
+    for (size = 256; size <= 64 * 1024 * 1024; size *= 4) {
+        if (!make_file(path, size)) return EXIT_FAILURE;
+        printf("%12zu", size);
+        for (s = 0; s < 3; s++) {
+            buf = buffer_new();
+            buffer_set_open_strategy(buf, strategies[s], 0);
+            buffer_open(buf, path); // warm page cache
+            t = now();
+            for (i = 0; i < iters; i++) {
+                buffer_open(buf, path);
+            }
+            printf(" %12.1f", (now() - t) / iters * 1e6);
+            buffer_destroy(buf);
+        }
+        printf("\n");
+    }
+    unlink(path);
+    return EXIT_SUCCESS;
+}
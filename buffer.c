@@ -5,17 +5,173 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+#ifdef MLBUF_IO_URING
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "mlbuf.h"
 #include "utlist.h"
 
-static int _buffer_open_mmap(buffer_t* self, int fd, size_t size);
-static int _buffer_open_read(buffer_t* self, int fd, size_t size);
+// Header of a sidecar line index. It is followed by nlines uint64_t line
+// start offsets.
+struct buffer_index_header_s {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t nlines;
+};
+
+// Header of an edit journal. It is followed by records. size and mtime are
+// of the file as last opened, saved, or followed. Records replay onto its
+// first base_size bytes; bytes followed after that are recorded as inserts.
+struct buffer_journal_header_s {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t base_size;
+};
+
+// An edit journal record. Insert, permute, join and split records are
+// followed by data_len bytes of data.
+struct buffer_journal_record_s {
+    int64_t type;
+    int64_t line_index;
+    int64_t col;
+    int64_t nchars;
+    int64_t data_len;
+};
+
+// A save running on a worker thread. iov is a snapshot of the buffer taken
+// when the save started, pointing into the mmap for unedited lines and into
+// data for copies of the rest; data_len is its total length and version is
+// the buffer version at that time. If the buffer lets go of its mmap while
+// the save runs, the job keeps it in mmap until the save is polled.
+struct buffer_save_job_s {
+    pthread_t thread;
+    char* path;
+    struct iovec* iov;
+    int iovcnt;
+    char* data;
+    bint_t data_len;
+    char* mmap;
+    size_t mmap_len;
+    int mmap_fd;
+    bint_t version;
+    int is_gzip;
+    buffer_save_callback_t callback;
+    void* callback_udata;
+    int rc;
+    size_t nbytes;
+    int is_done;
+};
+
+// A line being sorted or filtered. index is its position in the range and
+// key is what it is compared by.
+struct buffer_line_item_s {
+    bline_t* bline;
+    bint_t index;
+    char* key;
+    bint_t key_len;
+};
+
+#ifdef MLBUF_IO_URING
+// An io_uring instance set up with raw syscalls. Only what reading and
+// writing a file in chunks needs is kept: the submission and completion ring
+// pointers and the sqe array.
+struct buffer_uring_s {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+#endif
+
+static int _buffer_open_strategy(buffer_t* self, int fd, struct stat* st);
+static int _buffer_open_mmap(buffer_t* self, char* path, int fd, size_t size, int strategy);
+static int _buffer_mmap_save_in_place(buffer_t* self, char* path);
+static int _buffer_mmap_detach(buffer_t* self, char* path);
+static int _buffer_set_mmapped_w_offsets(buffer_t* self, char* data, bint_t data_len, uint64_t* line_offsets, bint_t nlines);
+static char* _buffer_index_path(buffer_t* self, char* path);
+static int _buffer_index_load(buffer_t* self, char* path, int fd, char* data, void** ret_map, size_t* ret_map_len, uint64_t** ret_offsets, bint_t* ret_nlines);
+static int _buffer_index_save(buffer_t* self, char* path, int fd);
+static int _buffer_index_header(int fd, struct buffer_index_header_s* header);
+static int _buffer_open_read(buffer_t* self, int fd);
+static int _buffer_read_fd(buffer_t* self, int fd, gzFile gz, int do_reset, bint_t* optret_nbytes);
+#ifdef MLBUF_IO_URING
+static int _buffer_read_fd_uring(buffer_t* self, int fd, struct buffer_uring_s* ring, int do_reset, bint_t* optret_nbytes);
+static int _buffer_uring_init(struct buffer_uring_s* ring, unsigned depth);
+static void _buffer_uring_free(struct buffer_uring_s* ring);
+static int _buffer_write_fd_uring(buffer_t* self, int fd, struct buffer_uring_s* ring, size_t* optret_nbytes);
+static int _buffer_uring_reap_write(struct buffer_uring_s* ring, int fd, struct iovec** batch_iov, int* batch_iovcnt, off_t* batch_off, int* nflight, size_t* nbytes);
+static int _buffer_uring_submit(struct buffer_uring_s* ring, int opcode, int fd, struct iovec* iov, int iovcnt, off_t off, uint64_t user_data);
+static int _buffer_uring_wait(struct buffer_uring_s* ring, int* ret_res, uint64_t* ret_user_data);
+#endif
+static int _buffer_is_gzip(int fd);
+static int _buffer_copy_fd(int src_fd, int dst_fd);
+static int _buffer_writev_all(int fd, struct iovec* iov, int iovcnt, size_t* nbytes);
+static bint_t _buffer_mmap_run(buffer_t* self, bline_t* bline, bline_t** ret_end);
+static int _buffer_write_mmap_range(buffer_t* self, size_t off, size_t len, int fd, size_t* nbytes);
+static int _buffer_write_to_gzip(buffer_t* self, int fd, size_t* optret_nbytes);
+static int _buffer_gzwrite_all(gzFile gz, char* data, size_t len);
+static int _buffer_reset(buffer_t* self);
+static int _buffer_append(buffer_t* self, char* data, bint_t data_len);
+static bint_t _buffer_bulk_append(buffer_t* self, char* data, bint_t data_len);
+static bint_t _buffer_count_chars(char* data, bint_t data_len);
 static int _buffer_bline_unslab(bline_t* self);
 static void _buffer_stat(buffer_t* self);
+static void* _buffer_save_job_run(void* arg);
+static void _buffer_snapshot(buffer_t* self, struct iovec* iov, char* arena, int* ret_iovcnt, size_t* ret_arena_len);
+static void* _buffer_reap(void* arg);
+static void _buffer_detach_srules(buffer_t* self);
+static int _buffer_journal_write(buffer_t* self, int type, bint_t line_index, bint_t col, bint_t nchars, char* data, bint_t data_len);
+static int _buffer_journal_truncate(buffer_t* self);
+static int _buffer_journal_rebase(buffer_t* self, bline_t* orig_last_line, bint_t orig_col);
+static int _buffer_journal_is_record_valid(struct buffer_journal_record_s* record, char* data);
 static int _buffer_baction_do(buffer_t* self, bline_t* bline, baction_t* action, int is_redo, bint_t* opt_repeat_offset);
+static int _buffer_edit_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol, char* data, bint_t data_len, int do_pad);
+static bint_t _buffer_line_range(bline_t** start_line, bline_t* end_line);
+static struct buffer_line_item_s* _buffer_line_items(bline_t** start_line, bline_t* end_line, bint_t* ret_nlines);
+static int _buffer_line_item_cmp(struct buffer_line_item_s* a, struct buffer_line_item_s* b, buffer_line_cmp_t cmp, void* udata);
+static int _buffer_sort_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre, buffer_line_cmp_t cmp, void* udata);
+static int _buffer_drop_lines(buffer_t* self, bline_t* start_line, bint_t nlines, char* drop);
+static int _buffer_permute_lines(buffer_t* self, bline_t* start_line, bint_t nlines, bint_t* perm);
+static int _buffer_join_lines(buffer_t* self, bline_t* start_line, bint_t nlines, char* sep, bint_t sep_len);
+static int _buffer_split_line(buffer_t* self, bline_t* bline, char* data, bint_t data_len);
+static int _buffer_detach_lines(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, bint_t nchars, bint_t nlines, baction_t* maybe_owner);
+static int _buffer_attach_lines(buffer_t* self, bline_t* bline, baction_t* action);
 static int _buffer_update(buffer_t* self, baction_t* action);
+static int _buffer_undo(buffer_t* self);
+static int _buffer_redo(buffer_t* self);
+static int _buffer_do_group(buffer_t* self, baction_t* action, int is_redo);
+static int _buffer_update_data(buffer_t* self, baction_t* action);
 static int _buffer_truncate_undo_stack(buffer_t* self, baction_t* action_from);
 static int _buffer_add_to_undo_stack(buffer_t* self, baction_t* action);
 static int _buffer_apply_styles_singles(bline_t* start_line, bint_t min_nlines);
@@ -24,12 +180,13 @@ static int _buffer_bline_apply_style_single(srule_t* srule, bline_t* bline);
 static int _buffer_bline_apply_style_multi(srule_t* srule, bline_t* bline, srule_t** open_rule, bint_t* look_offset);
 static bline_t* _buffer_bline_new(buffer_t* self);
 static int _buffer_bline_free(bline_t* bline, bline_t* maybe_mark_line, bint_t col_delta);
-static bline_t* _buffer_bline_break(bline_t* bline, bint_t col);
+static bline_t* _buffer_bline_insert_lines(bline_t* bline, bint_t col, char* data, bint_t data_len, bint_t* ret_end_col, bint_t* ret_num_lines, bint_t* ret_num_chars);
 static void _buffer_find_end_pos(bline_t* start_line, bint_t start_col, bint_t num_chars, bline_t** ret_end_line, bint_t* ret_end_col, bint_t* ret_safe_num_chars);
 static void _buffer_bline_replace(bline_t* bline, bint_t start_col, char* data, bint_t data_len, str_t* del_data);
 static bint_t _buffer_bline_insert(bline_t* bline, bint_t col, char* data, bint_t data_len, int move_marks);
 static bint_t _buffer_bline_delete(bline_t* bline, bint_t col, bint_t num_chars);
 static bint_t _buffer_bline_col_to_index(bline_t* bline, bint_t col);
+static bint_t _buffer_substr_len(bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col);
 static bint_t _buffer_bline_index_to_col(bline_t* bline, bint_t index);
 static int _buffer_munmap(buffer_t* self);
 static int _srule_multi_find(srule_t* rule, int find_end, bline_t* bline, bint_t start_offset, bint_t* ret_start, bint_t* ret_stop);
@@ -37,6 +194,12 @@ static int _srule_multi_find_start(srule_t* rule, bline_t* bline, bint_t start_o
 static int _srule_multi_find_end(srule_t* rule, bline_t* bline, bint_t start_offset, bint_t* ret_stop);
 static int _baction_destroy(baction_t* action);
 
+// Number of reaper threads still freeing buffers, for
+// buffer_destroy_async_wait
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static int reap_count = 0;
+
 // Make a new buffer and return it
 buffer_t* buffer_new() {
     buffer_t* buffer;
@@ -48,6 +211,9 @@ buffer_t* buffer_new() {
     buffer->last_line = bline;
     buffer->line_count = 1;
     buffer->mmap_fd = -1;
+    buffer->export_fd = -1;
+    buffer->open_strategy = MLBUF_OPEN_STRATEGY_AUTO;
+    buffer->open_mmap_min_size = MLBUF_LARGE_FILE_SIZE;
     return buffer;
 }
 
@@ -66,10 +232,14 @@ buffer_t* buffer_new_open(char* path) {
 // Read buffer from path
 int buffer_open(buffer_t* self, char* path) {
     int rc;
+    int strategy;
     struct stat st;
     int fd;
     fd = -1;
 
+    // Finish any background save first so it cannot update path afterwards
+    buffer_save_async_poll(self, 1);
+
     rc = MLBUF_OK;
     do {
         // Exit early if path is empty
@@ -78,8 +248,8 @@ int buffer_open(buffer_t* self, char* path) {
             break;
         }
 
-        // Open file for reading
-        if ((fd = open(path, O_RDONLY)) < 0) {
+        // Open file for reading, or writing too if we will overwrite in place
+        if ((fd = open(path, self->open_strategy == MLBUF_OPEN_STRATEGY_MMAP_SHARED ? O_RDWR : O_RDONLY)) < 0) {
             rc = MLBUF_ERR;
             break;
         }
@@ -92,16 +262,16 @@ int buffer_open(buffer_t* self, char* path) {
 
         // Read or mmap file into buffer
         self->is_in_open = 1;
-        if (st.st_size >= MLBUF_LARGE_FILE_SIZE) {
-            if (_buffer_open_mmap(self, fd, st.st_size) != MLBUF_OK) {
-                rc = MLBUF_ERR;
+        strategy = _buffer_open_strategy(self, fd, &st);
+        switch (strategy) {
+            case MLBUF_OPEN_STRATEGY_MMAP:
+            case MLBUF_OPEN_STRATEGY_MMAP_COPY:
+            case MLBUF_OPEN_STRATEGY_MMAP_SHARED:
+                rc = _buffer_open_mmap(self, path, fd, st.st_size, strategy);
                 break;
-            }
-        } else {
-            if (_buffer_open_read(self, fd, st.st_size) != MLBUF_OK) {
-                rc = MLBUF_ERR;
+            default:
+                rc = _buffer_open_read(self, fd);
                 break;
-            }
         }
         self->is_in_open = 0;
     } while(0);
@@ -118,9 +288,93 @@ int buffer_open(buffer_t* self, char* path) {
     // Remember stat
     _buffer_stat(self);
 
+    // File is the new journal base
+    _buffer_journal_truncate(self);
+
     return MLBUF_OK;
 }
 
+// Read buffer from file descriptor until EOF. Unlike buffer_open, this works
+// on pipes, FIFOs, and sockets. Path is left unchanged.
+int buffer_open_fd(buffer_t* self, int fd) {
+    int rc;
+    buffer_save_async_poll(self, 1);
+    self->is_in_open = 1;
+    rc = _buffer_open_read(self, fd);
+    self->is_in_open = 0;
+    if (rc == MLBUF_ERR) return rc;
+    self->is_unsaved = 0;
+    return MLBUF_OK;
+}
+
+// Append data written to path since the buffer was last opened, saved, or
+// followed. Meant to be polled on growing files, e.g., logs. Only the new
+// bytes are read. Marks, styles, and undo history are preserved. Return
+// MLBUF_ERR if the file was replaced or truncated, in which case the caller
+// should reopen it.
+int buffer_follow(buffer_t* self, bint_t* optret_nbytes) {
+    int rc;
+    int fd;
+    int is_unsaved;
+    struct stat st;
+    bint_t nbytes;
+    bline_t* orig_last_line;
+    bint_t orig_col;
+
+    if (optret_nbytes) *optret_nbytes = 0;
+
+    // Exit early if there is no path or file is compressed
+    if (!self->path || self->is_gzip) {
+        return MLBUF_ERR;
+    }
+
+    // Open file for reading
+    if ((fd = open(self->path, O_RDONLY)) < 0) {
+        return MLBUF_ERR;
+    }
+
+    rc = MLBUF_OK;
+    nbytes = 0;
+    do {
+        // Stat file and make sure it only grew
+        if (fstat(fd, &st) < 0) {
+            rc = MLBUF_ERR;
+            break;
+        } else if (st.st_dev != self->st.st_dev
+            || st.st_ino != self->st.st_ino
+            || st.st_size < self->st.st_size
+        ) {
+            rc = MLBUF_ERR;
+            break;
+        } else if (st.st_size == self->st.st_size) {
+            break;
+        }
+
+        // Read appended bytes
+        if (lseek(fd, self->st.st_size, SEEK_SET) < 0) {
+            rc = MLBUF_ERR;
+            break;
+        }
+        is_unsaved = self->is_unsaved;
+        orig_last_line = self->last_line;
+        MLBUF_BLINE_ENSURE_CHARS(orig_last_line);
+        orig_col = orig_last_line->char_count;
+        rc = _buffer_read_fd(self, fd, NULL, 0, &nbytes);
+        self->is_unsaved = is_unsaved;
+
+        // Remember stat, accounting for data appended since fstat
+        st.st_size = self->st.st_size + nbytes;
+        self->st = st;
+
+        // Move the journal to the grown file
+        _buffer_journal_rebase(self, orig_last_line, orig_col);
+    } while(0);
+
+    close(fd);
+    if (optret_nbytes) *optret_nbytes = nbytes;
+    return rc;
+}
+
 // Write buffer to path
 int buffer_save(buffer_t* self) {
     return buffer_save_as(self, self->path, NULL);
@@ -128,7 +382,7 @@ int buffer_save(buffer_t* self) {
 
 // Write buffer to specified path
 int buffer_save_as(buffer_t* self, char* path, bint_t* optret_nbytes) {
-    FILE* fp;
+    int fd;
     size_t nbytes;
 
     if (optret_nbytes) *optret_nbytes = 0;
@@ -138,15 +392,33 @@ int buffer_save_as(buffer_t* self, char* path, bint_t* optret_nbytes) {
         return MLBUF_ERR;
     }
 
+    // Flush overwritten pages if the shared mmap is still the whole buffer
+    if (_buffer_mmap_save_in_place(self, path) == MLBUF_OK) {
+        if (optret_nbytes) *optret_nbytes = (bint_t)self->mmap_len;
+        self->is_unsaved = 0;
+        _buffer_stat(self);
+        _buffer_journal_truncate(self);
+        return MLBUF_OK;
+    }
+
+    // Make sure we are not about to truncate our own mmap
+    if (_buffer_mmap_detach(self, path) != MLBUF_OK) {
+        return MLBUF_ERR;
+    }
+
     // Open file for writing
-    if (!(fp = fopen(path, "wb"))) {
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
         return MLBUF_ERR;
     }
 
-    // Write data to file
+    // Write data to file, recompressing if buffer was opened from gzip
     nbytes = 0;
-    buffer_write_to_file(self, fp, &nbytes);
-    fclose(fp);
+    if (self->is_gzip) {
+        _buffer_write_to_gzip(self, fd, &nbytes);
+    } else {
+        buffer_write_to_fd(self, fd, &nbytes);
+    }
+    close(fd);
     if (optret_nbytes) *optret_nbytes = (bint_t)nbytes;
     if ((bint_t)nbytes != self->byte_count) return MLBUF_ERR;
 
@@ -160,30 +432,239 @@ int buffer_save_as(buffer_t* self, char* path, bint_t* optret_nbytes) {
     // Remember stat
     _buffer_stat(self);
 
+    // Compact journal
+    _buffer_journal_truncate(self);
+
+    return MLBUF_OK;
+}
+
+// Publish a read-only snapshot of the buffer in a sealed memfd and return it
+// in ret_fd. Another local process can mmap the fd (e.g., after receiving it
+// over a unix socket) and read it without copying. The layout is a
+// buffer_export_header_t, then line_count uint64_t line start offsets, then
+// the data. Seals prevent anyone from changing it, so an export copies the
+// whole buffer into a new memfd. The last one is kept and shared until the
+// buffer version changes, so exporting an unchanged buffer is just a dup.
+// The caller owns ret_fd.
+int buffer_export_memfd(buffer_t* self, int* ret_fd) {
+#ifdef __linux__
+    int fd;
+    size_t size;
+    char* map;
+    buffer_export_header_t* header;
+    uint64_t* line_offsets;
+    char* data_cursor;
+    bline_t* bline;
+    bint_t i;
+
+    *ret_fd = -1;
+
+    // Reuse last export if nothing changed since
+    if (self->export_fd >= 0 && self->export_version == self->version) {
+        *ret_fd = fcntl(self->export_fd, F_DUPFD_CLOEXEC, 0);
+        return *ret_fd >= 0 ? MLBUF_OK : MLBUF_ERR;
+    }
+
+    size = sizeof(buffer_export_header_t) + (size_t)self->line_count * sizeof(uint64_t) + (size_t)self->byte_count;
+    if ((fd = memfd_create("mlbuf", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+        return MLBUF_ERR;
+    } else if (ftruncate(fd, size) != 0
+        || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED
+    ) {
+        close(fd);
+        return MLBUF_ERR;
+    }
+
+    // Fill header, line offsets, and data
+    header = (buffer_export_header_t*)map;
+    memcpy(header->magic, MLBUF_EXPORT_MAGIC, sizeof(header->magic));
+    header->version = (uint64_t)self->version;
+    header->byte_count = (uint64_t)self->byte_count;
+    header->line_count = (uint64_t)self->line_count;
+    header->line_offsets_offset = sizeof(buffer_export_header_t);
+    header->data_offset = header->line_offsets_offset + header->line_count * sizeof(uint64_t);
+    line_offsets = (uint64_t*)(map + header->line_offsets_offset);
+    data_cursor = map + header->data_offset;
+    for (bline = self->first_line, i = 0; bline; bline = bline->next, i++) {
+        line_offsets[i] = (uint64_t)(data_cursor - (map + header->data_offset));
+        if (bline->data_len > 0) {
+            memcpy(data_cursor, bline->data, bline->data_len);
+            data_cursor += bline->data_len;
+        }
+        if (bline->next) {
+            *data_cursor = '\n';
+            data_cursor += 1;
+        }
+    }
+    munmap(map, size);
+
+    // Seal it
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(fd);
+        return MLBUF_ERR;
+    }
+
+    // Keep it for the next export
+    if (self->export_fd >= 0) close(self->export_fd);
+    self->export_fd = fd;
+    self->export_version = self->version;
+    *ret_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    return *ret_fd >= 0 ? MLBUF_OK : MLBUF_ERR;
+#else
+    *ret_fd = -1;
+    return MLBUF_ERR;
+#endif
+}
+
+// Start writing buffer to path on a worker thread. A snapshot of the
+// contents is taken now so editing can continue while the save runs. Unedited
+// lines are referenced in the mmap, which stays alive until the save is
+// polled, and only edited lines are copied. Completion is reported via fn_cb
+// from buffer_save_async_poll. buffer_open waits for a pending save before
+// loading anything.
+int buffer_save_as_async(buffer_t* self, char* path, buffer_save_callback_t fn_cb, void* udata) {
+    buffer_save_job_t* job;
+    size_t arena_len;
+
+    // Exit early if path is empty or a save is in flight
+    if (!path || strlen(path) < 1 || self->save_job) {
+        return MLBUF_ERR;
+    }
+
+    // Make sure we are not about to truncate our own mmap
+    if (_buffer_mmap_detach(self, path) != MLBUF_OK) {
+        return MLBUF_ERR;
+    }
+
+    // Snapshot contents
+    job = calloc(1, sizeof(buffer_save_job_t));
+    job->path = strdup(path);
+    _buffer_snapshot(self, NULL, NULL, &job->iovcnt, &arena_len);
+    job->iov = malloc(sizeof(struct iovec) * (job->iovcnt + 1));
+    job->data = malloc(arena_len + 1);
+    _buffer_snapshot(self, job->iov, job->data, &job->iovcnt, &arena_len);
+    job->data_len = self->byte_count;
+    job->mmap_fd = -1;
+    job->version = self->version;
+    job->is_gzip = self->is_gzip;
+    job->callback = fn_cb;
+    job->callback_udata = udata;
+
+    if (pthread_create(&job->thread, NULL, _buffer_save_job_run, job) != 0) {
+        free(job->path);
+        free(job->iov);
+        free(job->data);
+        free(job);
+        return MLBUF_ERR;
+    }
+    self->save_job = job;
     return MLBUF_OK;
 }
 
+// Finish a background save if it is done, or wait for it if do_wait is set.
+// Path is updated on success. is_unsaved and st are updated only if the
+// buffer was not edited since the save started. Returns 1 if a save was
+// finished, otherwise 0.
+int buffer_save_async_poll(buffer_t* self, int do_wait) {
+    buffer_save_job_t* job;
+    int rc;
+
+    job = self->save_job;
+    if (!job || (!do_wait && !__atomic_load_n(&job->is_done, __ATOMIC_ACQUIRE))) {
+        return 0;
+    }
+    pthread_join(job->thread, NULL);
+    self->save_job = NULL;
+
+    rc = job->rc;
+    if (rc == MLBUF_OK && (bint_t)job->nbytes != job->data_len) rc = MLBUF_ERR;
+    if (rc == MLBUF_OK) {
+        if (!self->path || strcmp(self->path, job->path) != 0) {
+            if (self->path) free(self->path);
+            self->path = strdup(job->path);
+        }
+        if (self->version == job->version) {
+            self->is_unsaved = 0;
+            _buffer_stat(self);
+            _buffer_journal_truncate(self);
+        }
+    }
+    if (job->callback) {
+        job->callback(self, rc, (bint_t)job->nbytes, job->callback_udata);
+    }
+
+    if (job->mmap) {
+        munmap(job->mmap, job->mmap_len);
+        close(job->mmap_fd);
+    }
+    free(job->path);
+    free(job->iov);
+    free(job->data);
+    free(job);
+    return 1;
+}
+
 // Write buffer data to FILE*
 int buffer_write_to_file(buffer_t* self, FILE* fp, size_t* optret_nbytes) {
     return buffer_write_to_fd(self, fileno(fp), optret_nbytes);
 }
 
-// Write buffer data to file descriptor
+// Write buffer data to file descriptor, batching lines into writev calls.
+// Long runs of untouched mmapped lines are copied straight from the mapped
+// file.
 int buffer_write_to_fd(buffer_t* self, int fd, size_t* optret_nbytes) {
     bline_t* bline;
+    bline_t* run_end;
     size_t nbytes;
-    ssize_t write_rc;
+    struct iovec iov[MLBUF_IOV_MAX];
+    int iovcnt;
+    bint_t run_len;
+#ifdef MLBUF_IO_URING
+    int rc;
+    int flags;
+    struct stat st;
+    struct buffer_uring_s ring;
+
+    // Keep several batches of a regular file in flight if io_uring is there.
+    // Writes go to explicit offsets, which O_APPEND would ignore.
+    if (fstat(fd, &st) == 0
+        && S_ISREG(st.st_mode)
+        && (flags = fcntl(fd, F_GETFL)) >= 0
+        && !(flags & O_APPEND)
+        && _buffer_uring_init(&ring, MLBUF_URING_DEPTH) == MLBUF_OK
+    ) {
+        rc = _buffer_write_fd_uring(self, fd, &ring, optret_nbytes);
+        _buffer_uring_free(&ring);
+        return rc;
+    }
+#endif
     nbytes = 0;
-    #define MLBUF_BUFFER_WRITE_CHECK(pd, pl) do { \
-        write_rc = write(fd, (pd), (pl)); \
-        if (write_rc < (pl)) { \
-            return MLBUF_ERR; \
-        } \
-        nbytes += write_rc; \
-    } while(0)
+    iovcnt = 0;
+    run_end = NULL;
     for (bline = self->first_line; bline; bline = bline->next) {
-        if (bline->data_len > 0) MLBUF_BUFFER_WRITE_CHECK(bline->data, bline->data_len);
-        if (bline->next)         MLBUF_BUFFER_WRITE_CHECK("\n", 1);
+        // Look for a run unless we are inside a short one already
+        run_len = run_end ? 0 : _buffer_mmap_run(self, bline, &run_end);
+        if (run_len >= MLBUF_COPY_RANGE_MIN_SIZE) {
+            if (_buffer_writev_all(fd, iov, iovcnt, &nbytes) != MLBUF_OK
+                || _buffer_write_mmap_range(self, (size_t)(bline->data - self->mmap), (size_t)run_len, fd, &nbytes) != MLBUF_OK
+            ) {
+                return MLBUF_ERR;
+            }
+            iovcnt = 0;
+            bline = run_end;
+        } else if (bline->data_len > 0) {
+            iov[iovcnt++] = (struct iovec){ .iov_base = bline->data, .iov_len = bline->data_len };
+        }
+        if (bline == run_end) run_end = NULL;
+        if (bline->next) {
+            iov[iovcnt++] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+        }
+        if (iovcnt >= MLBUF_IOV_MAX - 1 || !bline->next) {
+            if (_buffer_writev_all(fd, iov, iovcnt, &nbytes) != MLBUF_OK) {
+                return MLBUF_ERR;
+            }
+            iovcnt = 0;
+        }
     }
     if (optret_nbytes) *optret_nbytes = nbytes;
     return MLBUF_OK;
@@ -196,6 +677,7 @@ int buffer_destroy(buffer_t* self) {
     baction_t* action;
     baction_t* action_tmp;
     char c;
+    buffer_save_async_poll(self, 1);
     for (line = self->last_line; line; ) {
         line_tmp = line->prev;
         _buffer_bline_free(line, NULL, 0);
@@ -203,6 +685,9 @@ int buffer_destroy(buffer_t* self) {
     }
     if (self->data) free(self->data);
     if (self->path) free(self->path);
+    if (self->index_dir) free(self->index_dir);
+    if (self->journal) fclose(self->journal);
+    if (self->export_fd >= 0) close(self->export_fd);
     DL_FOREACH_SAFE(self->actions, action, action_tmp) {
         DL_DELETE(self->actions, action);
         _baction_destroy(action);
@@ -215,6 +700,49 @@ int buffer_destroy(buffer_t* self) {
     return MLBUF_OK;
 }
 
+// Free a buffer on a background reaper thread. Styling rules are detached
+// and any pending save is finished before returning, so the caller may free
+// srules right away. Everything else is released in the background in
+// batches. Small buffers are freed right away.
+int buffer_destroy_async(buffer_t* self) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    int rc;
+
+    buffer_save_async_poll(self, 1);
+    if (self->line_count < MLBUF_REAP_MIN_LINES) {
+        return buffer_destroy(self);
+    }
+    _buffer_detach_srules(self);
+
+    pthread_mutex_lock(&reap_lock);
+    reap_count += 1;
+    pthread_mutex_unlock(&reap_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, _buffer_reap, self);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        pthread_mutex_lock(&reap_lock);
+        reap_count -= 1;
+        pthread_mutex_unlock(&reap_lock);
+        return buffer_destroy(self);
+    }
+    return MLBUF_OK;
+}
+
+// Wait until every buffer passed to buffer_destroy_async is freed, e.g.,
+// before exiting
+int buffer_destroy_async_wait() {
+    pthread_mutex_lock(&reap_lock);
+    while (reap_count > 0) {
+        pthread_cond_wait(&reap_cond, &reap_lock);
+    }
+    pthread_mutex_unlock(&reap_lock);
+    return MLBUF_OK;
+}
+
 // Add a mark to this buffer and return it
 mark_t* buffer_add_mark(buffer_t* self, bline_t* maybe_line, bint_t maybe_col) {
     return buffer_add_mark_ex(self, '\0', maybe_line, maybe_col);
@@ -275,7 +803,8 @@ int buffer_destroy_mark(buffer_t* self, mark_t* mark) {
     return MLBUF_OK;
 }
 
-// Get buffer contents and length
+// Get buffer contents and length. Once built, the contents are kept up to
+// date across edits by _buffer_update_data.
 int buffer_get(buffer_t* self, char** ret_data, bint_t* ret_data_len) {
     bline_t* bline;
     char* data_cursor;
@@ -286,6 +815,7 @@ int buffer_get(buffer_t* self, char** ret_data, bint_t* ret_data_len) {
         self->data = self->data != NULL
             ? realloc(self->data, alloc_size)
             : malloc(alloc_size);
+        self->data_cap = alloc_size;
         data_cursor = self->data;
         for (bline = self->first_line; bline != NULL; bline = bline->next) {
             if (bline->data_len > 0) {
@@ -301,107 +831,235 @@ int buffer_get(buffer_t* self, char** ret_data, bint_t* ret_data_len) {
         *data_cursor = '\0';
         self->data_len = (bint_t)(data_cursor - self->data);
         self->is_data_dirty = 0;
+        self->data_hint_line = self->first_line;
+        self->data_hint_offset = 0;
     }
+    self->is_data_read = 1;
     *ret_data = self->data;
     *ret_data_len = self->data_len;
     return MLBUF_OK;
 }
 
+// Call fn_cb with the contents of nlines lines starting at start_line, or
+// the whole buffer if start_line is NULL, without flattening. Each call gets
+// a pointer into line data and a length. is_eol is set if a newline follows
+// the chunk. Unedited mmapped lines are contiguous in memory and are passed
+// as one chunk, newlines included. Pass nlines < 0 to iterate to the end.
+// Stop early and return fn_cb's rc if it is not MLBUF_OK.
+int buffer_foreach_chunk(buffer_t* self, bline_t* start_line, bint_t nlines, buffer_chunk_callback_t fn_cb, void* udata) {
+    bline_t* bline;
+    bline_t* run_end;
+    int rc;
+    if (!start_line) start_line = self->first_line;
+    if (nlines < 0) nlines = self->line_count;
+    for (bline = start_line; bline && nlines > 0; bline = run_end->next) {
+        run_end = bline;
+        nlines -= 1;
+        while (nlines > 0
+            && run_end->is_data_slabbed
+            && run_end->next
+            && run_end->next->is_data_slabbed
+            && run_end->next->data == run_end->data + run_end->data_len + 1
+        ) {
+            run_end = run_end->next;
+            nlines -= 1;
+        }
+        rc = fn_cb(
+            self,
+            bline->data ? bline->data : "",
+            run_end == bline ? bline->data_len : (bint_t)((run_end->data + run_end->data_len) - bline->data),
+            run_end->next ? 1 : 0,
+            udata
+        );
+        if (rc != MLBUF_OK) {
+            return rc;
+        }
+    }
+    return MLBUF_OK;
+}
+
 int buffer_clear(buffer_t* self) {
     return buffer_delete(self, 0, self->byte_count);
 }
 
-// Set buffer contents
+// Set buffer contents. Lines are built directly from data without recording
+// an undo action. The undo stack is discarded.
 int buffer_set(buffer_t* self, char* data, bint_t data_len) {
-    int rc;
     MLBUF_MAKE_GT_EQ0(data_len);
-    if ((rc = buffer_clear(self)) != MLBUF_OK) {
-        return rc;
-    }
-    rc = buffer_insert(self, 0, data, data_len, NULL);
-    if (self->actions) _buffer_truncate_undo_stack(self, self->actions);
-    return rc;
+    _buffer_reset(self);
+    _buffer_journal_write(self, MLBUF_JOURNAL_TYPE_CLEAR, 0, 0, 0, NULL, 0);
+    _buffer_journal_write(self, MLBUF_BACTION_TYPE_INSERT, 0, 0, 0, data, data_len);
+    return _buffer_append(self, data, data_len);
 }
 
 // Set buffer contents more efficiently
 int buffer_set_mmapped(buffer_t* self, char* data, bint_t data_len) {
+    int rc;
+    rc = _buffer_set_mmapped_w_offsets(self, data, data_len, NULL, 0);
+    if (rc == MLBUF_OK) {
+        _buffer_journal_write(self, MLBUF_JOURNAL_TYPE_CLEAR, 0, 0, 0, NULL, 0);
+        _buffer_journal_write(self, MLBUF_BACTION_TYPE_INSERT, 0, 0, 0, data, data_len);
+    }
+    return rc;
+}
+
+// Append each edit to an edit journal at path so unsaved changes survive a
+// crash without full saves. Records are buffered; call buffer_journal_flush
+// to push them to the file. The journal is truncated whenever the buffer is
+// opened or saved. To recover after a crash, open the original file, call
+// buffer_journal_recover, then re-enable the journal. Pass NULL to disable.
+int buffer_set_journal(buffer_t* self, char* path) {
+    struct stat st;
+    int fd;
+    if (self->journal) {
+        fclose(self->journal);
+        self->journal = NULL;
+    }
+    self->is_journal_failed = 0;
+    if (!path) {
+        return MLBUF_OK;
+    }
+
+    // Not O_APPEND, so _buffer_journal_rebase can rewrite the header
+    if ((fd = open(path, O_RDWR | O_CREAT, 0666)) < 0) {
+        return MLBUF_ERR;
+    } else if (!(self->journal = fdopen(fd, "r+b"))) {
+        close(fd);
+        return MLBUF_ERR;
+    }
+    setvbuf(self->journal, NULL, _IOFBF, MLBUF_JOURNAL_BUFFER_SIZE);
+    fseek(self->journal, 0, SEEK_END);
+    if (fstat(fileno(self->journal), &st) < 0) {
+        fclose(self->journal);
+        self->journal = NULL;
+        return MLBUF_ERR;
+    } else if (st.st_size == 0) {
+        return _buffer_journal_truncate(self);
+    }
+    return MLBUF_OK;
+}
+
+// Flush buffered journal records to the journal file. If do_sync is set,
+// also wait for them to reach the disk. Fails if any record could not be
+// written since the journal was last truncated, as it is then incomplete.
+int buffer_journal_flush(buffer_t* self, int do_sync) {
+    if (!self->journal) {
+        return MLBUF_ERR;
+    }
+    if (fflush(self->journal) != 0 || self->is_journal_failed) {
+        return MLBUF_ERR;
+    } else if (do_sync && fdatasync(fileno(self->journal)) != 0) {
+        return MLBUF_ERR;
+    }
+    return MLBUF_OK;
+}
+
+// Replay the edit journal at path onto the buffer. The buffer must hold the
+// file the journal was recorded against, as of its last open or save. A
+// partial record at the end, e.g., from a crash mid-write, is ignored.
+int buffer_journal_recover(buffer_t* self, char* path) {
+    FILE* fp;
+    struct buffer_journal_header_s header;
+    struct buffer_journal_record_s record;
+    bline_t* bline;
+    bint_t* perm;
     bint_t nlines;
-    bint_t line_num;
-    bline_t* blines;
-    bint_t data_remaining_len;
-    char* data_cursor;
-    char* data_newline;
-    bint_t line_len;
+    bint_t line_start;
+    bint_t col;
+    char* data;
+    int rc;
 
-    if (buffer_clear(self) != MLBUF_OK) {
+    if (!(fp = fopen(path, "rb"))) {
         return MLBUF_ERR;
     }
 
-    // Count number of lines
-    nlines = 1;
-    data_cursor = data;
-    data_remaining_len = data_len;
-    while (data_remaining_len > 0 && (data_newline = memchr(data_cursor, '\n', data_remaining_len)) != NULL) {
-        data_remaining_len -= (bint_t)(data_newline - data_cursor) + 1;
-        data_cursor = data_newline + 1;
-        nlines += 1;
+    // Make sure journal matches buffer
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, MLBUF_JOURNAL_MAGIC, sizeof(header.magic)) != 0
+        || header.size != (uint64_t)self->st.st_size
+        || header.mtime_sec != (int64_t)self->st.st_mtim.tv_sec
+        || header.mtime_nsec != (int64_t)self->st.st_mtim.tv_nsec
+        || header.base_size > header.size
+        || (header.base_size < header.size && (bint_t)header.size != self->byte_count)
+    ) {
+        fclose(fp);
+        return MLBUF_ERR;
     }
 
-    // Allocate blines and chars. These are freed in buffer_destroy.
-    self->slabbed_chars = calloc(data_len, sizeof(bline_char_t));
-    self->slabbed_blines = malloc(nlines * sizeof(bline_t));
-    blines = self->slabbed_blines;
+    // Drop bytes followed after the base. The records insert them again.
+    self->is_in_journal_replay = 1;
+    if (header.base_size < header.size) {
+        line_start = self->byte_count - self->last_line->data_len;
+        for (bline = self->last_line; line_start > (bint_t)header.base_size; bline = bline->prev) {
+            line_start -= bline->prev->data_len + 1;
+        }
+        bline_get_col(bline, (bint_t)header.base_size - line_start, &col);
+        buffer_delete_w_bline(self, bline, col, self->byte_count);
+    }
 
-    // Populate blines
-    line_num = 0;
-    data_cursor = data;
-    data_remaining_len = data_len;
-    while (1) {
-        data_newline = data_remaining_len > 0
-            ? memchr(data_cursor, '\n', data_remaining_len)
-            : NULL;
-        line_len = data_newline ?
-            (bint_t)(data_newline - data_cursor)
-            : data_remaining_len;
-        blines[line_num] = (bline_t){
-            .buffer = self,
-            .data = data_cursor,
-            .data_len = line_len,
-            .data_cap = line_len,
-            .line_index = line_num,
-            .char_count = line_len,
-            .char_vwidth = line_len,
-            .chars = (self->slabbed_chars + (data_len - data_remaining_len)),
-            .chars_cap = line_len,
-            .marks = NULL,
-            .bol_rule = NULL,
-            .eol_rule = NULL,
-            .is_chars_dirty = 1,
-            .is_slabbed = 1,
-            .is_data_slabbed = 1,
-            .next = NULL,
-            .prev = NULL
-        };
-        if (line_num > 0) {
-            blines[line_num-1].next = blines + line_num;
-            blines[line_num].prev = blines + (line_num-1);
+    // Replay records
+    rc = MLBUF_OK;
+    data = NULL;
+    while (rc == MLBUF_OK && fread(&record, sizeof(record), 1, fp) == 1) {
+        if (record.data_len < 0) {
+            rc = MLBUF_ERR;
+            break;
         }
-        if (data_newline) {
-            data_remaining_len -= line_len + 1;
-            data_cursor = data_newline + 1;
-            line_num += 1;
-        } else {
+        data = realloc(data, record.data_len + 1);
+        if (record.data_len > 0 && fread(data, record.data_len, 1, fp) != 1) {
             break;
         }
+        if (record.type == MLBUF_JOURNAL_TYPE_CLEAR) {
+            rc = buffer_set(self, "", 0);
+            continue;
+        }
+        bline = NULL;
+        buffer_get_bline(self, (bint_t)record.line_index, &bline);
+        if (!bline || !_buffer_journal_is_record_valid(&record, data)) {
+            rc = MLBUF_ERR;
+        } else if (record.type == MLBUF_BACTION_TYPE_INSERT) {
+            rc = buffer_insert_w_bline(self, bline, (bint_t)record.col, data, (bint_t)record.data_len, NULL);
+        } else if (record.type == MLBUF_BACTION_TYPE_DELETE) {
+            rc = buffer_delete_w_bline(self, bline, (bint_t)record.col, (bint_t)record.nchars);
+        } else if (record.type == MLBUF_BACTION_TYPE_PERMUTE) {
+            perm = malloc(record.data_len);
+            memcpy(perm, data, record.data_len);
+            rc = _buffer_permute_lines(self, bline, (bint_t)record.data_len / sizeof(bint_t), perm);
+        } else if (record.type == MLBUF_BACTION_TYPE_JOIN) {
+            nlines = ((bint_t*)data)[0];
+            rc = _buffer_join_lines(self, bline, nlines, data + sizeof(bint_t) * (nlines + 1), (bint_t)record.data_len - sizeof(bint_t) * (nlines + 1));
+        } else if (record.type == MLBUF_BACTION_TYPE_SPLIT) {
+            rc = _buffer_split_line(self, bline, data, (bint_t)record.data_len);
+        } else {
+            rc = MLBUF_ERR;
+        }
     }
+    self->is_in_journal_replay = 0;
 
-    if (self->first_line) _buffer_bline_free(self->first_line, NULL, 0);
-    self->first_line = blines;
-    self->last_line = blines + line_num;
-    self->byte_count = data_len;
-    self->line_count = line_num + 1;
-    self->is_data_dirty = 1;
-    return MLBUF_OK;
+    if (data) free(data);
+    fclose(fp);
+    return rc;
+}
+
+// Set how buffer_open loads files. strategy is one of
+// MLBUF_OPEN_STRATEGY_*. With MLBUF_OPEN_STRATEGY_AUTO, regular files of at
+// least mmap_min_size bytes are mmapped, usually from a tmp copy. See
+// _buffer_open_strategy.
+int buffer_set_open_strategy(buffer_t* self, int strategy, bint_t mmap_min_size) {
+    if (strategy < MLBUF_OPEN_STRATEGY_AUTO || strategy > MLBUF_OPEN_STRATEGY_MMAP_SHARED) {
+        return MLBUF_ERR;
+    }
+    MLBUF_MAKE_GT_EQ0(mmap_min_size);
+    self->open_strategy = strategy;
+    self->open_mmap_min_size = mmap_min_size;
+    return MLBUF_OK;
+}
+
+// Set sidecar line index directory. Pass in NULL to disable line indexes.
+int buffer_set_index_dir(buffer_t* self, char* dir) {
+    if (self->index_dir) free(self->index_dir);
+    self->index_dir = dir ? strdup(dir) : NULL;
+    return MLBUF_OK;
 }
 
 // Insert data into buffer given a buffer offset
@@ -423,14 +1081,8 @@ int buffer_insert(buffer_t* self, bint_t offset, char* data, bint_t data_len, bi
 int buffer_insert_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, char* data, bint_t data_len, bint_t* optret_num_chars) {
     bline_t* cur_line;
     bint_t cur_col;
-    bline_t* new_line;
-    char* data_cursor;
-    char* data_newline;
-    bint_t data_remaining_len;
-    bint_t insert_len;
     bint_t num_lines_added;
     char* ins_data;
-    bint_t ins_data_len;
     bint_t ins_data_nchars;
     baction_t* action;
     MLBUF_MAKE_GT_EQ0(data_len);
@@ -440,30 +1092,25 @@ int buffer_insert_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col,
         return MLBUF_OK;
     }
 
-    // Insert lines
-    data_cursor = data;
-    data_remaining_len = data_len;
-    cur_line = start_line;
-    cur_col = start_col;
-    num_lines_added = 0;
-    while (data_remaining_len > 0 && (data_newline = memchr(data_cursor, '\n', data_remaining_len)) != NULL) {
-        insert_len = (bint_t)(data_newline - data_cursor);
-        new_line = _buffer_bline_break(cur_line, cur_col);
-        num_lines_added += 1;
-        if (insert_len > 0) {
-            _buffer_bline_insert(cur_line, cur_col, data_cursor, insert_len, 1);
-        }
-        data_remaining_len -= (data_newline - data_cursor) + 1;
-        data_cursor = data_newline + 1;
-        cur_line = new_line;
-        cur_col = 0;
-    }
-    if (data_remaining_len > 0) {
-        cur_col += _buffer_bline_insert(cur_line, cur_col, data_cursor, data_remaining_len, 1);
+    // Clamp start_col so the action records where data actually goes
+    MLBUF_BLINE_ENSURE_CHARS(start_line);
+    start_col = MLBUF_MAX(0, MLBUF_MIN(start_col, start_line->char_count));
+
+    // Insert data. Multi-line data breaks start_line once and builds the new
+    // lines directly so large pastes stay linear.
+    if (memchr(data, '\n', data_len)) {
+        cur_line = _buffer_bline_insert_lines(start_line, start_col, data, data_len, &cur_col, &num_lines_added, &ins_data_nchars);
+    } else {
+        cur_line = start_line;
+        ins_data_nchars = _buffer_bline_insert(start_line, start_col, data, data_len, 1);
+        cur_col = start_col + ins_data_nchars;
+        num_lines_added = 0;
     }
 
-    // Get inserted data
-    buffer_substr(self, start_line, start_col, cur_line, cur_col, &ins_data, &ins_data_len, &ins_data_nchars);
+    // Copy inserted data
+    ins_data = malloc(data_len + 1);
+    memcpy(ins_data, data, data_len);
+    ins_data[data_len] = '\0';
 
     // Add baction
     action = calloc(1, sizeof(baction_t));
@@ -475,11 +1122,11 @@ int buffer_insert_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col,
     action->maybe_end_line = cur_line;
     action->maybe_end_line_index = action->start_line_index + num_lines_added;
     action->maybe_end_col = cur_col;
-    action->byte_delta = (bint_t)ins_data_len;
-    action->char_delta = (bint_t)ins_data_nchars;
-    action->line_delta = (bint_t)num_lines_added;
+    action->byte_delta = data_len;
+    action->char_delta = ins_data_nchars;
+    action->line_delta = num_lines_added;
     action->data = ins_data;
-    action->data_len = ins_data_len;
+    action->data_len = data_len;
     _buffer_update(self, action);
     if (optret_num_chars) *optret_num_chars = ins_data_nchars;
 
@@ -512,6 +1159,10 @@ int buffer_delete_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col,
     baction_t* action;
     MLBUF_MAKE_GT_EQ0(num_chars);
 
+    // Clamp start_col so the action records where the delete starts
+    MLBUF_BLINE_ENSURE_CHARS(start_line);
+    start_col = MLBUF_MAX(0, MLBUF_MIN(start_col, start_line->char_count));
+
     // Find end line and col
     _buffer_find_end_pos(start_line, start_col, num_chars, &end_line, &end_col, &num_chars);
 
@@ -523,6 +1174,15 @@ int buffer_delete_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col,
         return MLBUF_OK;
     }
 
+    // Detach many whole lines instead of copying and freeing them
+    num_lines_removed = 0;
+    for (tmp_line = start_line; tmp_line != end_line; tmp_line = tmp_line->next) {
+        num_lines_removed += 1;
+    }
+    if (num_lines_removed >= MLBUF_DETACH_MIN_LINES) {
+        return _buffer_detach_lines(self, start_line, start_col, end_line, end_col, num_chars, num_lines_removed, NULL);
+    }
+
     // Get deleted data
     buffer_substr(self, start_line, start_col, end_line, end_col, &del_data, &del_data_len, &del_data_nchars);
 
@@ -593,180 +1253,1271 @@ int buffer_replace(buffer_t* self, bint_t offset, bint_t num_chars, char* data,
     return buffer_replace_w_bline(self, start_line, start_col, num_chars, data, data_len);
 }
 
-// Replace num_chars from start_line:start_col with data
-int buffer_replace_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, bint_t del_chars, char* data, bint_t data_len) {
-    bline_t* cur_line;
-    bint_t cur_col;
-    bint_t insert_rem;
-    bint_t delete_rem;
-    bint_t data_linelen;
-    bint_t nchars_ins;
-    bint_t nlines;
-    char* data_cursor;
-    char* data_newline;
+// Overwrite data_len bytes at offset with data in place. The replaced text
+// must have the same byte and char length as data and lie within one line.
+// On a buffer opened with MLBUF_OPEN_STRATEGY_MMAP_SHARED, unedited lines
+// are written straight into the shared mapping, so line lengths and char
+// indexes stay valid and buffer_save only has to msync the dirtied pages.
+// Note that the file sees the new bytes before the save. Otherwise this
+// falls back to buffer_replace.
+int buffer_overwrite(buffer_t* self, bint_t offset, char* data, bint_t data_len) {
+    bline_t* bline;
+    bint_t col;
+    bint_t nchars;
+    bint_t start_index;
+    bint_t end_index;
+    size_t mmap_off;
     baction_t* action;
-    str_t del_data = {0};
+    baction_t* del_action;
+    MLBUF_MAKE_GT_EQ0(offset);
+    MLBUF_MAKE_GT_EQ0(data_len);
 
-    // Replace data on common lines
-    insert_rem = data_len;
-    delete_rem = del_chars;
-    cur_line = start_line;
-    cur_col = start_col;
-    data_cursor = data;
-    nchars_ins = 0;
-    nlines = 0;
-    MLBUF_BLINE_ENSURE_CHARS(cur_line);
-    while (insert_rem > 0 && delete_rem > (cur_line->char_count - cur_col)) {
-        data_newline = memchr(data_cursor, '\n', insert_rem);
-        data_linelen = data_newline ? (bint_t)(data_newline - data_cursor) : insert_rem;
-        delete_rem -= cur_line->char_count - cur_col;
-        _buffer_bline_replace(cur_line, cur_col, data_cursor, data_linelen, &del_data);
-        nchars_ins += cur_line->char_count - cur_col;
-        insert_rem -= data_linelen;
-        data_cursor += data_linelen;
-        cur_col = cur_line->char_count;
-        if (data_newline && insert_rem >= 2 && delete_rem >= 2 && cur_line->next) {
-            data_cursor += 1;
-            insert_rem -= 1;
-            delete_rem -= 1;
-            cur_line = cur_line->next;
-            cur_col = 0;
-            nchars_ins += 1;
-            str_append_len(&del_data, "\n", 1);
-        } else {
-            break;
-        }
-        nlines += 1;
-        MLBUF_BLINE_ENSURE_CHARS(cur_line);
+    if (data_len < 1) {
+        return MLBUF_OK;
+    } else if (memchr(data, '\n', data_len)) {
+        return MLBUF_ERR;
+    } else if (buffer_get_bline_col(self, offset, &bline, &col) != MLBUF_OK) {
+        return MLBUF_ERR;
     }
 
-    // Add delete baction
-    if (del_data.len > 0) {
-        action = calloc(1, sizeof(baction_t));
-        action->type = MLBUF_BACTION_TYPE_DELETE;
-        action->buffer = self;
-        action->start_line = start_line;
-        action->start_line_index = start_line->line_index;
-        action->start_col = start_col;
-        action->byte_delta = -1 * del_data.len;
-        action->char_delta = -1 * (del_chars - delete_rem);
-        action->line_delta = -1 * nlines;
-        action->data = del_data.data;
-        action->data_len = del_data.len;
-        _buffer_update(self, action);
+    // Make sure replaced text is the same size as data
+    nchars = _buffer_count_chars(data, data_len);
+    MLBUF_BLINE_ENSURE_CHARS(bline);
+    if (col + nchars > bline->char_count) {
+        return MLBUF_ERR;
+    }
+    start_index = _buffer_bline_col_to_index(bline, col);
+    end_index = _buffer_bline_col_to_index(bline, col + nchars);
+    if (end_index - start_index != data_len) {
+        return MLBUF_ERR;
     }
 
-    // Add insert baction
-    if (data_len - insert_rem > 0) {
-        action = calloc(1, sizeof(baction_t));
-        action->type = MLBUF_BACTION_TYPE_INSERT;
-        action->buffer = self;
-        action->start_line = start_line;
-        action->start_line_index = start_line->line_index;
-        action->start_col = start_col;
-        action->maybe_end_line = cur_line;
-        action->maybe_end_line_index = action->start_line_index + nlines;
-        action->maybe_end_col = cur_col;
-        action->byte_delta = data_len - insert_rem;
-        action->char_delta = nchars_ins;
-        action->line_delta = nlines;
-        action->data = strndup(data, action->byte_delta);
-        action->data_len = action->byte_delta;
-        _buffer_update(self, action);
+    // Fall back to replace unless line data lives in the shared mmap and no
+    // background save is reading it
+    if (!self->is_mmap_shared || !bline->is_data_slabbed || self->save_job) {
+        return buffer_replace_w_bline(self, bline, col, nchars, data, data_len);
     }
 
-    // Delete left over data
-    if (delete_rem > 0) {
-        buffer_delete_w_bline(self, cur_line, cur_col, delete_rem);
+    // Add delete baction for the old bytes
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_DELETE;
+    action->buffer = self;
+    action->start_line = bline;
+    action->start_line_index = bline->line_index;
+    action->start_col = col;
+    action->byte_delta = -1 * data_len;
+    action->char_delta = -1 * nchars;
+    action->data = malloc(data_len);
+    action->data_len = data_len;
+    memcpy(action->data, bline->data + start_index, data_len);
+
+    // Write new bytes into the mapping and note the dirty range
+    memcpy(bline->data + start_index, data, data_len);
+    bline->is_chars_dirty = 1;
+    mmap_off = (size_t)(bline->data + start_index - self->mmap);
+    if (self->mmap_dirty_end <= self->mmap_dirty_start) {
+        self->mmap_dirty_start = mmap_off;
+        self->mmap_dirty_end = mmap_off + data_len;
+    } else {
+        self->mmap_dirty_start = MLBUF_MIN(self->mmap_dirty_start, mmap_off);
+        self->mmap_dirty_end = MLBUF_MAX(self->mmap_dirty_end, mmap_off + data_len);
     }
+    _buffer_update(self, action);
+    del_action = self->action_tail;
 
-    // Insert left over data
-    if (insert_rem > 0) {
-        buffer_insert_w_bline(self, cur_line, cur_col, data_cursor, insert_rem, NULL);
+    // Add insert baction for the new bytes
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_INSERT;
+    action->buffer = self;
+    action->start_line = bline;
+    action->start_line_index = bline->line_index;
+    action->start_col = col;
+    action->maybe_end_line = bline;
+    action->maybe_end_line_index = bline->line_index;
+    action->maybe_end_col = col + nchars;
+    action->byte_delta = data_len;
+    action->char_delta = nchars;
+    action->data = malloc(data_len);
+    action->data_len = data_len;
+    memcpy(action->data, data, data_len);
+    _buffer_update(self, action);
+
+    // Group the delete and insert for undo
+    if (!self->action_group && del_action && self->action_tail != del_action) {
+        del_action->group = self->action_tail->group = ++self->num_action_groups;
     }
 
     return MLBUF_OK;
 }
 
-// Return a line given a line_index
-int buffer_get_bline(buffer_t* self, bint_t line_index, bline_t** ret_bline) {
+// Apply nedits edits in one forward pass. Each edit replaces num_chars
+// chars at offset with data. Offsets refer to the buffer before any edits
+// and must be sorted and non-overlapping. Offsets past the end of the
+// buffer are clamped to the end. Lines are renumbered and restyled
+// once, the callback gets one MLBUF_BACTION_TYPE_BATCH action summarizing
+// the batch, and a single undo or redo reverts or reapplies all of it.
+int buffer_apply_edits(buffer_t* self, buffer_edit_t* edits, bint_t nedits) {
+    bline_t* cur_line;
+    bline_t* first_line;
+    bline_t* last_line;
     bline_t* tmp_line;
-    MLBUF_MAKE_GT_EQ0(line_index);
-    for (tmp_line = self->first_line; tmp_line; tmp_line = tmp_line->next) {
-        if (tmp_line->line_index == line_index) {
-            *ret_bline = tmp_line;
-            return MLBUF_OK;
+    bint_t cur_line_offset;
+    bint_t offset;
+    bint_t shift;
+    bint_t ins_nchars;
+    bint_t i;
+    bint_t orig_byte_count;
+    bint_t orig_line_count;
+    bint_t first_line_index;
+    bint_t span;
+    baction_t batch;
+    int rc;
+
+    if (nedits < 1) {
+        return MLBUF_OK;
+    }
+    for (i = 1; i < nedits; i++) {
+        if (edits[i].offset < edits[i - 1].offset + edits[i - 1].num_chars) {
+            return MLBUF_ERR;
         }
     }
-    *ret_bline = self->last_line;
-    return MLBUF_ERR;
-}
 
-// Return a line and col for the given offset
-int buffer_get_bline_col(buffer_t* self, bint_t offset, bline_t** ret_bline, bint_t* ret_col) {
-    bline_t* tmp_line;
-    bline_t* good_line = NULL;
-    bint_t remaining_chars;
-    MLBUF_MAKE_GT_EQ0(offset);
+    self->action_group = ++self->num_action_groups;
+    self->is_data_dirty = 1;
+    orig_byte_count = self->byte_count;
+    orig_line_count = self->line_count;
+    cur_line = self->first_line;
+    cur_line_offset = 0;
+    first_line = NULL;
+    last_line = NULL;
+    shift = 0;
+    rc = MLBUF_OK;
+    for (i = 0; i < nedits && rc == MLBUF_OK; i++) {
+        // Walk to edit, renumbering lines behind earlier edits as we go
+        offset = MLBUF_MAX(0, edits[i].offset) + shift;
+        MLBUF_BLINE_ENSURE_CHARS(cur_line);
+        while (offset > cur_line_offset + cur_line->char_count && cur_line->next) {
+            cur_line_offset += cur_line->char_count + 1;
+            cur_line->next->line_index = cur_line->line_index + 1;
+            cur_line = cur_line->next;
+            MLBUF_BLINE_ENSURE_CHARS(cur_line);
+        }
+        offset = MLBUF_MIN(offset, cur_line_offset + cur_line->char_count);
+        if (!first_line) first_line = cur_line;
 
-    remaining_chars = offset;
-    for (tmp_line = self->first_line; tmp_line != NULL; tmp_line = tmp_line->next) {
-        MLBUF_BLINE_ENSURE_CHARS(tmp_line);
-        if (tmp_line->char_count >= remaining_chars) {
-            *ret_bline = tmp_line;
-            *ret_col = remaining_chars;
-            return MLBUF_OK;
-        } else {
-            remaining_chars -= (tmp_line->char_count + 1); // Plus 1 for newline
+        // Apply edit
+        ins_nchars = 0;
+        if (edits[i].num_chars > 0) {
+            rc = buffer_delete_w_bline(self, cur_line, offset - cur_line_offset, edits[i].num_chars);
         }
-        good_line = tmp_line;
+        if (rc == MLBUF_OK && edits[i].data_len > 0) {
+            rc = buffer_insert_w_bline(self, cur_line, offset - cur_line_offset, edits[i].data, edits[i].data_len, &ins_nchars);
+        }
+        last_line = ins_nchars > 0 ? self->action_tail->maybe_end_line : cur_line;
+        shift += ins_nchars - edits[i].num_chars;
     }
 
-    if (!good_line) good_line = self->first_line;
-    *ret_bline = good_line;
-    *ret_col = good_line->char_count;
-    return MLBUF_OK;
+    // Renumber lines after the last edit. Untouched lines are all off by the
+    // same amount, so stop at the first one that is already in order.
+    for (tmp_line = cur_line; tmp_line->next && tmp_line->next->line_index != tmp_line->line_index + 1; tmp_line = tmp_line->next) {
+        tmp_line->next->line_index = tmp_line->line_index + 1;
+    }
+    if (!tmp_line->next) self->last_line = tmp_line;
+    self->action_group = 0;
+
+    if (!first_line) {
+        return rc;
+    }
+
+    // Restyle union of touched lines
+    first_line_index = first_line->line_index;
+    span = last_line->line_index - first_line_index;
+    buffer_apply_styles(self, first_line, span > 0 ? span : (self->line_count < orig_line_count ? -1 : 0));
+
+    // Raise one event on listener
+    if (self->callback && !self->is_in_callback) {
+        batch = (baction_t){
+            .type = MLBUF_BACTION_TYPE_BATCH,
+            .buffer = self,
+            .start_line = first_line,
+            .start_line_index = first_line_index,
+            .start_col = 0,
+            .maybe_end_line = last_line,
+            .maybe_end_line_index = last_line->line_index,
+            .byte_delta = self->byte_count - orig_byte_count,
+            .line_delta = self->line_count - orig_line_count,
+        };
+        self->is_in_callback = 1;
+        self->callback(self, &batch, self->callback_udata);
+        self->is_in_callback = 0;
+    }
+
+    return rc;
 }
 
-// Return an offset given a line and col
-int buffer_get_offset(buffer_t* self, bline_t* bline, bint_t col, bint_t* ret_offset) {
-    bline_t* tmp_line;
-    bint_t offset;
-    MLBUF_MAKE_GT_EQ0(col);
+// Replace all matches of cre with repl, which may contain backrefs. Each line
+// is scanned once and the result is applied as one batch of edits.
+int buffer_replace_all(buffer_t* self, pcre* cre, char* repl, bint_t* optret_num_replaced) {
+    bline_t* bline;
+    char* subj;
+    char* data_cursor;
+    bint_t subj_len;
+    bint_t line_offset;
+    bint_t look_offset;
+    bint_t match_start;
+    bint_t match_end;
+    bint_t repl_start;
+    bint_t start_col;
+    bint_t end_col;
+    bint_t num_replaced;
+    bint_t nedits;
+    bint_t edits_cap;
+    bint_t i;
+    buffer_edit_t* edits;
+    int ovector[MLBUF_REPLACE_ALL_OVECTOR_SIZE];
+    int rc;
+    str_t repl_data = {0};
+    MLBUF_INIT_PCRE_EXTRA(pcre_extra);
+
+    edits = NULL;
+    nedits = 0;
+    edits_cap = 0;
+    num_replaced = 0;
+    line_offset = 0;
+    for (bline = self->first_line; bline; bline = bline->next) {
+        subj = bline->data ? bline->data : "";
+        subj_len = bline->data_len;
+        look_offset = 0;
+        match_start = -1;
+        match_end = 0;
+        repl_start = repl_data.len;
+        while (look_offset <= subj_len
+            && (rc = pcre_exec(cre, &pcre_extra, subj, subj_len, look_offset, 0, ovector, MLBUF_REPLACE_ALL_OVECTOR_SIZE)) >= 0
+        ) {
+            if (rc == 0) rc = MLBUF_REPLACE_ALL_OVECTOR_SIZE / 3;
+            if (match_start < 0) {
+                match_start = ovector[0];
+            } else {
+                str_append_stop(&repl_data, subj + match_end, subj + ovector[0]);
+            }
+            str_append_replace_with_backrefs(&repl_data, subj, repl, rc, ovector, MLBUF_REPLACE_ALL_OVECTOR_SIZE);
+            match_end = ovector[1];
+            num_replaced += 1;
+            if (ovector[1] > ovector[0]) {
+                look_offset = ovector[1];
+            } else if (ovector[1] < subj_len) {
+                look_offset = ovector[1] + utf8_char_length(subj[ovector[1]]);
+            } else {
+                break;
+            }
+        }
 
-    offset = 0;
-    for (tmp_line = self->first_line; tmp_line != bline->next; tmp_line = tmp_line->next) {
-        MLBUF_BLINE_ENSURE_CHARS(tmp_line);
-        if (tmp_line == bline) {
-            offset += MLBUF_MIN(tmp_line->char_count, col);
-            break;
-        } else {
-            offset += tmp_line->char_count + 1; // Plus 1 for newline
+        // Add one edit spanning first through last match on line
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        if (match_start >= 0) {
+            if (nedits >= edits_cap) {
+                edits_cap = edits_cap ? edits_cap * 2 : 64;
+                edits = realloc(edits, sizeof(buffer_edit_t) * edits_cap);
+            }
+            bline_get_col(bline, match_start, &start_col);
+            bline_get_col(bline, match_end, &end_col);
+            edits[nedits].offset = line_offset + start_col;
+            edits[nedits].num_chars = end_col - start_col;
+            edits[nedits].data = NULL;
+            edits[nedits].data_len = repl_data.len - repl_start;
+            nedits += 1;
         }
+        line_offset += bline->char_count + 1;
     }
 
-    *ret_offset = offset;
-    return MLBUF_OK;
+    // Point edits at their replacement data now that it will not move
+    data_cursor = repl_data.data;
+    for (i = 0; i < nedits; i++) {
+        edits[i].data = data_cursor;
+        data_cursor += edits[i].data_len;
+    }
+
+    rc = buffer_apply_edits(self, edits, nedits);
+    if (optret_num_replaced) *optret_num_replaced = num_replaced;
+    if (edits) free(edits);
+    str_free(&repl_data);
+    return rc;
 }
 
-// Add a style rule to the buffer
-int buffer_add_srule(buffer_t* self, srule_t* srule) {
-    srule_node_t* node;
-    node = calloc(1, sizeof(srule_node_t));
-    node->srule = srule;
-    if (srule->type == MLBUF_SRULE_TYPE_SINGLE) {
-        DL_APPEND(self->single_srules, node);
-    } else {
-        DL_APPEND(self->multi_srules, node);
+// Insert data at vcol on every line from start_line thru end_line. Lines
+// shorter than vcol are padded with spaces.
+int buffer_insert_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t vcol, char* data, bint_t data_len) {
+    return _buffer_edit_block(self, start_line, end_line, vcol, vcol, data, data_len, 1);
+}
+
+// Delete chars starting within start_vcol thru end_vcol (exclusive) on every
+// line from start_line thru end_line
+int buffer_delete_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol) {
+    return _buffer_edit_block(self, start_line, end_line, start_vcol, end_vcol, NULL, 0, 0);
+}
+
+// Replace a vcol block with data as one batch of edits
+static int _buffer_edit_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol, char* data, bint_t data_len, int do_pad) {
+    bline_t* bline;
+    buffer_edit_t* edits;
+    bint_t nedits;
+    bint_t offset;
+    bint_t start_col;
+    bint_t end_col;
+    bint_t pad;
+    bint_t i;
+    char* pad_cursor;
+    int rc;
+    str_t pad_data = {0};
+
+    if (end_line->line_index < start_line->line_index) {
+        bline = start_line;
+        start_line = end_line;
+        end_line = bline;
     }
-    if (srule->type == MLBUF_SRULE_TYPE_RANGE) {
-        srule->range_a->range_srule = srule;
-        srule->range_b->range_srule = srule;
+    MLBUF_MAKE_GT_EQ0(start_vcol);
+    end_vcol = MLBUF_MAX(start_vcol, end_vcol);
+    edits = malloc(sizeof(buffer_edit_t) * (end_line->line_index - start_line->line_index + 1));
+    nedits = 0;
+    buffer_get_offset(self, start_line, 0, &offset);
+    for (bline = start_line; bline; bline = bline->next) {
+        bline_get_col_from_vcol(bline, start_vcol, &start_col);
+        bline_get_col_from_vcol(bline, end_vcol, &end_col);
+        pad = do_pad ? start_vcol - bline->char_vwidth : 0;
+        if (pad > 0 || end_col > start_col || data_len > 0) {
+            edits[nedits].offset = offset + start_col;
+            edits[nedits].num_chars = end_col - start_col;
+            edits[nedits].data = data;
+            edits[nedits].data_len = data_len;
+            if (pad > 0) {
+                // Padded data is pointed at below once pad_data stops moving
+                for (i = 0; i < pad; i++) str_append_char(&pad_data, ' ');
+                str_append_len(&pad_data, data, data_len);
+                edits[nedits].data = NULL;
+                edits[nedits].data_len = pad + data_len;
+            }
+            nedits += 1;
+        }
+        offset += bline->char_count + 1;
+        if (bline == end_line) break;
     }
-    return buffer_apply_styles(self, self->first_line, self->line_count - 1);
+    pad_cursor = pad_data.data;
+    for (i = 0; i < nedits; i++) {
+        if (edits[i].data) continue;
+        edits[i].data = pad_cursor;
+        pad_cursor += edits[i].data_len;
+    }
+    rc = buffer_apply_edits(self, edits, nedits);
+    free(edits);
+    str_free(&pad_data);
+    return rc;
 }
 
-// Remove a style rule from the buffer
+// Stable sort lines from start_line thru end_line by cmp, or by their bytes
+// if cmp is NULL. Lines are relinked, not copied.
+int buffer_sort_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, buffer_line_cmp_t cmp, void* udata) {
+    return _buffer_sort_lines(self, start_line, end_line, NULL, cmp, udata);
+}
+
+// Stable sort lines from start_line thru end_line by the first capture group
+// of cre, or by the whole match if there are no groups. Lines that do not
+// match sort first.
+int buffer_sort_lines_by_cre(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre) {
+    return _buffer_sort_lines(self, start_line, end_line, cre, NULL, NULL);
+}
+
+// Reverse the order of lines from start_line thru end_line
+int buffer_reverse_lines(buffer_t* self, bline_t* start_line, bline_t* end_line) {
+    bint_t nlines;
+    bint_t* perm;
+    bint_t i;
+    nlines = _buffer_line_range(&start_line, end_line);
+    perm = malloc(sizeof(bint_t) * nlines);
+    for (i = 0; i < nlines; i++) {
+        perm[i] = nlines - 1 - i;
+    }
+    return _buffer_permute_lines(self, start_line, nlines, perm);
+}
+
+// Remove lines from start_line thru end_line that repeat the line before them
+int buffer_unique_lines(buffer_t* self, bline_t* start_line, bline_t* end_line) {
+    struct buffer_line_item_s* items;
+    bint_t nlines;
+    bint_t last_kept;
+    bint_t i;
+    char* drop;
+    int rc;
+    items = _buffer_line_items(&start_line, end_line, &nlines);
+    drop = calloc(nlines, sizeof(char));
+    last_kept = 0;
+    for (i = 1; i < nlines; i++) {
+        if (_buffer_line_item_cmp(&items[last_kept], &items[i], NULL, NULL) == 0) {
+            drop[i] = 1;
+        } else {
+            last_kept = i;
+        }
+    }
+    free(items);
+    rc = _buffer_drop_lines(self, start_line, nlines, drop);
+    free(drop);
+    return rc;
+}
+
+// Keep only lines from start_line thru end_line that match cre, or only lines
+// that do not if keep_matching is 0
+int buffer_filter_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre, int keep_matching) {
+    bline_t* bline;
+    bint_t nlines;
+    bint_t i;
+    char* drop;
+    int is_match;
+    int rc;
+    int ovector[3];
+    MLBUF_INIT_PCRE_EXTRA(pcre_extra);
+    nlines = _buffer_line_range(&start_line, end_line);
+    drop = malloc(nlines);
+    for (bline = start_line, i = 0; i < nlines; bline = bline->next, i++) {
+        is_match = pcre_exec(cre, &pcre_extra, bline->data ? bline->data : "", bline->data_len, 0, 0, ovector, 3) >= 0 ? 1 : 0;
+        drop[i] = is_match == (keep_matching ? 0 : 1) ? 1 : 0;
+    }
+    rc = _buffer_drop_lines(self, start_line, nlines, drop);
+    free(drop);
+    return rc;
+}
+
+// Return the number of lines from start_line thru end_line. The range is
+// flipped if given bottom-up.
+static bint_t _buffer_line_range(bline_t** start_line, bline_t* end_line) {
+    bint_t nlines;
+    nlines = end_line->line_index - (*start_line)->line_index;
+    if (nlines < 0) {
+        *start_line = end_line;
+        nlines = -1 * nlines;
+    }
+    return nlines + 1;
+}
+
+// Return the lines from start_line thru end_line keyed by their data. The
+// range is flipped if given bottom-up.
+static struct buffer_line_item_s* _buffer_line_items(bline_t** start_line, bline_t* end_line, bint_t* ret_nlines) {
+    struct buffer_line_item_s* items;
+    bline_t* bline;
+    bint_t nlines;
+    bint_t i;
+    nlines = _buffer_line_range(start_line, end_line);
+    items = malloc(sizeof(struct buffer_line_item_s) * nlines);
+    for (bline = *start_line, i = 0; i < nlines; bline = bline->next, i++) {
+        items[i].bline = bline;
+        items[i].index = i;
+        items[i].key = bline->data;
+        items[i].key_len = bline->data_len;
+    }
+    *ret_nlines = nlines;
+    return items;
+}
+
+// Compare two lines with cmp, or by their keys if cmp is NULL
+static int _buffer_line_item_cmp(struct buffer_line_item_s* a, struct buffer_line_item_s* b, buffer_line_cmp_t cmp, void* udata) {
+    int rc;
+    if (cmp) {
+        return cmp(a->bline, b->bline, udata);
+    }
+    rc = MLBUF_MIN(a->key_len, b->key_len) > 0 ? memcmp(a->key, b->key, MLBUF_MIN(a->key_len, b->key_len)) : 0;
+    if (rc == 0 && a->key_len != b->key_len) {
+        rc = a->key_len < b->key_len ? -1 : 1;
+    }
+    return rc;
+}
+
+// Merge sort lines (stable) and relink them in sorted order
+static int _buffer_sort_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre, buffer_line_cmp_t cmp, void* udata) {
+    struct buffer_line_item_s* items;
+    struct buffer_line_item_s* tmp;
+    struct buffer_line_item_s* swap;
+    bint_t nlines;
+    bint_t width;
+    bint_t lo;
+    bint_t mid;
+    bint_t hi;
+    bint_t i;
+    bint_t j;
+    bint_t k;
+    bint_t* perm;
+    int rc;
+    int ovector[6];
+    MLBUF_INIT_PCRE_EXTRA(pcre_extra);
+
+    items = _buffer_line_items(&start_line, end_line, &nlines);
+
+    // Key lines by regex
+    if (cre) {
+        for (i = 0; i < nlines; i++) {
+            rc = pcre_exec(cre, &pcre_extra, items[i].bline->data ? items[i].bline->data : "", items[i].bline->data_len, 0, 0, ovector, 6);
+            if (rc < 0) {
+                items[i].key_len = 0;
+                continue;
+            }
+            j = (rc == 0 || rc >= 2) && ovector[2] >= 0 ? 1 : 0;
+            items[i].key = items[i].bline->data + ovector[j * 2];
+            items[i].key_len = ovector[j * 2 + 1] - ovector[j * 2];
+        }
+    }
+
+    // Bottom-up merge sort
+    tmp = malloc(sizeof(struct buffer_line_item_s) * nlines);
+    for (width = 1; width < nlines; width *= 2) {
+        for (lo = 0; lo < nlines; lo += width * 2) {
+            mid = MLBUF_MIN(lo + width, nlines);
+            hi = MLBUF_MIN(lo + width * 2, nlines);
+            for (i = lo, j = mid, k = lo; k < hi; k++) {
+                if (i < mid && (j >= hi || _buffer_line_item_cmp(&items[i], &items[j], cmp, udata) <= 0)) {
+                    tmp[k] = items[i++];
+                } else {
+                    tmp[k] = items[j++];
+                }
+            }
+        }
+        swap = items;
+        items = tmp;
+        tmp = swap;
+    }
+    free(tmp);
+
+    perm = malloc(sizeof(bint_t) * nlines);
+    for (i = 0; i < nlines; i++) {
+        perm[i] = items[i].index;
+    }
+    free(items);
+    return _buffer_permute_lines(self, start_line, nlines, perm);
+}
+
+// Remove lines flagged in drop by moving them to the end of the range, then
+// deleting them as one block. Both steps are undone together.
+static int _buffer_drop_lines(buffer_t* self, bline_t* start_line, bint_t nlines, char* drop) {
+    bline_t* before_line;
+    bline_t* drop_line;
+    bline_t* bline;
+    baction_t* permute_action;
+    bint_t* perm;
+    bint_t nkept;
+    bint_t nchars;
+    bint_t group;
+    bint_t i;
+    bint_t j;
+    int is_permuted;
+    int rc;
+
+    // Kept lines first, then dropped lines, each in their original order
+    perm = malloc(sizeof(bint_t) * nlines);
+    nkept = 0;
+    for (i = 0; i < nlines; i++) {
+        if (!drop[i]) perm[nkept++] = i;
+    }
+    if (nkept == nlines) {
+        free(perm);
+        return MLBUF_OK;
+    }
+    for (i = 0, j = nkept; i < nlines; i++) {
+        if (drop[i]) perm[j++] = i;
+    }
+    is_permuted = nkept > 0 && perm[nkept - 1] != nkept - 1;
+    before_line = start_line->prev;
+    if ((rc = _buffer_permute_lines(self, start_line, nlines, perm)) != MLBUF_OK) {
+        return rc;
+    }
+    permute_action = is_permuted ? self->action_tail : NULL;
+
+    // Delete dropped lines
+    drop_line = before_line ? before_line->next : self->first_line;
+    for (i = 0; i < nkept; i++) drop_line = drop_line->next;
+    nchars = 0;
+    for (bline = drop_line, i = nkept; i < nlines; bline = bline->next, i++) {
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        nchars += bline->char_count + 1;
+        if (i == nlines - 1) break;
+    }
+    if (bline->next) {
+        rc = buffer_delete_w_bline(self, drop_line, 0, nchars);
+    } else if (drop_line->prev) {
+        MLBUF_BLINE_ENSURE_CHARS(drop_line->prev);
+        rc = buffer_delete_w_bline(self, drop_line->prev, drop_line->prev->char_count, nchars);
+    } else {
+        rc = buffer_delete_w_bline(self, drop_line, 0, nchars - 1);
+    }
+
+    // Group the permute and delete for undo
+    if (permute_action && self->action_tail != permute_action) {
+        group = ++self->num_action_groups;
+        permute_action->group = group;
+        self->action_tail->group = group;
+    }
+    return rc;
+}
+
+// Relink nlines lines starting at start_line so that position i holds the
+// line previously at position perm[i]. Takes ownership of perm.
+static int _buffer_permute_lines(buffer_t* self, bline_t* start_line, bint_t nlines, bint_t* perm) {
+    bline_t** lines;
+    bline_t* before_line;
+    bline_t* after_line;
+    bline_t* bline;
+    bint_t start_line_index;
+    bint_t i;
+    baction_t* action;
+
+    for (i = 0; i < nlines && perm[i] == i; i++);
+    if (i >= nlines) {
+        free(perm);
+        return MLBUF_OK;
+    }
+
+    lines = malloc(sizeof(bline_t*) * nlines);
+    for (bline = start_line, i = 0; i < nlines; bline = bline->next, i++) {
+        if (!bline) {
+            free(lines);
+            free(perm);
+            return MLBUF_ERR;
+        }
+        lines[i] = bline;
+    }
+    start_line_index = start_line->line_index;
+    before_line = start_line->prev;
+    after_line = lines[nlines - 1]->next;
+    for (i = 0; i < nlines; i++) {
+        bline = lines[perm[i]];
+        bline->prev = i > 0 ? lines[perm[i - 1]] : before_line;
+        bline->next = i < nlines - 1 ? lines[perm[i + 1]] : after_line;
+        bline->line_index = start_line_index + i;
+    }
+    if (before_line) {
+        before_line->next = lines[perm[0]];
+    } else {
+        self->first_line = lines[perm[0]];
+    }
+    if (after_line) {
+        after_line->prev = lines[perm[nlines - 1]];
+    } else {
+        self->last_line = lines[perm[nlines - 1]];
+    }
+    self->data_hint_line = NULL;
+
+    // Record permutation as action data
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_PERMUTE;
+    action->buffer = self;
+    action->start_line = lines[perm[0]];
+    action->start_line_index = start_line_index;
+    action->start_col = 0;
+    action->maybe_end_line = lines[perm[nlines - 1]];
+    action->maybe_end_line_index = start_line_index + nlines - 1;
+    action->data = (char*)perm;
+    action->data_len = sizeof(bint_t) * nlines;
+    free(lines);
+    return _buffer_update(self, action);
+}
+
+// Move lines from start_line thru end_line up (negative) or down (positive)
+// by line_delta lines
+int buffer_move_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t line_delta) {
+    bline_t* tmp_line;
+    bint_t nlines;
+    bint_t nother;
+    bint_t* perm;
+    bint_t i;
+
+    if (end_line->line_index < start_line->line_index) {
+        tmp_line = start_line;
+        start_line = end_line;
+        end_line = tmp_line;
+    }
+    nlines = end_line->line_index - start_line->line_index + 1;
+    line_delta = MLBUF_MAX(-1 * start_line->line_index, MLBUF_MIN(self->line_count - 1 - end_line->line_index, line_delta));
+    if (line_delta == 0) {
+        return MLBUF_OK;
+    }
+
+    // Rotate the block past the lines it moves over
+    nother = line_delta < 0 ? -1 * line_delta : line_delta;
+    perm = malloc(sizeof(bint_t) * (nlines + nother));
+    for (i = 0; i < nlines + nother; i++) {
+        if (line_delta < 0) {
+            perm[i] = i < nlines ? nother + i : i - nlines;
+        } else {
+            perm[i] = i < nother ? nlines + i : i - nother;
+        }
+    }
+    for (i = 0; line_delta < 0 && i < nother; i++) {
+        start_line = start_line->prev;
+    }
+    return _buffer_permute_lines(self, start_line, nlines + nother, perm);
+}
+
+// Insert a copy of lines from start_line thru end_line after end_line. Line
+// data and char metadata are copied directly.
+int buffer_duplicate_lines(buffer_t* self, bline_t* start_line, bline_t* end_line) {
+    bline_t* tmp_line;
+    bline_t* bline;
+    bline_t* new_line;
+    bline_t* prev_line;
+    bint_t nlines;
+    bint_t nchars;
+    bint_t i;
+    baction_t* action;
+    str_t ins_data = {0};
+
+    if (end_line->line_index < start_line->line_index) {
+        tmp_line = start_line;
+        start_line = end_line;
+        end_line = tmp_line;
+    }
+    nlines = end_line->line_index - start_line->line_index + 1;
+    MLBUF_BLINE_ENSURE_CHARS(end_line);
+    prev_line = end_line;
+    nchars = 0;
+    for (bline = start_line, i = 0; i < nlines; bline = bline->next, i++) {
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        new_line = _buffer_bline_new(self);
+        if (bline->data_len > 0) {
+            new_line->data = malloc(bline->data_len);
+            new_line->data_len = bline->data_len;
+            new_line->data_cap = bline->data_len;
+            memcpy(new_line->data, bline->data, bline->data_len);
+            new_line->chars = malloc(sizeof(bline_char_t) * bline->data_len);
+            new_line->chars_cap = bline->data_len;
+            memcpy(new_line->chars, bline->chars, sizeof(bline_char_t) * bline->data_len);
+        }
+        new_line->char_count = bline->char_count;
+        new_line->char_vwidth = bline->char_vwidth;
+        new_line->is_chars_dirty = 0;
+        new_line->line_index = end_line->line_index + i + 1;
+        new_line->prev = prev_line;
+        new_line->next = prev_line->next;
+        if (prev_line->next) prev_line->next->prev = new_line;
+        prev_line->next = new_line;
+        prev_line = new_line;
+        str_append_char(&ins_data, '\n');
+        if (bline->data_len > 0) str_append_len(&ins_data, bline->data, bline->data_len);
+        nchars += bline->char_count + 1;
+    }
+
+    // Record as an insert at end_line's eol
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_INSERT;
+    action->buffer = self;
+    action->start_line = end_line;
+    action->start_line_index = end_line->line_index;
+    action->start_col = end_line->char_count;
+    action->maybe_end_line = prev_line;
+    action->maybe_end_line_index = end_line->line_index + nlines;
+    action->maybe_end_col = prev_line->char_count;
+    action->byte_delta = (bint_t)ins_data.len;
+    action->char_delta = nchars;
+    action->line_delta = nlines;
+    action->data = ins_data.data;
+    action->data_len = (bint_t)ins_data.len;
+    return _buffer_update(self, action);
+}
+
+// Join lines from start_line thru end_line into start_line, replacing each
+// line break with sep
+int buffer_join_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, char* sep, bint_t sep_len) {
+    bline_t* tmp_line;
+    if (end_line->line_index < start_line->line_index) {
+        tmp_line = start_line;
+        start_line = end_line;
+        end_line = tmp_line;
+    }
+    if (start_line == end_line) {
+        return MLBUF_OK;
+    }
+    return _buffer_join_lines(self, start_line, end_line->line_index - start_line->line_index + 1, sep, sep_len);
+}
+
+// Concatenate nlines lines into start_line. The action data is nlines, the
+// char count of each original line, then sep, which is enough to split the
+// line again on undo.
+static int _buffer_join_lines(buffer_t* self, bline_t* start_line, bint_t nlines, char* sep, bint_t sep_len) {
+    bline_t* bline;
+    bline_t* next_line;
+    bint_t* counts;
+    bint_t sep_nchars;
+    bint_t new_len;
+    bint_t col;
+    bint_t i;
+    baction_t* action;
+
+    // Size joined line and record original char counts
+    action = calloc(1, sizeof(baction_t));
+    action->data_len = sizeof(bint_t) * (nlines + 1) + sep_len;
+    action->data = malloc(action->data_len);
+    counts = (bint_t*)action->data;
+    counts[0] = nlines;
+    if (sep_len > 0) memcpy(action->data + sizeof(bint_t) * (nlines + 1), sep, sep_len);
+    new_len = 0;
+    for (bline = start_line, i = 0; i < nlines; bline = bline->next, i++) {
+        if (!bline) {
+            _baction_destroy(action);
+            return MLBUF_ERR;
+        }
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        counts[i + 1] = bline->char_count;
+        new_len += bline->data_len + (i > 0 ? sep_len : 0);
+    }
+    sep_nchars = _buffer_count_chars(sep, sep_len);
+
+    // Append data to start_line
+    if (start_line->is_data_slabbed) _buffer_bline_unslab(start_line);
+    if (new_len > start_line->data_cap) {
+        start_line->data = realloc(start_line->data, new_len);
+        start_line->data_cap = new_len;
+    }
+    for (bline = start_line->next, i = 1; i < nlines; bline = bline->next, i++) {
+        if (sep_len > 0) memcpy(start_line->data + start_line->data_len, sep, sep_len);
+        start_line->data_len += sep_len;
+        if (bline->data_len > 0) memcpy(start_line->data + start_line->data_len, bline->data, bline->data_len);
+        start_line->data_len += bline->data_len;
+    }
+    bline_count_chars(start_line);
+
+    // Free joined lines, moving their marks to start_line
+    col = counts[1];
+    for (bline = start_line->next, i = 1; i < nlines; bline = next_line, i++) {
+        next_line = bline->next;
+        col += sep_nchars;
+        _buffer_bline_free(bline, start_line, col);
+        col += counts[i + 1];
+    }
+    start_line->next = bline;
+    if (bline) bline->prev = start_line;
+
+    action->type = MLBUF_BACTION_TYPE_JOIN;
+    action->buffer = self;
+    action->start_line = start_line;
+    action->start_line_index = start_line->line_index;
+    action->start_col = 0;
+    action->maybe_end_line = start_line;
+    action->maybe_end_line_index = start_line->line_index;
+    action->byte_delta = (nlines - 1) * (sep_len - 1);
+    action->char_delta = (nlines - 1) * (sep_nchars - 1);
+    action->line_delta = -1 * (nlines - 1);
+    return _buffer_update(self, action);
+}
+
+// Split a line joined by _buffer_join_lines back into its original lines
+static int _buffer_split_line(buffer_t* self, bline_t* bline, char* data, bint_t data_len) {
+    bline_t** lines;
+    bline_t* new_line;
+    bint_t* counts;
+    bint_t* start_cols;
+    bint_t nlines;
+    bint_t sep_len;
+    bint_t sep_nchars;
+    bint_t start_index;
+    bint_t end_index;
+    bint_t col;
+    bint_t i;
+    mark_t* mark;
+    mark_t* mark_tmp;
+    baction_t* action;
+
+    counts = (bint_t*)data;
+    nlines = counts[0];
+    sep_len = data_len - sizeof(bint_t) * (nlines + 1);
+    sep_nchars = _buffer_count_chars(data + sizeof(bint_t) * (nlines + 1), sep_len);
+
+    // Find where each line starts
+    start_cols = malloc(sizeof(bint_t) * nlines);
+    for (col = 0, i = 0; i < nlines; i++) {
+        start_cols[i] = col;
+        col += counts[i + 1] + sep_nchars;
+    }
+    MLBUF_BLINE_ENSURE_CHARS(bline);
+    if (col - sep_nchars != bline->char_count) {
+        free(start_cols);
+        return MLBUF_ERR;
+    }
+
+    // Copy each line after the first out of bline
+    if (bline->is_data_slabbed) _buffer_bline_unslab(bline);
+    lines = malloc(sizeof(bline_t*) * nlines);
+    lines[0] = bline;
+    for (i = 1; i < nlines; i++) {
+        new_line = _buffer_bline_new(self);
+        start_index = _buffer_bline_col_to_index(bline, start_cols[i]);
+        end_index = _buffer_bline_col_to_index(bline, start_cols[i] + counts[i + 1]);
+        if (end_index > start_index) {
+            new_line->data = malloc(end_index - start_index);
+            new_line->data_len = end_index - start_index;
+            new_line->data_cap = new_line->data_len;
+            memcpy(new_line->data, bline->data + start_index, new_line->data_len);
+        }
+        bline_count_chars(new_line);
+        new_line->line_index = bline->line_index + i;
+        new_line->prev = lines[i - 1];
+        new_line->next = lines[i - 1]->next;
+        if (new_line->next) new_line->next->prev = new_line;
+        lines[i - 1]->next = new_line;
+        lines[i] = new_line;
+    }
+
+    // Move marks to their original lines, then truncate bline
+    DL_FOREACH_SAFE(bline->marks, mark, mark_tmp) {
+        for (i = nlines - 1; i > 0 && mark->col < start_cols[i]; i--);
+        if (i > 0) {
+            _mark_mark_move_inner(mark, lines[i], mark->col - start_cols[i], 1, 0);
+        } else if (mark->col > counts[1]) {
+            _mark_mark_move_inner(mark, bline, counts[1], 1, 0);
+        }
+    }
+    bline->data_len = _buffer_bline_col_to_index(bline, counts[1]);
+    bline_count_chars(bline);
+
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_SPLIT;
+    action->buffer = self;
+    action->start_line = bline;
+    action->start_line_index = bline->line_index;
+    action->start_col = 0;
+    action->maybe_end_line = lines[nlines - 1];
+    action->maybe_end_line_index = bline->line_index + nlines - 1;
+    action->byte_delta = -1 * (nlines - 1) * (sep_len - 1);
+    action->char_delta = -1 * (nlines - 1) * (sep_nchars - 1);
+    action->line_delta = nlines - 1;
+    action->data = malloc(data_len);
+    action->data_len = data_len;
+    memcpy(action->data, data, data_len);
+    free(lines);
+    free(start_cols);
+    return _buffer_update(self, action);
+}
+
+// Delete start_line:start_col thru end_line:end_col by unlinking the lines
+// after start_line as a chain. The chain is kept by the action (or by
+// maybe_owner when redoing) instead of being copied, and marks on it
+// collapse onto start_line in one pass. The action's data is only the
+// deleted tail of start_line; see baction_get_data for all of it.
+static int _buffer_detach_lines(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, bint_t nchars, bint_t nlines, baction_t* maybe_owner) {
+    bint_t start_index;
+    bint_t end_index;
+    bint_t tail_len;
+    bint_t del_len;
+    char* del_data;
+    bint_t del_data_len;
+    bline_t* head;
+    bline_t* tmp_line;
+    mark_t* mark;
+    mark_t* mark_tmp;
+    baction_t* action;
+
+    // Unslab if needed
+    if (start_line->is_data_slabbed) _buffer_bline_unslab(start_line);
+
+    // Save the tail of start_line and replace it with the tail of end_line
+    start_index = _buffer_bline_col_to_index(start_line, start_col);
+    end_index = _buffer_bline_col_to_index(end_line, end_col);
+    tail_len = end_line->data_len - end_index;
+    del_data_len = start_line->data_len - start_index;
+    del_data = NULL;
+    if (del_data_len > 0) {
+        del_data = malloc(del_data_len);
+        memcpy(del_data, start_line->data + start_index, del_data_len);
+    }
+    if (start_index + tail_len > start_line->data_cap) {
+        start_line->data = realloc(start_line->data, start_index + tail_len);
+        start_line->data_cap = start_index + tail_len;
+    }
+    if (tail_len > 0) memcpy(start_line->data + start_index, end_line->data + end_index, tail_len);
+    start_line->data_len = start_index + tail_len;
+    bline_count_chars(start_line);
+    DL_FOREACH(start_line->marks, mark) {
+        if (mark->col > start_col) mark->col = start_col;
+    }
+
+    // Collapse marks on the chain onto start_line and sum its bytes
+    del_len = del_data_len;
+    for (tmp_line = start_line->next; ; tmp_line = tmp_line->next) {
+        del_len += 1 + (tmp_line == end_line ? end_index : tmp_line->data_len);
+        DL_FOREACH_SAFE(tmp_line->marks, mark, mark_tmp) {
+            if (tmp_line == end_line && mark->col > end_col) {
+                _mark_mark_move_inner(mark, start_line, start_col + mark->col - end_col, 1, 0);
+            } else {
+                _mark_mark_move_inner(mark, start_line, start_col, 1, 0);
+            }
+        }
+        if (tmp_line == end_line) break;
+    }
+
+    // Unlink chain
+    head = start_line->next;
+    start_line->next = end_line->next;
+    if (end_line->next) end_line->next->prev = start_line;
+    head->prev = NULL;
+    end_line->next = NULL;
+    if (self->data_hint_line && self->data_hint_line->line_index > start_line->line_index) {
+        self->data_hint_line = NULL;
+    }
+
+    action = calloc(1, sizeof(baction_t));
+    action->type = MLBUF_BACTION_TYPE_DELETE;
+    action->buffer = self;
+    action->start_line = start_line;
+    action->start_line_index = start_line->line_index;
+    action->start_col = start_col;
+    action->maybe_end_col = end_col;
+    action->byte_delta = -1 * del_len;
+    action->char_delta = -1 * nchars;
+    action->line_delta = -1 * nlines;
+    action->data = del_data;
+    action->data_len = del_data_len;
+    action->maybe_lines = head;
+    if (maybe_owner) {
+        // The redo action only lends the chain to the callback
+        maybe_owner->maybe_lines = head;
+    }
+    return _buffer_update(self, action);
+}
+
+// Undo _buffer_detach_lines by linking action's chain back in after bline.
+// The buffer takes the chain back from action.
+static int _buffer_attach_lines(buffer_t* self, bline_t* bline, baction_t* action) {
+    bint_t start_index;
+    bint_t tail_len;
+    char* newline;
+    bline_t* head;
+    bline_t* end_line;
+    mark_t* mark;
+    mark_t* mark_tmp;
+    baction_t* ins_action;
+    bint_t ins_data_len;
+    bint_t ins_data_nchars;
+
+    // Find end of chain
+    head = action->maybe_lines;
+    for (end_line = head; end_line->next; end_line = end_line->next);
+
+    // Restore the tail of bline. It is the data up to the first newline if
+    // baction_get_data flattened the deleted text.
+    if (bline->is_data_slabbed) _buffer_bline_unslab(bline);
+    start_index = _buffer_bline_col_to_index(bline, action->start_col);
+    newline = action->data_len > 0 ? memchr(action->data, '\n', action->data_len) : NULL;
+    tail_len = newline ? (bint_t)(newline - action->data) : action->data_len;
+    if (start_index + tail_len > bline->data_cap) {
+        bline->data = realloc(bline->data, start_index + tail_len);
+        bline->data_cap = start_index + tail_len;
+    }
+    if (tail_len > 0) memcpy(bline->data + start_index, action->data, tail_len);
+    bline->data_len = start_index + tail_len;
+    bline_count_chars(bline);
+
+    // Link chain
+    end_line->next = bline->next;
+    if (bline->next) bline->next->prev = end_line;
+    bline->next = head;
+    head->prev = bline;
+    action->maybe_lines = NULL;
+
+    // Move marks at or past start_col to end_line, as an insert would
+    DL_FOREACH_SAFE(bline->marks, mark, mark_tmp) {
+        if (mark->col >= action->start_col) {
+            _mark_mark_move_inner(mark, end_line, mark->col - action->start_col + (mark_is_after_col_minus_lefties(mark, action->start_col) ? action->maybe_end_col : 0), 1, 0);
+        }
+    }
+
+    // Record as an insert. Only flatten the lines if a journal or callback
+    // needs the data.
+    ins_action = calloc(1, sizeof(baction_t));
+    ins_action->type = MLBUF_BACTION_TYPE_INSERT;
+    ins_action->buffer = self;
+    ins_action->start_line = bline;
+    ins_action->start_line_index = bline->line_index;
+    ins_action->start_col = action->start_col;
+    ins_action->maybe_end_line = end_line;
+    ins_action->maybe_end_line_index = bline->line_index - action->line_delta;
+    ins_action->maybe_end_col = action->maybe_end_col;
+    ins_action->byte_delta = -1 * action->byte_delta;
+    ins_action->char_delta = -1 * action->char_delta;
+    ins_action->line_delta = -1 * action->line_delta;
+    if (self->journal || self->callback) {
+        buffer_substr(self, bline, action->start_col, end_line, action->maybe_end_col, &ins_action->data, &ins_data_len, &ins_data_nchars);
+        ins_action->data_len = ins_data_len;
+    }
+    return _buffer_update(self, ins_action);
+}
+
+// Replace num_chars from start_line:start_col with data
+int buffer_replace_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, bint_t del_chars, char* data, bint_t data_len) {
+    bline_t* cur_line;
+    bint_t cur_col;
+    bint_t insert_rem;
+    bint_t delete_rem;
+    bint_t data_linelen;
+    bint_t nchars_ins;
+    bint_t nlines;
+    char* data_cursor;
+    char* data_newline;
+    baction_t* action;
+    str_t del_data = {0};
+
+    // Replace data on common lines
+    insert_rem = data_len;
+    delete_rem = del_chars;
+    cur_line = start_line;
+    cur_col = start_col;
+    data_cursor = data;
+    nchars_ins = 0;
+    nlines = 0;
+    MLBUF_BLINE_ENSURE_CHARS(cur_line);
+    while (insert_rem > 0 && delete_rem > (cur_line->char_count - cur_col)) {
+        data_newline = memchr(data_cursor, '\n', insert_rem);
+        data_linelen = data_newline ? (bint_t)(data_newline - data_cursor) : insert_rem;
+        delete_rem -= cur_line->char_count - cur_col;
+        _buffer_bline_replace(cur_line, cur_col, data_cursor, data_linelen, &del_data);
+        nchars_ins += cur_line->char_count - cur_col;
+        insert_rem -= data_linelen;
+        data_cursor += data_linelen;
+        cur_col = cur_line->char_count;
+        if (data_newline && insert_rem >= 2 && delete_rem >= 2 && cur_line->next) {
+            data_cursor += 1;
+            insert_rem -= 1;
+            delete_rem -= 1;
+            cur_line = cur_line->next;
+            cur_col = 0;
+            nchars_ins += 1;
+            str_append_len(&del_data, "\n", 1);
+        } else {
+            break;
+        }
+        nlines += 1;
+        MLBUF_BLINE_ENSURE_CHARS(cur_line);
+    }
+
+    // Add delete baction
+    if (del_data.len > 0) {
+        action = calloc(1, sizeof(baction_t));
+        action->type = MLBUF_BACTION_TYPE_DELETE;
+        action->buffer = self;
+        action->start_line = start_line;
+        action->start_line_index = start_line->line_index;
+        action->start_col = start_col;
+        action->byte_delta = -1 * del_data.len;
+        action->char_delta = -1 * (del_chars - delete_rem);
+        action->line_delta = -1 * nlines;
+        action->data = del_data.data;
+        action->data_len = del_data.len;
+        _buffer_update(self, action);
+    }
+
+    // Add insert baction
+    if (data_len - insert_rem > 0) {
+        action = calloc(1, sizeof(baction_t));
+        action->type = MLBUF_BACTION_TYPE_INSERT;
+        action->buffer = self;
+        action->start_line = start_line;
+        action->start_line_index = start_line->line_index;
+        action->start_col = start_col;
+        action->maybe_end_line = cur_line;
+        action->maybe_end_line_index = action->start_line_index + nlines;
+        action->maybe_end_col = cur_col;
+        action->byte_delta = data_len - insert_rem;
+        action->char_delta = nchars_ins;
+        action->line_delta = nlines;
+        action->data = strndup(data, action->byte_delta);
+        action->data_len = action->byte_delta;
+        _buffer_update(self, action);
+    }
+
+    // Delete left over data
+    if (delete_rem > 0) {
+        buffer_delete_w_bline(self, cur_line, cur_col, delete_rem);
+    }
+
+    // Insert left over data
+    if (insert_rem > 0) {
+        buffer_insert_w_bline(self, cur_line, cur_col, data_cursor, insert_rem, NULL);
+    }
+
+    return MLBUF_OK;
+}
+
+// Return a line given a line_index
+int buffer_get_bline(buffer_t* self, bint_t line_index, bline_t** ret_bline) {
+    bline_t* tmp_line;
+    MLBUF_MAKE_GT_EQ0(line_index);
+    for (tmp_line = self->first_line; tmp_line; tmp_line = tmp_line->next) {
+        if (tmp_line->line_index == line_index) {
+            *ret_bline = tmp_line;
+            return MLBUF_OK;
+        }
+    }
+    *ret_bline = self->last_line;
+    return MLBUF_ERR;
+}
+
+// Return a line and col for the given offset
+int buffer_get_bline_col(buffer_t* self, bint_t offset, bline_t** ret_bline, bint_t* ret_col) {
+    bline_t* tmp_line;
+    bline_t* good_line = NULL;
+    bint_t remaining_chars;
+    MLBUF_MAKE_GT_EQ0(offset);
+
+    remaining_chars = offset;
+    for (tmp_line = self->first_line; tmp_line != NULL; tmp_line = tmp_line->next) {
+        MLBUF_BLINE_ENSURE_CHARS(tmp_line);
+        if (tmp_line->char_count >= remaining_chars) {
+            *ret_bline = tmp_line;
+            *ret_col = remaining_chars;
+            return MLBUF_OK;
+        } else {
+            remaining_chars -= (tmp_line->char_count + 1); // Plus 1 for newline
+        }
+        good_line = tmp_line;
+    }
+
+    if (!good_line) good_line = self->first_line;
+    *ret_bline = good_line;
+    *ret_col = good_line->char_count;
+    return MLBUF_OK;
+}
+
+// Return an offset given a line and col
+int buffer_get_offset(buffer_t* self, bline_t* bline, bint_t col, bint_t* ret_offset) {
+    bline_t* tmp_line;
+    bint_t offset;
+    MLBUF_MAKE_GT_EQ0(col);
+
+    offset = 0;
+    for (tmp_line = self->first_line; tmp_line != bline->next; tmp_line = tmp_line->next) {
+        MLBUF_BLINE_ENSURE_CHARS(tmp_line);
+        if (tmp_line == bline) {
+            offset += MLBUF_MIN(tmp_line->char_count, col);
+            break;
+        } else {
+            offset += tmp_line->char_count + 1; // Plus 1 for newline
+        }
+    }
+
+    *ret_offset = offset;
+    return MLBUF_OK;
+}
+
+// Add a style rule to the buffer
+int buffer_add_srule(buffer_t* self, srule_t* srule) {
+    srule_node_t* node;
+    node = calloc(1, sizeof(srule_node_t));
+    node->srule = srule;
+    if (srule->type == MLBUF_SRULE_TYPE_SINGLE) {
+        DL_APPEND(self->single_srules, node);
+    } else {
+        DL_APPEND(self->multi_srules, node);
+    }
+    if (srule->type == MLBUF_SRULE_TYPE_RANGE) {
+        srule->range_a->range_srule = srule;
+        srule->range_b->range_srule = srule;
+    }
+    return buffer_apply_styles(self, self->first_line, self->line_count - 1);
+}
+
+// Remove a style rule from the buffer
 int buffer_remove_srule(buffer_t* self, srule_t* srule) {
     int found;
     srule_node_t** head;
@@ -775,335 +2526,1756 @@ int buffer_remove_srule(buffer_t* self, srule_t* srule) {
     if (srule->type == MLBUF_SRULE_TYPE_SINGLE) {
         head = &self->single_srules;
     } else {
-        head = &self->multi_srules;
+        head = &self->multi_srules;
+    }
+    found = 0;
+    DL_FOREACH_SAFE(*head, node, node_tmp) {
+        if (node->srule != srule) continue;
+        if (srule->type == MLBUF_SRULE_TYPE_RANGE) {
+            srule->range_a->range_srule = NULL;
+            srule->range_b->range_srule = NULL;
+        }
+        DL_DELETE(*head, node);
+        free(node);
+        found = 1;
+        break;
+    }
+    if (!found) return MLBUF_ERR;
+    return buffer_apply_styles(self, self->first_line, self->line_count - 1);
+}
+
+// Set callback to cb. Pass in NULL to unset callback.
+int buffer_set_callback(buffer_t* self, buffer_callback_t cb, void* udata) {
+    if (cb) {
+        self->callback = cb;
+        self->callback_udata = udata;
+    } else {
+        self->callback = NULL;
+        self->callback_udata = NULL;
+    }
+    return MLBUF_OK;
+}
+
+// Set tab_width and recalculate all line char vwidths
+int buffer_set_tab_width(buffer_t* self, int tab_width) {
+    bline_t* tmp_line;
+    if (tab_width < 1) {
+        return MLBUF_ERR;
+    }
+    self->tab_width = tab_width;
+    for (tmp_line = self->first_line; tmp_line; tmp_line = tmp_line->next) {
+        bline_count_chars(tmp_line);
+    }
+    return MLBUF_OK;
+}
+
+// Return data from start_line:start_col thru end_line:end_col
+int buffer_substr(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, char** ret_data, bint_t* ret_data_len, bint_t* ret_data_nchars) {
+    char* data;
+    bint_t data_size;
+    MLBUF_MAKE_GT_EQ0(start_col);
+    MLBUF_MAKE_GT_EQ0(end_col);
+
+    // Size exactly, then fill in one pass
+    data_size = _buffer_substr_len(start_line, start_col, end_line, end_col) + 1; // Plus 1 for nullchar
+    data = malloc(data_size);
+    buffer_substr_into(self, start_line, start_col, end_line, end_col, data, data_size, ret_data_len, ret_data_nchars);
+    *ret_data = data;
+    return MLBUF_OK;
+}
+
+// Like buffer_substr but copy into data, a caller-provided buffer of
+// data_size bytes. If data is too small (room is needed for a nullchar),
+// set ret_data_len to the required length and return MLBUF_ERR.
+int buffer_substr_into(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, char* data, bint_t data_size, bint_t* ret_data_len, bint_t* ret_data_nchars) {
+    bint_t data_len;
+    bline_t* tmp_line;
+    bint_t copy_len;
+    bint_t copy_index;
+    bint_t nchars;
+    MLBUF_MAKE_GT_EQ0(start_col);
+    MLBUF_MAKE_GT_EQ0(end_col);
+
+    // Make sure data is big enough
+    data_len = _buffer_substr_len(start_line, start_col, end_line, end_col);
+    if (data_len + 1 > data_size) {
+        *ret_data_len = data_len;
+        return MLBUF_ERR;
+    }
+
+    data_len = 0;
+    nchars = 0;
+    for (tmp_line = start_line; tmp_line != end_line->next; tmp_line = tmp_line->next) {
+        // Get copy_index + copy_len
+        // Also increment nchars
+        if (start_line == end_line) {
+            copy_index = _buffer_bline_col_to_index(start_line, start_col);
+            copy_len = _buffer_bline_col_to_index(start_line, end_col) - copy_index;
+            nchars += end_col - start_col;
+        } else if (tmp_line == start_line) {
+            copy_index = _buffer_bline_col_to_index(start_line, start_col);
+            copy_len = tmp_line->data_len - copy_index;
+            MLBUF_BLINE_ENSURE_CHARS(start_line);
+            nchars += start_line->char_count - start_col;
+        } else if (tmp_line == end_line) {
+            copy_index = 0;
+            copy_len = _buffer_bline_col_to_index(end_line, end_col);
+            nchars += end_col;
+        } else {
+            copy_index = 0;
+            copy_len = tmp_line->data_len;
+            MLBUF_BLINE_ENSURE_CHARS(tmp_line);
+            nchars += tmp_line->char_count;
+        }
+
+        // Copy copy_len bytes from copy_index into data
+        if (copy_len > 0) {
+            memcpy(data + data_len, tmp_line->data + copy_index, copy_len);
+            data_len += copy_len;
+        }
+
+        // Add newline if not on end_line
+        if (tmp_line != end_line) {
+            *(data + data_len) = '\n';
+            data_len += 1;
+            nchars += 1;
+        }
+    }
+
+    *(data + data_len) = '\0';
+    *ret_data_len = data_len;
+    *ret_data_nchars = nchars;
+
+    return MLBUF_OK;
+}
+
+// Undo an action, or a group of actions from buffer_apply_edits
+int buffer_undo(buffer_t* self) {
+    baction_t* action;
+    if (self->action_undone) {
+        action = self->action_undone == self->actions ? NULL : self->action_undone->prev;
+    } else {
+        action = self->action_tail;
+    }
+    if (action && action->group && action != self->actions && action->prev->group == action->group) {
+        return _buffer_do_group(self, action, 0);
+    }
+    return _buffer_undo(self);
+}
+
+// Redo an undone action, or group of actions
+int buffer_redo(buffer_t* self) {
+    baction_t* action;
+    action = self->action_undone;
+    if (action && action->group && action->next && action->next->group == action->group) {
+        return _buffer_do_group(self, action, 1);
+    }
+    return _buffer_redo(self);
+}
+
+// Undo or redo the group of actions ending or starting at action. Like
+// buffer_apply_edits, lines are renumbered, restyled, and reported once for
+// the whole group, and each action's line is found by walking from the
+// previous one instead of from the first line.
+static int _buffer_do_group(buffer_t* self, baction_t* action, int is_redo) {
+    bline_t* bline;
+    bline_t* valid_line;
+    bline_t* first_line;
+    bline_t* last_line;
+    bint_t group;
+    bint_t nlines;
+    bint_t first_line_index;
+    bint_t last_line_index;
+    bint_t orig_byte_count;
+    bint_t orig_line_count;
+    bint_t span;
+    baction_t batch;
+    int rc;
+
+    group = action->group;
+    self->action_group = group;
+    self->is_data_dirty = 1;
+    orig_byte_count = self->byte_count;
+    orig_line_count = self->line_count;
+    valid_line = self->last_line;
+    first_line_index = -1;
+    last_line_index = -1;
+    rc = MLBUF_OK;
+    while (action && action->group == group) {
+        // Find line. Lines up to valid_line are numbered, so walk back from
+        // it, or forward renumbering as we go.
+        bline = valid_line;
+        while (bline->prev && bline->line_index > action->start_line_index) {
+            bline = bline->prev;
+        }
+        while (bline->next && bline->line_index < action->start_line_index) {
+            bline->next->line_index = bline->line_index + 1;
+            bline = bline->next;
+        }
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        if (bline->line_index != action->start_line_index || action->start_col > bline->char_count) {
+            rc = MLBUF_ERR;
+            break;
+        }
+
+        // Perform action. Lines before bline keep their numbers.
+        valid_line = bline->prev;
+        if ((rc = _buffer_baction_do(self, bline, action, is_redo, NULL)) != MLBUF_OK) {
+            if (!valid_line) valid_line = self->first_line;
+            break;
+        }
+        if (!valid_line) {
+            valid_line = self->first_line;
+            valid_line->line_index = 0;
+        }
+
+        // Track touched lines, shifting the ones seen so far
+        nlines = is_redo ? action->line_delta : -1 * action->line_delta;
+        if (last_line_index > action->start_line_index) {
+            last_line_index = MLBUF_MAX(action->start_line_index, last_line_index + nlines);
+        }
+        if (first_line_index < 0 || action->start_line_index < first_line_index) {
+            first_line_index = action->start_line_index;
+        }
+        if (action->type == MLBUF_BACTION_TYPE_PERMUTE) {
+            nlines = action->maybe_end_line_index - action->start_line_index;
+        }
+        last_line_index = MLBUF_MAX(last_line_index, action->start_line_index + MLBUF_MAX(0, nlines));
+
+        // Update action_undone
+        if (is_redo) {
+            self->action_undone = action->next;
+            action = action->next;
+        } else {
+            self->action_undone = action;
+            action = action == self->actions ? NULL : action->prev;
+        }
+    }
+
+    // Renumber lines after the last one known to be in order
+    for (bline = valid_line; bline->next; bline = bline->next) {
+        bline->next->line_index = bline->line_index + 1;
+    }
+    self->last_line = bline;
+    self->action_group = 0;
+
+    if (first_line_index < 0) {
+        return rc;
+    }
+
+    // Restyle union of touched lines
+    last_line_index = MLBUF_MIN(last_line_index, self->line_count - 1);
+    buffer_get_bline(self, first_line_index, &first_line);
+    buffer_get_bline(self, last_line_index, &last_line);
+    span = last_line_index - first_line_index;
+    buffer_apply_styles(self, first_line, span > 0 ? span : (self->line_count < orig_line_count ? -1 : 0));
+
+    // Raise one event on listener
+    if (self->callback && !self->is_in_callback) {
+        batch = (baction_t){
+            .type = MLBUF_BACTION_TYPE_BATCH,
+            .buffer = self,
+            .start_line = first_line,
+            .start_line_index = first_line_index,
+            .start_col = 0,
+            .maybe_end_line = last_line,
+            .maybe_end_line_index = last_line_index,
+            .byte_delta = self->byte_count - orig_byte_count,
+            .line_delta = self->line_count - orig_line_count,
+        };
+        self->is_in_callback = 1;
+        self->callback(self, &batch, self->callback_udata);
+        self->is_in_callback = 0;
+    }
+
+    return rc;
+}
+
+// Undo one action
+static int _buffer_undo(buffer_t* self) {
+    baction_t* action_to_undo;
+    bline_t* bline;
+    int rc;
+
+    // Find action to undo
+    if (self->action_undone) {
+        if (self->action_undone == self->actions) {
+            return MLBUF_ERR;
+        } else if (!self->action_undone->prev) {
+            return MLBUF_ERR;
+        }
+        action_to_undo = self->action_undone->prev;
+    } else if (self->action_tail) {
+        action_to_undo = self->action_tail;
+    } else {
+        return MLBUF_ERR;
+    }
+
+    // Get line to perform undo on
+    bline = NULL;
+    buffer_get_bline(self, action_to_undo->start_line_index, &bline);
+    MLBUF_BLINE_ENSURE_CHARS(bline);
+    if (!bline) {
+        return MLBUF_ERR;
+    } else if (action_to_undo->start_col > bline->char_count) {
+        return MLBUF_ERR;
+    }
+
+    // Perform action
+    rc = _buffer_baction_do(self, bline, action_to_undo, 0, NULL);
+
+    // Update action_undone
+    if (rc == MLBUF_OK) {
+        self->action_undone = action_to_undo;
+    }
+    return rc;
+}
+
+// Redo one undone action
+static int _buffer_redo(buffer_t* self) {
+    baction_t* action_to_redo;
+    bline_t* bline;
+    int rc;
+
+    // Find action to undo
+    if (!self->action_undone) {
+        return MLBUF_ERR;
+    }
+    action_to_redo = self->action_undone;
+
+    // Get line to perform undo on
+    bline = NULL;
+    buffer_get_bline(self, action_to_redo->start_line_index, &bline);
+    MLBUF_BLINE_ENSURE_CHARS(bline);
+    if (!bline) {
+        return MLBUF_ERR;
+    } else if (action_to_redo->start_col > bline->char_count) {
+        return MLBUF_ERR;
+    }
+
+    // Perform action
+    rc = _buffer_baction_do(self, bline, action_to_redo, 1, NULL);
+
+    // Update action_undone
+    if (rc == MLBUF_OK) {
+        self->action_undone = self->action_undone->next;
+    }
+    return rc;
+}
+
+// Toggle is_style_disabled
+int buffer_set_styles_enabled(buffer_t* self, int is_enabled) {
+    if (!self->is_style_disabled && !is_enabled) {
+        self->is_style_disabled = 1;
+    } else if (self->is_style_disabled && is_enabled) {
+        self->is_style_disabled = 0;
+        buffer_apply_styles(self, self->first_line, self->line_count);
+    }
+    return MLBUF_OK;
+}
+
+// Apply styles from start_line
+int buffer_apply_styles(buffer_t* self, bline_t* start_line, bint_t line_delta) {
+    bint_t min_nlines;
+    srule_node_t* srule_node;
+    int count_tmp;
+    int srule_count;
+
+    if (self->is_style_disabled) {
+        return MLBUF_OK;
+    }
+
+    // min_nlines, minimum number of lines to style
+    //     line_delta  < 0: 2 (start_line + 1)
+    //     line_delta == 0: 1 (start_line)
+    //     line_delta  > 0: 1 + line_delta (start_line + added lines)
+    min_nlines = 1 + (line_delta < 0 ? 1 : line_delta);
+
+    // Count current srules
+    srule_count = 0;
+    DL_COUNT(self->single_srules, srule_node, count_tmp);
+    srule_count += count_tmp;
+    DL_COUNT(self->multi_srules, srule_node, count_tmp);
+    srule_count += count_tmp;
+
+    // Apply rules if there are any, or if the number of rules changed
+    if (srule_count > 0 || self->num_applied_srules != srule_count) {
+        _buffer_apply_styles_singles(start_line, min_nlines);
+        _buffer_apply_styles_multis(start_line, min_nlines, MLBUF_SRULE_TYPE_MULTI);
+        _buffer_apply_styles_multis(start_line, min_nlines, MLBUF_SRULE_TYPE_RANGE);
+        self->num_applied_srules = srule_count;
+    }
+
+    return MLBUF_OK;
+}
+
+// Set register
+int buffer_register_set(buffer_t* self, char reg, char* data, size_t data_len) {
+    MLBUF_ENSURE_AZ(reg);
+    str_set_len(MLBUF_REG_PTR(self, reg), data, data_len);
+    return MLBUF_OK;
+}
+
+// Append to register
+int buffer_register_append(buffer_t* self, char reg, char* data, size_t data_len) {
+    MLBUF_ENSURE_AZ(reg);
+    str_append_len(MLBUF_REG_PTR(self, reg), data, data_len);
+    return MLBUF_OK;
+}
+
+// Prepend to register
+int buffer_register_prepend(buffer_t* self, char reg, char* data, size_t data_len) {
+    MLBUF_ENSURE_AZ(reg);
+    str_prepend_len(MLBUF_REG_PTR(self, reg), data, data_len);
+    return MLBUF_OK;
+}
+
+// Clear register
+int buffer_register_clear(buffer_t* self, char reg) {
+    MLBUF_ENSURE_AZ(reg);
+    str_free(MLBUF_REG_PTR(self, reg));
+    return MLBUF_OK;
+}
+
+// Set register to the chars starting within start_vcol thru end_vcol
+// (exclusive) on every line from start_line thru end_line, one row per line
+int buffer_register_set_block(buffer_t* self, char reg, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol) {
+    bline_t* bline;
+    bint_t start_col;
+    bint_t end_col;
+    str_t* sreg;
+    MLBUF_ENSURE_AZ(reg);
+    sreg = MLBUF_REG_PTR(self, reg);
+    str_clear(sreg);
+    if (end_line->line_index < start_line->line_index) {
+        bline = start_line;
+        start_line = end_line;
+        end_line = bline;
+    }
+    for (bline = start_line; bline; bline = bline->next) {
+        bline_get_col_from_vcol(bline, start_vcol, &start_col);
+        bline_get_col_from_vcol(bline, end_vcol, &end_col);
+        if (end_col > start_col) {
+            str_append_stop(sreg,
+                bline->data + _buffer_bline_col_to_index(bline, start_col),
+                bline->data + _buffer_bline_col_to_index(bline, end_col)
+            );
+        }
+        if (bline == end_line) break;
+        str_append_char(sreg, '\n');
+    }
+    return MLBUF_OK;
+}
+
+// Get register, optionally allocating duplicate
+int buffer_register_get(buffer_t* self, char reg, int dup, char** ret_data, size_t* ret_data_len) {
+    str_t* sreg;
+    MLBUF_ENSURE_AZ(reg);
+    sreg = MLBUF_REG_PTR(self, reg);
+    if (dup) {
+        *ret_data = strndup(sreg->data, sreg->len);
+        *ret_data_len = strlen(*ret_data);
+    } else {
+        *ret_data = sreg->len > 0 ? sreg->data : "";
+        *ret_data_len = sreg->len;
+    }
+    return MLBUF_OK;
+}
+
+// Set buffer contents from mmapped data. If line_offsets is not NULL, it
+// holds the start offset of each of nlines lines and no newline scan is done.
+static int _buffer_set_mmapped_w_offsets(buffer_t* self, char* data, bint_t data_len, uint64_t* line_offsets, bint_t nlines) {
+    bint_t line_num;
+    bline_t* blines;
+    bint_t data_remaining_len;
+    char* data_cursor;
+    char* data_newline;
+    bint_t line_len;
+
+    // Drop all lines and the undo stack
+    _buffer_reset(self);
+
+    // Count number of lines
+    if (!line_offsets) {
+        nlines = 1;
+        data_cursor = data;
+        data_remaining_len = data_len;
+        while (data_remaining_len > 0 && (data_newline = memchr(data_cursor, '\n', data_remaining_len)) != NULL) {
+            data_remaining_len -= (bint_t)(data_newline - data_cursor) + 1;
+            data_cursor = data_newline + 1;
+            nlines += 1;
+        }
+    }
+
+    // Allocate blines and chars. These are freed in buffer_destroy.
+    self->slabbed_chars = calloc(data_len, sizeof(bline_char_t));
+    self->slabbed_blines = malloc(nlines * sizeof(bline_t));
+    blines = self->slabbed_blines;
+
+    // Populate blines
+    line_num = 0;
+    data_cursor = data;
+    data_remaining_len = data_len;
+    while (1) {
+        if (line_offsets) {
+            data_newline = line_num + 1 < nlines
+                ? data + line_offsets[line_num + 1] - 1
+                : NULL;
+        } else {
+            data_newline = data_remaining_len > 0
+                ? memchr(data_cursor, '\n', data_remaining_len)
+                : NULL;
+        }
+        line_len = data_newline ?
+            (bint_t)(data_newline - data_cursor)
+            : data_remaining_len;
+        blines[line_num] = (bline_t){
+            .buffer = self,
+            .data = data_cursor,
+            .data_len = line_len,
+            .data_cap = line_len,
+            .line_index = line_num,
+            .char_count = line_len,
+            .char_vwidth = line_len,
+            .chars = (self->slabbed_chars + (data_len - data_remaining_len)),
+            .chars_cap = line_len,
+            .marks = NULL,
+            .bol_rule = NULL,
+            .eol_rule = NULL,
+            .is_chars_dirty = 1,
+            .is_slabbed = 1,
+            .is_data_slabbed = 1,
+            .next = NULL,
+            .prev = NULL
+        };
+        if (line_num > 0) {
+            blines[line_num-1].next = blines + line_num;
+            blines[line_num].prev = blines + (line_num-1);
+        }
+        if (data_newline) {
+            data_remaining_len -= line_len + 1;
+            data_cursor = data_newline + 1;
+            line_num += 1;
+        } else {
+            break;
+        }
     }
-    found = 0;
-    DL_FOREACH_SAFE(*head, node, node_tmp) {
-        if (node->srule != srule) continue;
-        if (srule->type == MLBUF_SRULE_TYPE_RANGE) {
-            srule->range_a->range_srule = NULL;
-            srule->range_b->range_srule = NULL;
+
+    // Move marks to first line
+    _buffer_bline_free(self->first_line, blines, 0);
+    self->first_line = blines;
+    self->last_line = blines + line_num;
+    self->byte_count = data_len;
+    self->line_count = line_num + 1;
+    self->is_data_dirty = 1;
+    self->is_unsaved = 1;
+    return MLBUF_OK;
+}
+
+// Decide how to load the file open at fd. Non-regular, empty, and gzip
+// files are always read. Otherwise an explicit strategy wins. With AUTO:
+//
+// - Files smaller than open_mmap_min_size are read.
+// - Files on network and FUSE file systems are copied to a local tmp file
+//   and mmapped, as the remote file may change or vanish underneath us.
+// - Local files are copied and mmapped too, since truncating a directly
+//   mapped file turns line access into SIGBUS. The exception is when the tmp
+//   copy would live in memory (tmpfs) and the file does not fit in available
+//   memory. Then the file is mapped directly rather than exhaust memory.
+static int _buffer_open_strategy(buffer_t* self, int fd, struct stat* st) {
+#ifdef __linux__
+    struct statfs sfs;
+    long avail_pages;
+    long page_size;
+#endif
+
+    if (!S_ISREG(st->st_mode) || st->st_size < 1 || _buffer_is_gzip(fd)) {
+        return MLBUF_OPEN_STRATEGY_READ;
+    } else if (self->open_strategy != MLBUF_OPEN_STRATEGY_AUTO) {
+        return self->open_strategy;
+    } else if (st->st_size < self->open_mmap_min_size) {
+        return MLBUF_OPEN_STRATEGY_READ;
+    }
+
+#ifdef __linux__
+    // Always copy files on network file systems
+    if (fstatfs(fd, &sfs) == 0) {
+        switch ((unsigned long)sfs.f_type) {
+            case 0x6969:     // NFS_SUPER_MAGIC
+            case 0x517b:     // SMB_SUPER_MAGIC
+            case 0xfe534d42: // SMB2_MAGIC_NUMBER
+            case 0xff534d42: // CIFS_MAGIC_NUMBER
+            case 0x65735546: // FUSE_SUPER_MAGIC
+                return MLBUF_OPEN_STRATEGY_MMAP_COPY;
         }
-        DL_DELETE(*head, node);
-        free(node);
-        found = 1;
-        break;
     }
-    if (!found) return MLBUF_ERR;
-    return buffer_apply_styles(self, self->first_line, self->line_count - 1);
+
+    // Map local files directly if a tmpfs copy would not fit in memory
+    avail_pages = sysconf(_SC_AVPHYS_PAGES);
+    page_size = sysconf(_SC_PAGESIZE);
+    if (avail_pages > 0
+        && page_size > 0
+        && st->st_size > (bint_t)avail_pages * page_size
+        && statfs("/tmp", &sfs) == 0
+        && (unsigned long)sfs.f_type == 0x01021994 // TMPFS_MAGIC
+    ) {
+        return MLBUF_OPEN_STRATEGY_MMAP;
+    }
+#endif
+
+    return MLBUF_OPEN_STRATEGY_MMAP_COPY;
 }
 
-// Set callback to cb. Pass in NULL to unset callback.
-int buffer_set_callback(buffer_t* self, buffer_callback_t cb, void* udata) {
-    if (cb) {
-        self->callback = cb;
-        self->callback_udata = udata;
+// mmap file open at fd according to strategy. With MMAP_COPY, copy it to an
+// unlinked tmp file and mmap that instead. With MMAP_SHARED, map it writable
+// and shared for buffer_overwrite.
+static int _buffer_open_mmap(buffer_t* self, char* path, int fd, size_t size, int strategy) {
+    char tmppath[16];
+    int tmpfd;
+    char* mmap_buf;
+    void* index_map;
+    size_t index_map_len;
+    uint64_t* line_offsets;
+    bint_t nlines;
+    int rc;
+
+    if (strategy == MLBUF_OPEN_STRATEGY_MMAP_COPY) {
+        // Copy fd to tmp file
+        sprintf(tmppath, "%s", "/tmp/mle-XXXXXX");
+        tmpfd = mkstemp(tmppath);
+        if (tmpfd < 0) {
+            return MLBUF_ERR;
+        }
+        unlink(tmppath);
+        if (_buffer_copy_fd(fd, tmpfd) != MLBUF_OK) {
+            close(tmpfd);
+            return MLBUF_ERR;
+        }
     } else {
-        self->callback = NULL;
-        self->callback_udata = NULL;
+        // mmap fd directly; hold on to a dup of it
+        tmpfd = dup(fd);
+        if (tmpfd < 0) {
+            return MLBUF_ERR;
+        }
+    }
+
+    // Now mmap it
+    mmap_buf = strategy == MLBUF_OPEN_STRATEGY_MMAP_SHARED
+        ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tmpfd, 0)
+        : mmap(NULL, size, PROT_READ, MAP_PRIVATE, tmpfd, 0);
+    if (mmap_buf == MAP_FAILED) {
+        close(tmpfd);
+        return MLBUF_ERR;
+    }
+
+    // Use line index if we have a valid one, otherwise scan and save one
+    if (_buffer_index_load(self, path, fd, mmap_buf, &index_map, &index_map_len, &line_offsets, &nlines) == MLBUF_OK) {
+        rc = _buffer_set_mmapped_w_offsets(self, mmap_buf, (bint_t)size, line_offsets, nlines);
+        munmap(index_map, index_map_len);
+    } else {
+        // Start readahead so the scan overlaps with I/O. Go back to normal
+        // afterwards so later random access to lines is not penalized.
+        madvise(mmap_buf, size, MADV_SEQUENTIAL);
+        madvise(mmap_buf, size, MADV_WILLNEED);
+        rc = buffer_set_mmapped(self, mmap_buf, (bint_t)size);
+        madvise(mmap_buf, size, MADV_NORMAL);
+        if (rc == MLBUF_OK) _buffer_index_save(self, path, fd);
+    }
+    if (rc != MLBUF_OK) {
+        munmap(mmap_buf, size);
+        close(tmpfd);
+        return MLBUF_ERR;
     }
+    self->is_gzip = 0;
+
+    _buffer_munmap(self);
+    self->mmap = mmap_buf;
+    self->mmap_len = size;
+    self->mmap_fd = tmpfd;
+    self->is_mmap_shared = strategy == MLBUF_OPEN_STRATEGY_MMAP_SHARED ? 1 : 0;
     return MLBUF_OK;
 }
 
-// Set tab_width and recalculate all line char vwidths
-int buffer_set_tab_width(buffer_t* self, int tab_width) {
-    bline_t* tmp_line;
-    if (tab_width < 1) {
+// If self->mmap maps path directly, move it to an unlinked tmp copy at the
+// same address so slabbed lines survive path being truncated or rewritten.
+static int _buffer_mmap_detach(buffer_t* self, char* path) {
+    struct stat st_path;
+    struct stat st_mmap;
+    char tmppath[16];
+    int tmpfd;
+    size_t nwritten;
+
+    if (!self->mmap
+        || stat(path, &st_path) < 0
+        || fstat(self->mmap_fd, &st_mmap) < 0
+        || st_path.st_dev != st_mmap.st_dev
+        || st_path.st_ino != st_mmap.st_ino
+    ) {
+        return MLBUF_OK;
+    }
+
+    // Copy mmap to tmp file
+    sprintf(tmppath, "%s", "/tmp/mle-XXXXXX");
+    tmpfd = mkstemp(tmppath);
+    if (tmpfd < 0) {
         return MLBUF_ERR;
     }
-    self->tab_width = tab_width;
-    for (tmp_line = self->first_line; tmp_line; tmp_line = tmp_line->next) {
-        bline_count_chars(tmp_line);
+    unlink(tmppath);
+    nwritten = 0;
+    if (_buffer_write_mmap_range(self, 0, self->mmap_len, tmpfd, &nwritten) != MLBUF_OK) {
+        close(tmpfd);
+        return MLBUF_ERR;
+    }
+
+    // Remap tmp file in place
+    if (mmap(self->mmap, self->mmap_len, PROT_READ, MAP_PRIVATE | MAP_FIXED, tmpfd, 0) == MAP_FAILED) {
+        close(tmpfd);
+        return MLBUF_ERR;
     }
+    close(self->mmap_fd);
+    self->mmap_fd = tmpfd;
+    self->is_mmap_shared = 0;
     return MLBUF_OK;
 }
 
-// Return data from start_line:start_col thru end_line:end_col
-int buffer_substr(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, char** ret_data, bint_t* ret_data_len, bint_t* ret_data_nchars) {
-    char* data;
-    bint_t data_len;
-    bint_t data_size;
-    bline_t* tmp_line;
-    bint_t copy_len;
-    bint_t copy_index;
-    bint_t add_len;
-    bint_t nchars;
-    MLBUF_MAKE_GT_EQ0(start_col);
-    MLBUF_MAKE_GT_EQ0(end_col);
+// If path is the file behind a shared mmap and every line still lives in
+// the mapping unedited (except by buffer_overwrite), msync the dirtied pages
+// instead of rewriting the file. Return MLBUF_ERR if a full save is needed.
+static int _buffer_mmap_save_in_place(buffer_t* self, char* path) {
+    struct stat st_path;
+    struct stat st_mmap;
+    bline_t* run_end;
+    size_t page_size;
+    size_t sync_start;
+
+    if (!self->is_mmap_shared
+        || self->first_line->data != self->mmap
+        || _buffer_mmap_run(self, self->first_line, &run_end) != (bint_t)self->mmap_len
+        || run_end != self->last_line
+        || stat(path, &st_path) < 0
+        || fstat(self->mmap_fd, &st_mmap) < 0
+        || st_path.st_dev != st_mmap.st_dev
+        || st_path.st_ino != st_mmap.st_ino
+        || st_path.st_size != (off_t)self->mmap_len
+    ) {
+        return MLBUF_ERR;
+    }
 
-    data = calloc(2, sizeof(char));
-    data_len = 0;
-    data_size = 2;
-    nchars = 0;
+    if (self->mmap_dirty_end > self->mmap_dirty_start) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+        sync_start = self->mmap_dirty_start - (self->mmap_dirty_start % page_size);
+        if (msync(self->mmap + sync_start, self->mmap_dirty_end - sync_start, MS_SYNC) != 0) {
+            return MLBUF_ERR;
+        }
+        self->mmap_dirty_start = 0;
+        self->mmap_dirty_end = 0;
+    }
+    return MLBUF_OK;
+}
 
-    for (tmp_line = start_line; tmp_line != end_line->next; tmp_line = tmp_line->next) {
-        // Get copy_index + copy_len
-        // Also increment nchars
-        if (start_line == end_line) {
-            copy_index = _buffer_bline_col_to_index(start_line, start_col);
-            copy_len = _buffer_bline_col_to_index(start_line, end_col) - copy_index;
-            nchars += end_col - start_col;
-        } else if (tmp_line == start_line) {
-            copy_index = _buffer_bline_col_to_index(start_line, start_col);
-            copy_len = tmp_line->data_len - copy_index;
-            MLBUF_BLINE_ENSURE_CHARS(start_line);
-            nchars += start_line->char_count - start_col;
-        } else if (tmp_line == end_line) {
-            copy_index = 0;
-            copy_len = _buffer_bline_col_to_index(end_line, end_col);
-            nchars += end_col;
+// Return path of sidecar line index for path, or NULL if there is no
+// index_dir. The index is named after a hash of the real path.
+static char* _buffer_index_path(buffer_t* self, char* path) {
+    char* real_path;
+    char* index_path;
+    char* c;
+    uint64_t hash;
+    if (!self->index_dir || !(real_path = realpath(path, NULL))) {
+        return NULL;
+    }
+    hash = 14695981039346656037ULL; // FNV-1a
+    for (c = real_path; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    free(real_path);
+    if (asprintf(&index_path, "%s/%016llx.idx", self->index_dir, (unsigned long long)hash) < 0) {
+        return NULL;
+    }
+    return index_path;
+}
+
+// Fill header for the file open at fd
+static int _buffer_index_header(int fd, struct buffer_index_header_s* header) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return MLBUF_ERR;
+    }
+    memset(header, 0, sizeof(struct buffer_index_header_s));
+    memcpy(header->magic, MLBUF_INDEX_MAGIC, sizeof(header->magic));
+    header->dev = (uint64_t)st.st_dev;
+    header->ino = (uint64_t)st.st_ino;
+    header->size = (uint64_t)st.st_size;
+    header->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    header->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    header->ctime_sec = (int64_t)st.st_ctim.tv_sec;
+    header->ctime_nsec = (int64_t)st.st_ctim.tv_nsec;
+    return MLBUF_OK;
+}
+
+// mmap sidecar line index for the file open at fd if it exists and matches
+// the file, and a sample of its offsets start lines in data. On success,
+// caller must munmap ret_map.
+static int _buffer_index_load(buffer_t* self, char* path, int fd, char* data, void** ret_map, size_t* ret_map_len, uint64_t** ret_offsets, bint_t* ret_nlines) {
+    int rc;
+    int index_fd;
+    char* index_path;
+    struct stat st;
+    struct buffer_index_header_s header;
+    struct buffer_index_header_s* index_header;
+    uint64_t* line_offsets;
+    uint64_t offset;
+    uint64_t i;
+    void* map;
+
+    if (!(index_path = _buffer_index_path(self, path))) {
+        return MLBUF_ERR;
+    }
+    index_fd = open(index_path, O_RDONLY);
+    free(index_path);
+    if (index_fd < 0) {
+        return MLBUF_ERR;
+    }
+
+    rc = MLBUF_ERR;
+    map = MAP_FAILED;
+    do {
+        // mmap index
+        if (_buffer_index_header(fd, &header) != MLBUF_OK
+            || fstat(index_fd, &st) < 0
+            || (size_t)st.st_size < sizeof(header) + sizeof(uint64_t)
+        ) {
+            break;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+        if (map == MAP_FAILED) {
+            break;
+        }
+
+        // Make sure index is for this version of the file
+        index_header = (struct buffer_index_header_s*)map;
+        header.nlines = index_header->nlines;
+        if (memcmp(&header, index_header, sizeof(header)) != 0
+            || header.nlines < 1
+            || (uint64_t)st.st_size != sizeof(header) + header.nlines * sizeof(uint64_t)
+        ) {
+            break;
+        }
+
+        // Make sure offsets are sane
+        line_offsets = (uint64_t*)((char*)map + sizeof(header));
+        if (line_offsets[0] != 0) {
+            break;
+        }
+        for (i = 1; i < header.nlines; i++) {
+            if (line_offsets[i] <= line_offsets[i - 1] || line_offsets[i] > header.size) {
+                break;
+            }
+        }
+        if (i < header.nlines) {
+            break;
+        }
+
+        // Spot check that offsets start lines. Checking every one would
+        // touch every page of data, which is what the index is there to
+        // avoid. The header already ties the index to this file version.
+        for (i = 1; i <= MLBUF_INDEX_SAMPLE_SIZE && header.nlines > 1; i++) {
+            offset = line_offsets[1 + (i * (header.nlines - 2)) / MLBUF_INDEX_SAMPLE_SIZE];
+            if (data[offset - 1] != '\n') {
+                break;
+            }
+        }
+        if (i <= MLBUF_INDEX_SAMPLE_SIZE && header.nlines > 1) {
+            break;
+        }
+        rc = MLBUF_OK;
+    } while(0);
+
+    close(index_fd);
+    if (rc != MLBUF_OK) {
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        return rc;
+    }
+    *ret_map = map;
+    *ret_map_len = st.st_size;
+    *ret_offsets = line_offsets;
+    *ret_nlines = (bint_t)header.nlines;
+    return MLBUF_OK;
+}
+
+// Write sidecar line index for the file open at fd. The index is written to
+// a temp file and renamed into place. Failures are ignored; the index is
+// only a cache.
+static int _buffer_index_save(buffer_t* self, char* path, int fd) {
+    char* index_path;
+    char* tmp_path;
+    int tmp_fd;
+    FILE* fp;
+    struct buffer_index_header_s header;
+    bline_t* bline;
+    uint64_t offset;
+    int rc;
+
+    if (!(index_path = _buffer_index_path(self, path))) {
+        return MLBUF_ERR;
+    } else if (_buffer_index_header(fd, &header) != MLBUF_OK
+        || asprintf(&tmp_path, "%s.XXXXXX", index_path) < 0
+    ) {
+        free(index_path);
+        return MLBUF_ERR;
+    }
+
+    rc = MLBUF_ERR;
+    if ((tmp_fd = mkstemp(tmp_path)) >= 0) {
+        if ((fp = fdopen(tmp_fd, "wb")) != NULL) {
+            header.nlines = (uint64_t)self->line_count;
+            fwrite(&header, sizeof(header), 1, fp);
+            for (bline = self->first_line; bline; bline = bline->next) {
+                offset = (uint64_t)(bline->data - self->first_line->data);
+                fwrite(&offset, sizeof(offset), 1, fp);
+            }
+            if (!ferror(fp) && fclose(fp) == 0 && rename(tmp_path, index_path) == 0) {
+                rc = MLBUF_OK;
+            }
         } else {
-            copy_index = 0;
-            copy_len = tmp_line->data_len;
-            MLBUF_BLINE_ENSURE_CHARS(tmp_line);
-            nchars += tmp_line->char_count;
+            close(tmp_fd);
+        }
+        if (rc != MLBUF_OK) unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(index_path);
+    return rc;
+}
+
+// Replace buffer contents with data read from fd. gzip data is decompressed
+// on the fly. The buffer is left untouched if nothing can be read.
+static int _buffer_open_read(buffer_t* self, int fd) {
+    int rc;
+    int gz_fd;
+    int is_gzip;
+    gzFile gz;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    is_gzip = _buffer_is_gzip(fd);
+    if (!is_gzip) {
+        rc = _buffer_read_fd(self, fd, NULL, 1, NULL);
+    } else if ((gz_fd = dup(fd)) < 0) {
+        return MLBUF_ERR;
+    } else if (!(gz = gzdopen(gz_fd, "rb"))) {
+        close(gz_fd);
+        return MLBUF_ERR;
+    } else {
+        gzbuffer(gz, MLBUF_GZIP_BUFFER_SIZE);
+        rc = _buffer_read_fd(self, fd, gz, 1, NULL);
+        gzclose(gz);
+    }
+    if (rc == MLBUF_OK) self->is_gzip = is_gzip;
+    return rc;
+}
+
+// Read fd (or gz if not NULL) in chunks until EOF, appending complete lines
+// as they arrive. A gzip stream that does not end cleanly is an error. If
+// do_reset is set, the buffer is reset after the first successful read, so
+// an fd that cannot be read at all leaves it intact.
+static int _buffer_read_fd(buffer_t* self, int fd, gzFile gz, int do_reset, bint_t* optret_nbytes) {
+    int rc;
+    str_t buf = {0};
+    ssize_t nread;
+    char* last_newline;
+    bint_t line_bytes;
+    bint_t nbytes;
+    int gz_err;
+#ifdef MLBUF_IO_URING
+    struct stat st;
+    struct buffer_uring_s ring;
+
+    // Keep several reads of a regular file in flight if io_uring is there
+    if (!gz
+        && fstat(fd, &st) == 0
+        && S_ISREG(st.st_mode)
+        && _buffer_uring_init(&ring, MLBUF_URING_DEPTH) == MLBUF_OK
+    ) {
+        rc = _buffer_read_fd_uring(self, fd, &ring, do_reset, optret_nbytes);
+        _buffer_uring_free(&ring);
+        return rc;
+    }
+#endif
+
+    // Grow geometrically if a line does not fit in a chunk
+    buf.inc = -2;
+
+    rc = MLBUF_OK;
+    nbytes = 0;
+    while (1) {
+        str_ensure_cap(&buf, buf.len + MLBUF_READ_CHUNK_SIZE);
+        nread = gz
+            ? gzread(gz, buf.data + buf.len, (unsigned)(buf.cap - buf.len))
+            : read(fd, buf.data + buf.len, buf.cap - buf.len);
+        if (nread < 0) {
+            if (!gz && errno == EINTR) continue;
+            rc = MLBUF_ERR;
+            break;
+        }
+        if (do_reset) {
+            _buffer_reset(self);
+            do_reset = 0;
+        }
+        if (nread == 0) {
+            break;
+        }
+        buf.len += nread;
+        nbytes += nread;
+
+        // Append complete lines; keep partial line for next read. Only the
+        // new bytes can hold a newline.
+        if (!(last_newline = memrchr(buf.data + buf.len - nread, '\n', nread))) {
+            continue;
+        }
+        line_bytes = (bint_t)(last_newline - buf.data) + 1;
+        _buffer_append(self, buf.data, line_bytes);
+        memmove(buf.data, buf.data + line_bytes, buf.len - line_bytes);
+        buf.len -= line_bytes;
+    }
+
+    // Append partial last line
+    if (buf.len > 0) {
+        _buffer_append(self, buf.data, buf.len);
+    }
+
+    // A clean EOF leaves no error. Anything else, e.g. Z_BUF_ERROR from a
+    // truncated stream or Z_DATA_ERROR from a corrupt one, fails the read.
+    if (gz && rc == MLBUF_OK) {
+        gzerror(gz, &gz_err);
+        if (gz_err != Z_OK) rc = MLBUF_ERR;
+    }
+
+    str_free(&buf);
+    if (optret_nbytes) *optret_nbytes = nbytes;
+    return rc;
+}
+
+#ifdef MLBUF_IO_URING
+// Like _buffer_read_fd but for a regular file, keeping MLBUF_URING_DEPTH
+// chunk reads in flight. Chunks are appended in file order as they complete,
+// so building lines overlaps with the reads still queued behind them. Short
+// reads are resubmitted for the rest of the chunk, and a chunk that stays
+// short at EOF ends the read. The fd offset is left at EOF as read would.
+static int _buffer_read_fd_uring(buffer_t* self, int fd, struct buffer_uring_s* ring, int do_reset, bint_t* optret_nbytes) {
+    int rc;
+    char* chunks;
+    struct iovec iov[MLBUF_URING_DEPTH];
+    off_t chunk_off[MLBUF_URING_DEPTH];
+    size_t chunk_len[MLBUF_URING_DEPTH];
+    int is_chunk_done[MLBUF_URING_DEPTH];
+    off_t start;
+    off_t next_off;
+    bint_t nbytes;
+    int head;
+    int nflight;
+    int is_eof;
+    int res;
+    uint64_t slot;
+
+    if ((start = lseek(fd, 0, SEEK_CUR)) < 0
+        || !(chunks = malloc((size_t)MLBUF_URING_DEPTH * MLBUF_READ_CHUNK_SIZE))
+    ) {
+        return MLBUF_ERR;
+    }
+
+    // Queue up the first chunks
+    rc = MLBUF_OK;
+    nflight = 0;
+    next_off = start;
+    for (slot = 0; slot < MLBUF_URING_DEPTH; slot++) {
+        chunk_off[slot] = next_off;
+        chunk_len[slot] = 0;
+        is_chunk_done[slot] = 0;
+        iov[slot] = (struct iovec){ .iov_base = chunks + slot * MLBUF_READ_CHUNK_SIZE, .iov_len = MLBUF_READ_CHUNK_SIZE };
+        if (_buffer_uring_submit(ring, IORING_OP_READV, fd, &iov[slot], 1, next_off, slot) != MLBUF_OK) {
+            rc = MLBUF_ERR;
+            break;
+        }
+        nflight += 1;
+        next_off += MLBUF_READ_CHUNK_SIZE;
+    }
+
+    // Reap completions, appending chunks in file order. After an error or
+    // EOF keep reaping until nothing is in flight, because the kernel may
+    // still write to the chunks until then.
+    head = 0;
+    nbytes = 0;
+    is_eof = 0;
+    while (nflight > 0) {
+        if (_buffer_uring_wait(ring, &res, &slot) != MLBUF_OK) {
+            // Cannot tell what is still in flight, so leak the chunks
+            // rather than free memory the kernel may write to
+            return MLBUF_ERR;
+        }
+        nflight -= 1;
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        } else if (res < 0) {
+            rc = MLBUF_ERR;
+            continue;
+        } else if (res == 0) {
+            is_chunk_done[slot] = 1;
         }
 
-        // Add 1 for newline if not on end_line
-        add_len = copy_len + (tmp_line != end_line ? 1 : 0); // Plus 1 for newline
-        nchars += (tmp_line != end_line ? 1 : 0);
+        // Resubmit the rest of a short chunk
+        if (res > 0 || !is_chunk_done[slot]) {
+            chunk_len[slot] += (size_t)res;
+            if (chunk_len[slot] < MLBUF_READ_CHUNK_SIZE && rc == MLBUF_OK && !is_eof) {
+                iov[slot].iov_base = chunks + slot * MLBUF_READ_CHUNK_SIZE + chunk_len[slot];
+                iov[slot].iov_len = MLBUF_READ_CHUNK_SIZE - chunk_len[slot];
+                if (_buffer_uring_submit(ring, IORING_OP_READV, fd, &iov[slot], 1, chunk_off[slot] + (off_t)chunk_len[slot], slot) != MLBUF_OK) {
+                    rc = MLBUF_ERR;
+                } else {
+                    nflight += 1;
+                }
+                continue;
+            }
+            is_chunk_done[slot] = 1;
+        }
 
-        // Copy add_len bytes from copy_index into data
-        if (add_len > 0) {
-            if (data_len + add_len + 1 > data_size) {
-                data_size = data_len + add_len + 1; // Plus 1 for nullchar
-                data = realloc(data, data_size);
+        // Append finished chunks in file order and queue the next ones
+        while (rc == MLBUF_OK && !is_eof && is_chunk_done[head]) {
+            if (do_reset) {
+                _buffer_reset(self);
+                do_reset = 0;
             }
-            if (copy_len > 0) {
-                memcpy(data + data_len, tmp_line->data + copy_index, copy_len);
-                data_len += copy_len;
+            if (chunk_len[head] > 0) {
+                _buffer_append(self, chunks + head * MLBUF_READ_CHUNK_SIZE, (bint_t)chunk_len[head]);
+                nbytes += (bint_t)chunk_len[head];
+            }
+            if (chunk_len[head] < MLBUF_READ_CHUNK_SIZE) {
+                is_eof = 1;
+                break;
             }
-            if (tmp_line != end_line) {
-                *(data + data_len) = '\n';
-                data_len += 1;
+            chunk_off[head] = next_off;
+            chunk_len[head] = 0;
+            is_chunk_done[head] = 0;
+            iov[head] = (struct iovec){ .iov_base = chunks + head * MLBUF_READ_CHUNK_SIZE, .iov_len = MLBUF_READ_CHUNK_SIZE };
+            if (_buffer_uring_submit(ring, IORING_OP_READV, fd, &iov[head], 1, next_off, (uint64_t)head) != MLBUF_OK) {
+                rc = MLBUF_ERR;
+                break;
             }
+            nflight += 1;
+            next_off += MLBUF_READ_CHUNK_SIZE;
+            head = (head + 1) % MLBUF_URING_DEPTH;
         }
     }
 
-    *(data + data_len) = '\0';
-    *ret_data = data;
-    *ret_data_len = data_len;
-    *ret_data_nchars = nchars;
-
-    return MLBUF_OK;
+    free(chunks);
+    lseek(fd, start + nbytes, SEEK_SET);
+    if (optret_nbytes) *optret_nbytes = nbytes;
+    return rc;
 }
 
-// Undo an action
-int buffer_undo(buffer_t* self) {
-    baction_t* action_to_undo;
-    bline_t* bline;
+// Like buffer_write_to_fd but for a regular file, keeping up to
+// MLBUF_URING_DEPTH batches of lines in flight as writevs at explicit
+// offsets, so building a batch overlaps with the writes queued before it.
+// Long runs of mmapped lines are still copied with copy_file_range once the
+// writes before them land. The fd offset is left after the data as write
+// would.
+static int _buffer_write_fd_uring(buffer_t* self, int fd, struct buffer_uring_s* ring, size_t* optret_nbytes) {
     int rc;
+    struct iovec* iovs;
+    struct iovec* iov;
+    struct iovec* batch_iov[MLBUF_URING_DEPTH];
+    int batch_iovcnt[MLBUF_URING_DEPTH];
+    off_t batch_off[MLBUF_URING_DEPTH];
+    size_t batch_len;
+    int iovcnt;
+    int slot;
+    int nflight;
+    off_t off;
+    size_t nbytes;
+    bline_t* bline;
+    bline_t* run_end;
+    bint_t run_len;
 
-    // Find action to undo
-    if (self->action_undone) {
-        if (self->action_undone == self->actions) {
-            return MLBUF_ERR;
-        } else if (!self->action_undone->prev) {
-            return MLBUF_ERR;
-        }
-        action_to_undo = self->action_undone->prev;
-    } else if (self->action_tail) {
-        action_to_undo = self->action_tail;
-    } else {
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0
+        || !(iovs = malloc(sizeof(struct iovec) * MLBUF_URING_DEPTH * MLBUF_IOV_MAX))
+    ) {
         return MLBUF_ERR;
     }
+    memset(batch_iovcnt, 0, sizeof(batch_iovcnt));
 
-    // Get line to perform undo on
-    bline = NULL;
-    buffer_get_bline(self, action_to_undo->start_line_index, &bline);
-    MLBUF_BLINE_ENSURE_CHARS(bline);
-    if (!bline) {
+    rc = MLBUF_OK;
+    nbytes = 0;
+    nflight = 0;
+    slot = 0;
+    iov = iovs;
+    iovcnt = 0;
+    batch_len = 0;
+    run_end = NULL;
+    for (bline = self->first_line; bline && rc == MLBUF_OK; bline = bline->next) {
+        // Look for a run unless we are inside a short one already
+        run_len = run_end ? 0 : _buffer_mmap_run(self, bline, &run_end);
+        if (run_len < MLBUF_COPY_RANGE_MIN_SIZE && bline->data_len > 0) {
+            iov[iovcnt++] = (struct iovec){ .iov_base = bline->data, .iov_len = bline->data_len };
+            batch_len += bline->data_len;
+        }
+
+        // Queue the batch if it is full, at the end, or before a run
+        if (iovcnt > 0 && (run_len >= MLBUF_COPY_RANGE_MIN_SIZE || iovcnt >= MLBUF_IOV_MAX - 1 || !bline->next)) {
+            batch_iov[slot] = iov;
+            batch_iovcnt[slot] = iovcnt;
+            batch_off[slot] = off;
+            if (_buffer_uring_submit(ring, IORING_OP_WRITEV, fd, iov, iovcnt, off, (uint64_t)slot) != MLBUF_OK) {
+                batch_iovcnt[slot] = 0;
+                rc = MLBUF_ERR;
+                break;
+            }
+            nflight += 1;
+            off += (off_t)batch_len;
+            iovcnt = 0;
+            batch_len = 0;
+
+            // Wait for a free slot
+            while (rc == MLBUF_OK && batch_iovcnt[slot] > 0) {
+                for (slot = 0; slot < MLBUF_URING_DEPTH && batch_iovcnt[slot] > 0; slot++);
+                if (slot >= MLBUF_URING_DEPTH) {
+                    slot = 0;
+                    rc = _buffer_uring_reap_write(ring, fd, batch_iov, batch_iovcnt, batch_off, &nflight, &nbytes);
+                }
+            }
+            if (rc != MLBUF_OK) {
+                break;
+            }
+            iov = iovs + slot * MLBUF_IOV_MAX;
+        }
+
+        // Copy a run from the fd offset once queued writes land
+        if (rc == MLBUF_OK && run_len >= MLBUF_COPY_RANGE_MIN_SIZE) {
+            while (rc == MLBUF_OK && nflight > 0) {
+                rc = _buffer_uring_reap_write(ring, fd, batch_iov, batch_iovcnt, batch_off, &nflight, &nbytes);
+            }
+            if (rc != MLBUF_OK
+                || lseek(fd, off, SEEK_SET) < 0
+                || _buffer_write_mmap_range(self, (size_t)(bline->data - self->mmap), (size_t)run_len, fd, &nbytes) != MLBUF_OK
+            ) {
+                rc = MLBUF_ERR;
+                break;
+            }
+            off += (off_t)run_len;
+            bline = run_end;
+        }
+        if (bline == run_end) run_end = NULL;
+        if (bline->next) {
+            iov[iovcnt++] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+            batch_len += 1;
+        }
+    }
+
+    // Wait for the rest. After an error keep reaping until nothing is in
+    // flight, because the kernel may still read the iovecs until then.
+    while (nflight > 0) {
+        if (_buffer_uring_reap_write(ring, fd, batch_iov, batch_iovcnt, batch_off, &nflight, &nbytes) != MLBUF_OK) {
+            rc = MLBUF_ERR;
+        }
+    }
+    if (nflight < 0) {
+        // Cannot tell what is still in flight, so leak the iovecs rather
+        // than free memory the kernel may read
         return MLBUF_ERR;
-    } else if (action_to_undo->start_col > bline->char_count) {
+    }
+    free(iovs);
+    if (rc != MLBUF_OK || lseek(fd, off, SEEK_SET) < 0) {
         return MLBUF_ERR;
     }
+    if (optret_nbytes) *optret_nbytes = nbytes;
+    return MLBUF_OK;
+}
 
-    // Perform action
-    rc = _buffer_baction_do(self, bline, action_to_undo, 0, NULL);
+// Wait for a write queued by _buffer_write_fd_uring and add what it wrote
+// to nbytes. The rest of a short write is resubmitted, otherwise its slot
+// is freed. Sets nflight to -1 if completions can no longer be reaped.
+static int _buffer_uring_reap_write(struct buffer_uring_s* ring, int fd, struct iovec** batch_iov, int* batch_iovcnt, off_t* batch_off, int* nflight, size_t* nbytes) {
+    int res;
+    uint64_t slot;
+    size_t remaining;
 
-    // Update action_undone
-    if (rc == MLBUF_OK) {
-        self->action_undone = action_to_undo;
+    if (_buffer_uring_wait(ring, &res, &slot) != MLBUF_OK) {
+        *nflight = -1;
+        return MLBUF_ERR;
     }
-    return rc;
+    *nflight -= 1;
+    if (res == -EINTR || res == -EAGAIN) {
+        res = 0;
+    } else if (res <= 0) {
+        batch_iovcnt[slot] = 0;
+        return MLBUF_ERR;
+    }
+    *nbytes += (size_t)res;
+    batch_off[slot] += res;
+
+    // Skip fully written entries and advance into a partial one
+    remaining = (size_t)res;
+    while (batch_iovcnt[slot] > 0 && remaining >= batch_iov[slot]->iov_len) {
+        remaining -= batch_iov[slot]->iov_len;
+        batch_iov[slot] += 1;
+        batch_iovcnt[slot] -= 1;
+    }
+    if (batch_iovcnt[slot] == 0) {
+        return MLBUF_OK;
+    }
+    batch_iov[slot]->iov_base = (char*)batch_iov[slot]->iov_base + remaining;
+    batch_iov[slot]->iov_len -= remaining;
+    if (_buffer_uring_submit(ring, IORING_OP_WRITEV, fd, batch_iov[slot], batch_iovcnt[slot], batch_off[slot], slot) != MLBUF_OK) {
+        batch_iovcnt[slot] = 0;
+        return MLBUF_ERR;
+    }
+    *nflight += 1;
+    return MLBUF_OK;
 }
 
-// Redo an undone action
-int buffer_redo(buffer_t* self) {
-    baction_t* action_to_redo;
-    bline_t* bline;
-    int rc;
-
-    // Find action to undo
-    if (!self->action_undone) {
+// Set up an io_uring with room for depth entries. Fails on kernels without
+// io_uring or where it is disabled, in which case the caller uses read or
+// write.
+static int _buffer_uring_init(struct buffer_uring_s* ring, unsigned depth) {
+    struct io_uring_params params;
+    void* sq_ring;
+    void* cq_ring;
+    void* sqes;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0) {
         return MLBUF_ERR;
     }
-    action_to_redo = self->action_undone;
 
-    // Get line to perform undo on
-    bline = NULL;
-    buffer_get_bline(self, action_to_redo->start_line_index, &bline);
-    MLBUF_BLINE_ENSURE_CHARS(bline);
-    if (!bline) {
-        return MLBUF_ERR;
-    } else if (action_to_redo->start_col > bline->char_count) {
+    // Map rings. Newer kernels share one mapping for both.
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_len = MLBUF_MAX(ring->sq_ring_len, ring->cq_ring_len);
+        ring->cq_ring_len = 0;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    cq_ring = ring->cq_ring_len == 0
+        ? sq_ring
+        : mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->sq_ring = sq_ring == MAP_FAILED ? NULL : sq_ring;
+    ring->cq_ring = cq_ring == MAP_FAILED || ring->cq_ring_len == 0 ? NULL : cq_ring;
+    ring->sqes = sqes == MAP_FAILED ? NULL : sqes;
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        _buffer_uring_free(ring);
         return MLBUF_ERR;
     }
 
-    // Perform action
-    rc = _buffer_baction_do(self, bline, action_to_redo, 1, NULL);
+    ring->sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+    return MLBUF_OK;
+}
 
-    // Update action_undone
-    if (rc == MLBUF_OK) {
-        self->action_undone = self->action_undone->next;
-    }
-    return rc;
+// Unmap rings and close the io_uring fd
+static void _buffer_uring_free(struct buffer_uring_s* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
 }
 
-// Toggle is_style_disabled
-int buffer_set_styles_enabled(buffer_t* self, int is_enabled) {
-    if (!self->is_style_disabled && !is_enabled) {
-        self->is_style_disabled = 1;
-    } else if (self->is_style_disabled && is_enabled) {
-        self->is_style_disabled = 0;
-        buffer_apply_styles(self, self->first_line, self->line_count);
-    }
-    return MLBUF_OK;
+// Queue a readv or writev (opcode) of fd at off with iovcnt entries of iov
+// and submit it. iov and its buffers must stay valid until its completion
+// is reaped.
+static int _buffer_uring_submit(struct buffer_uring_s* ring, int opcode, int fd, struct iovec* iov, int iovcnt, off_t off, uint64_t user_data) {
+    struct io_uring_sqe* sqe;
+    unsigned tail;
+    unsigned index;
+    long submit_rc;
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = (uint32_t)iovcnt;
+    sqe->off = (uint64_t)off;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while ((submit_rc = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR);
+    return submit_rc == 1 ? MLBUF_OK : MLBUF_ERR;
 }
 
-// Apply styles from start_line
-int buffer_apply_styles(buffer_t* self, bline_t* start_line, bint_t line_delta) {
-    bint_t min_nlines;
-    srule_node_t* srule_node;
-    int count_tmp;
-    int srule_count;
+// Wait for a completion and return its result and user_data
+static int _buffer_uring_wait(struct buffer_uring_s* ring, int* ret_res, uint64_t* ret_user_data) {
+    struct io_uring_cqe* cqe;
+    unsigned head;
 
-    if (self->is_style_disabled) {
-        return MLBUF_OK;
+    while (1) {
+        head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            *ret_res = cqe->res;
+            *ret_user_data = cqe->user_data;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return MLBUF_OK;
+        }
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return MLBUF_ERR;
+        }
     }
+}
+#endif
 
-    // min_nlines, minimum number of lines to style
-    //     line_delta  < 0: 2 (start_line + 1)
-    //     line_delta == 0: 1 (start_line)
-    //     line_delta  > 0: 1 + line_delta (start_line + added lines)
-    min_nlines = 1 + (line_delta < 0 ? 1 : line_delta);
+// Return 1 if the regular file open at fd starts with the gzip magic bytes
+static int _buffer_is_gzip(int fd) {
+    unsigned char magic[2];
+    if (pread(fd, magic, 2, 0) != 2) {
+        return 0;
+    }
+    return magic[0] == 0x1f && magic[1] == 0x8b ? 1 : 0;
+}
 
-    // Count current srules
-    srule_count = 0;
-    DL_COUNT(self->single_srules, srule_node, count_tmp);
-    srule_count += count_tmp;
-    DL_COUNT(self->multi_srules, srule_node, count_tmp);
-    srule_count += count_tmp;
+// Copy src_fd to dst_fd from their current offsets until EOF. Let the
+// kernel do it with copy_file_range where possible, otherwise fall back to
+// large read/write blocks.
+static int _buffer_copy_fd(int src_fd, int dst_fd) {
+    char* buf;
+    ssize_t nread;
+    ssize_t nwritten;
+    ssize_t write_rc;
 
-    // Apply rules if there are any, or if the number of rules changed
-    if (srule_count > 0 || self->num_applied_srules != srule_count) {
-        _buffer_apply_styles_singles(start_line, min_nlines);
-        _buffer_apply_styles_multis(start_line, min_nlines, MLBUF_SRULE_TYPE_MULTI);
-        _buffer_apply_styles_multis(start_line, min_nlines, MLBUF_SRULE_TYPE_RANGE);
-        self->num_applied_srules = srule_count;
+#ifdef __linux__
+    while ((nread = copy_file_range(src_fd, NULL, dst_fd, NULL, MLBUF_READ_CHUNK_SIZE, 0)) > 0);
+    if (nread == 0) {
+        return MLBUF_OK;
+    } else if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+        return MLBUF_ERR;
     }
+#endif
 
+    if (!(buf = malloc(MLBUF_READ_CHUNK_SIZE))) {
+        return MLBUF_ERR;
+    }
+    while (1) {
+        nread = read(src_fd, buf, MLBUF_READ_CHUNK_SIZE);
+        if (nread == 0) {
+            break;
+        } else if (nread < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return MLBUF_ERR;
+        }
+        for (nwritten = 0; nwritten < nread; nwritten += write_rc) {
+            write_rc = write(dst_fd, buf + nwritten, nread - nwritten);
+            if (write_rc < 0) {
+                if (errno == EINTR) {
+                    write_rc = 0;
+                    continue;
+                }
+                free(buf);
+                return MLBUF_ERR;
+            }
+        }
+    }
+    free(buf);
     return MLBUF_OK;
 }
 
-// Set register
-int buffer_register_set(buffer_t* self, char reg, char* data, size_t data_len) {
-    MLBUF_ENSURE_AZ(reg);
-    str_set_len(MLBUF_REG_PTR(self, reg), data, data_len);
+// writev all of iov to fd, resuming after partial writes. Adds the number
+// of bytes written to nbytes.
+static int _buffer_writev_all(int fd, struct iovec* iov, int iovcnt, size_t* nbytes) {
+    ssize_t write_rc;
+    size_t remaining;
+    while (iovcnt > 0) {
+        write_rc = writev(fd, iov, iovcnt);
+        if (write_rc < 0) {
+            if (errno == EINTR) continue;
+            return MLBUF_ERR;
+        } else if (write_rc == 0) {
+            return MLBUF_ERR;
+        }
+        *nbytes += write_rc;
+
+        // Skip fully written entries and advance into a partial one
+        remaining = (size_t)write_rc;
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
     return MLBUF_OK;
 }
 
-// Append to register
-int buffer_register_append(buffer_t* self, char reg, char* data, size_t data_len) {
-    MLBUF_ENSURE_AZ(reg);
-    str_append_len(MLBUF_REG_PTR(self, reg), data, data_len);
-    return MLBUF_OK;
+// Return the byte length of the run of unedited lines starting at bline
+// whose data is contiguous in self->mmap, not counting the last line's
+// newline. Sets ret_end to the last line of the run.
+static bint_t _buffer_mmap_run(buffer_t* self, bline_t* bline, bline_t** ret_end) {
+    bline_t* cur;
+    *ret_end = bline;
+    if (!self->mmap
+        || !bline->is_data_slabbed
+        || bline->data < self->mmap
+        || bline->data + bline->data_len > self->mmap + self->mmap_len
+    ) {
+        return 0;
+    }
+    for (cur = bline; cur->next
+        && cur->next->is_data_slabbed
+        && cur->next->data == cur->data + cur->data_len + 1
+        && cur->next->data + cur->next->data_len <= self->mmap + self->mmap_len;
+        cur = cur->next
+    );
+    *ret_end = cur;
+    return (bint_t)((cur->data + cur->data_len) - bline->data);
 }
 
-// Prepend to register
-int buffer_register_prepend(buffer_t* self, char reg, char* data, size_t data_len) {
-    MLBUF_ENSURE_AZ(reg);
-    str_prepend_len(MLBUF_REG_PTR(self, reg), data, data_len);
-    return MLBUF_OK;
+// Write len bytes of self->mmap starting at off to fd. Let the kernel copy
+// from the mapped file with copy_file_range where possible (sharing extents
+// on file systems that support it), and write the rest from memory. Adds
+// the number of bytes written to nbytes.
+static int _buffer_write_mmap_range(buffer_t* self, size_t off, size_t len, int fd, size_t* nbytes) {
+    struct iovec iov;
+#ifdef __linux__
+    loff_t off_in;
+    ssize_t copy_rc;
+
+    off_in = (loff_t)off;
+    while (len > 0 && (copy_rc = copy_file_range(self->mmap_fd, &off_in, fd, NULL, len, 0)) > 0) {
+        off += copy_rc;
+        len -= copy_rc;
+        *nbytes += copy_rc;
+    }
+#endif
+
+    iov = (struct iovec){ .iov_base = self->mmap + off, .iov_len = len };
+    return _buffer_writev_all(fd, &iov, len > 0 ? 1 : 0, nbytes);
 }
 
-// Clear register
-int buffer_register_clear(buffer_t* self, char reg) {
-    MLBUF_ENSURE_AZ(reg);
-    str_free(MLBUF_REG_PTR(self, reg));
+// Write buffer data to fd, gzip compressing as it streams
+static int _buffer_write_to_gzip(buffer_t* self, int fd, size_t* optret_nbytes) {
+    bline_t* bline;
+    size_t nbytes;
+    int gz_fd;
+    gzFile gz;
+    int rc;
+    *optret_nbytes = 0;
+    if ((gz_fd = dup(fd)) < 0) {
+        return MLBUF_ERR;
+    } else if (!(gz = gzdopen(gz_fd, "wb"))) {
+        close(gz_fd);
+        return MLBUF_ERR;
+    }
+    gzbuffer(gz, MLBUF_GZIP_BUFFER_SIZE);
+    rc = MLBUF_OK;
+    nbytes = 0;
+    for (bline = self->first_line; bline && rc == MLBUF_OK; bline = bline->next) {
+        if (_buffer_gzwrite_all(gz, bline->data, (size_t)bline->data_len) != MLBUF_OK) {
+            rc = MLBUF_ERR;
+        } else if (bline->next && gzwrite(gz, "\n", 1) != 1) {
+            rc = MLBUF_ERR;
+        }
+        if (rc == MLBUF_OK) nbytes += bline->data_len + (bline->next ? 1 : 0);
+    }
+    if (gzclose(gz) != Z_OK) rc = MLBUF_ERR;
+    if (rc == MLBUF_OK) *optret_nbytes = nbytes;
+    return rc;
+}
+
+// gzwrite all of data. gzwrite takes an unsigned length and returns an int,
+// so feed it in chunks to handle data of 2GB or more.
+static int _buffer_gzwrite_all(gzFile gz, char* data, size_t len) {
+    unsigned chunk;
+    while (len > 0) {
+        chunk = (unsigned)MLBUF_MIN(len, MLBUF_READ_CHUNK_SIZE);
+        if (gzwrite(gz, data, chunk) != (int)chunk) {
+            return MLBUF_ERR;
+        }
+        data += chunk;
+        len -= chunk;
+    }
     return MLBUF_OK;
 }
 
-// Get register, optionally allocating duplicate
-int buffer_register_get(buffer_t* self, char reg, int dup, char** ret_data, size_t* ret_data_len) {
-    str_t* sreg;
-    MLBUF_ENSURE_AZ(reg);
-    sreg = MLBUF_REG_PTR(self, reg);
-    if (dup) {
-        *ret_data = strndup(sreg->data, sreg->len);
-        *ret_data_len = strlen(*ret_data);
-    } else {
-        *ret_data = sreg->len > 0 ? sreg->data : "";
-        *ret_data_len = sreg->len;
+// Replace all lines with a single empty line and discard the undo stack.
+// Marks are moved to the new line. Slabs and mmap are released as no lines
+// refer to them anymore.
+static int _buffer_reset(buffer_t* self) {
+    bline_t* new_line;
+    bline_t* line;
+    bline_t* line_tmp;
+    mark_t* mark;
+    mark_t* mark_tmp;
+
+    // Truncate undo stack
+    if (self->actions) _buffer_truncate_undo_stack(self, self->actions);
+    self->action_undone = NULL;
+
+    // Free lines, moving marks to new_line
+    new_line = _buffer_bline_new(self);
+    for (line = self->first_line; line; ) {
+        line_tmp = line->next;
+        DL_FOREACH_SAFE(line->marks, mark, mark_tmp) {
+            _mark_mark_move_inner(mark, new_line, 0, 1, 0);
+        }
+        _buffer_bline_free(line, NULL, 0);
+        line = line_tmp;
     }
+    _buffer_munmap(self);
+    if (self->slabbed_blines) free(self->slabbed_blines);
+    if (self->slabbed_chars) free(self->slabbed_chars);
+    self->slabbed_blines = NULL;
+    self->slabbed_chars = NULL;
+
+    self->first_line = new_line;
+    self->last_line = new_line;
+    self->byte_count = 0;
+    self->line_count = 1;
+    self->is_data_dirty = 1;
+    self->data_hint_line = NULL;
+    self->version += 1;
     return MLBUF_OK;
 }
 
-static int _buffer_open_mmap(buffer_t* self, int fd, size_t size) {
-    char tmppath[16];
-    int tmpfd;
-    char readbuf[1024];
-    ssize_t nread;
-    char* mmap_buf;
+// Append data to the end of the buffer without recording an undo action.
+// Marks at the end of the buffer move as if data was inserted there. A single
+// insert action is raised on the listener. Its data is borrowed from the
+// caller.
+static int _buffer_append(buffer_t* self, char* data, bint_t data_len) {
+    bline_t* orig_last_line;
+    bint_t orig_col;
+    bint_t nchars;
+    baction_t* action;
+    mark_t* mark;
+    mark_t* mark_tmp;
 
-    // Copy fd to tmp file
-    sprintf(tmppath, "%s", "/tmp/mle-XXXXXX");
-    tmpfd = mkstemp(tmppath);
-    if (tmpfd < 0) {
-        return MLBUF_ERR;
-    }
-    unlink(tmppath);
-    while (1) {
-        nread = read(fd, &readbuf, 1024);
-        if (nread == 0) {
-            break;
-        } else if (nread < 0) {
-            close(tmpfd);
-            return MLBUF_ERR;
-        }
-        if (write(tmpfd, readbuf, nread) != nread) {
-            close(tmpfd);
-            return MLBUF_ERR;
+    // Remember where we started
+    orig_last_line = self->last_line;
+    MLBUF_BLINE_ENSURE_CHARS(orig_last_line);
+    orig_col = orig_last_line->char_count;
+
+    // Build lines from data
+    nchars = _buffer_bulk_append(self, data, data_len);
+
+    // Move marks at end of buffer
+    MLBUF_BLINE_ENSURE_CHARS(self->last_line);
+    DL_FOREACH_SAFE(orig_last_line->marks, mark, mark_tmp) {
+        if (mark_is_after_col_minus_lefties(mark, orig_col)) {
+            _mark_mark_move_inner(mark, self->last_line, self->last_line->char_count, 1, 0);
         }
     }
 
-    // Now mmap tmp file
-    mmap_buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, tmpfd, 0);
-    if (mmap_buf == MAP_FAILED) {
-        return MLBUF_ERR;
-    } else if (buffer_set_mmapped(self, mmap_buf, (bint_t)size) != MLBUF_OK) {
-        return MLBUF_ERR;
+    // Set unsaved
+    self->is_unsaved = 1;
+
+    // Restyle from orig_last_line
+    buffer_apply_styles(self, orig_last_line, self->last_line->line_index - orig_last_line->line_index);
+
+    // Raise event on listener
+    if (self->callback && !self->is_in_callback) {
+        action = calloc(1, sizeof(baction_t));
+        action->type = MLBUF_BACTION_TYPE_INSERT;
+        action->buffer = self;
+        action->start_line = orig_last_line;
+        action->start_line_index = orig_last_line->line_index;
+        action->start_col = orig_col;
+        action->maybe_end_line = self->last_line;
+        action->maybe_end_line_index = self->last_line->line_index;
+        action->maybe_end_col = self->last_line->char_count;
+        action->byte_delta = data_len;
+        action->char_delta = nchars;
+        action->line_delta = self->last_line->line_index - orig_last_line->line_index;
+        action->data = data;
+        action->data_len = data_len;
+        self->is_in_callback = 1;
+        self->callback(self, action, self->callback_udata);
+        self->is_in_callback = 0;
+        free(action);
     }
 
-    _buffer_munmap(self);
-    self->mmap = mmap_buf;
-    self->mmap_len = size;
-    self->mmap_fd = tmpfd;
     return MLBUF_OK;
 }
 
-static int _buffer_open_read(buffer_t* self, int fd, size_t size) {
-    int rc;
-    char* buf;
-    buf = malloc(size);
-    rc = MLBUF_OK;
-    if (size != (size_t)read(fd, buf, size)) {
-        rc = MLBUF_ERR;
-    } else if (buffer_set(self, buf, (bint_t)size) != MLBUF_OK) {
-        rc = MLBUF_ERR;
+// Append data to the end of the buffer, building lines directly from data.
+// No undo action is recorded, no styles are applied, and no callback is
+// raised. Chars are counted lazily. Return number of chars appended.
+static bint_t _buffer_bulk_append(buffer_t* self, char* data, bint_t data_len) {
+    bline_t* cur_line;
+    bline_t* new_line;
+    char* data_cursor;
+    char* data_newline;
+    bint_t data_remaining_len;
+    bint_t line_len;
+    bint_t nchars;
+
+    cur_line = self->last_line;
+    data_cursor = data;
+    data_remaining_len = data_len;
+    nchars = 0;
+    while (data_remaining_len > 0) {
+        data_newline = memchr(data_cursor, '\n', data_remaining_len);
+        line_len = data_newline
+            ? (bint_t)(data_newline - data_cursor)
+            : data_remaining_len;
+
+        // Copy line data
+        if (line_len > 0) {
+            if (cur_line->is_data_slabbed) _buffer_bline_unslab(cur_line);
+            if (cur_line->data_len + line_len > cur_line->data_cap) {
+                cur_line->data = realloc(cur_line->data, cur_line->data_len + line_len);
+                cur_line->data_cap = cur_line->data_len + line_len;
+            }
+            memcpy(cur_line->data + cur_line->data_len, data_cursor, line_len);
+            cur_line->data_len += line_len;
+            cur_line->is_chars_dirty = 1;
+            nchars += _buffer_count_chars(data_cursor, line_len);
+        }
+        if (!data_newline) break;
+
+        // Start a new line
+        new_line = _buffer_bline_new(self);
+        new_line->line_index = cur_line->line_index + 1;
+        new_line->prev = cur_line;
+        cur_line->next = new_line;
+        cur_line = new_line;
+        self->line_count += 1;
+        nchars += 1;
+
+        data_remaining_len -= line_len + 1;
+        data_cursor = data_newline + 1;
     }
-    free(buf);
-    return rc;
+
+    self->last_line = cur_line;
+    self->byte_count += data_len;
+    self->is_data_dirty = 1;
+    self->version += 1;
+    return nchars;
+}
+
+// Count chars in data the same way bline_count_chars does
+static bint_t _buffer_count_chars(char* data, bint_t data_len) {
+    char* c;
+    char* stop;
+    int char_len;
+    bint_t nchars;
+    c = data;
+    stop = data + data_len;
+    nchars = 0;
+    while (c < stop) {
+        char_len = *c == 0 ? 1 : utf8_char_length(*c);
+        c += MLBUF_MIN(char_len, (bint_t)(stop - c));
+        nchars += 1;
+    }
+    return nchars;
 }
 
 static int _buffer_bline_unslab(bline_t* self) {
@@ -1131,19 +4303,332 @@ static void _buffer_stat(buffer_t* self) {
     stat(self->path, &self->st); // TODO err?
 }
 
+// Append an edit to the journal. nchars is used by deletes, data by inserts.
+static int _buffer_journal_write(buffer_t* self, int type, bint_t line_index, bint_t col, bint_t nchars, char* data, bint_t data_len) {
+    struct buffer_journal_record_s record;
+    if (!self->journal || self->is_in_open || self->is_in_journal_replay) {
+        return MLBUF_OK;
+    }
+    record = (struct buffer_journal_record_s){
+        .type = type,
+        .line_index = line_index,
+        .col = col,
+        .nchars = nchars,
+        .data_len = data_len,
+    };
+    if (fwrite(&record, sizeof(record), 1, self->journal) != 1
+        || (data_len > 0 && fwrite(data, data_len, 1, self->journal) != 1)
+    ) {
+        // Remember the lost record for buffer_journal_flush
+        self->is_journal_failed = 1;
+        return MLBUF_ERR;
+    }
+    return MLBUF_OK;
+}
+
+// Drop all journal records. Called when the buffer matches its file, which
+// becomes the journal's new base.
+static int _buffer_journal_truncate(buffer_t* self) {
+    struct buffer_journal_header_s header;
+    if (!self->journal) {
+        return MLBUF_OK;
+    }
+    fflush(self->journal);
+    if (ftruncate(fileno(self->journal), 0) != 0) {
+        return MLBUF_ERR;
+    }
+    rewind(self->journal);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MLBUF_JOURNAL_MAGIC, sizeof(header.magic));
+    header.size = (uint64_t)self->st.st_size;
+    header.mtime_sec = (int64_t)self->st.st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t)self->st.st_mtim.tv_nsec;
+    header.base_size = header.size;
+    if (fwrite(&header, sizeof(header), 1, self->journal) != 1 || fflush(self->journal) != 0) {
+        self->is_journal_failed = 1;
+        return MLBUF_ERR;
+    }
+    self->is_journal_failed = 0;
+    return MLBUF_OK;
+}
+
+// Move the journal to the file as it is now, after buffer_follow appended
+// the bytes it grew by at orig_last_line:orig_col. Without unsaved edits the
+// file is the new base. Otherwise the appended bytes are recorded as an
+// insert after the edits, and the header is updated in place, keeping the
+// old base size. Either way only the appended bytes are touched.
+static int _buffer_journal_rebase(buffer_t* self, bline_t* orig_last_line, bint_t orig_col) {
+    struct buffer_journal_header_s header;
+    char* data;
+    bint_t data_len;
+    bint_t data_nchars;
+    int rc;
+    if (!self->journal) {
+        return MLBUF_OK;
+    } else if (!self->is_unsaved) {
+        return _buffer_journal_truncate(self);
+    }
+
+    // Record appended bytes
+    MLBUF_BLINE_ENSURE_CHARS(self->last_line);
+    buffer_substr(self, orig_last_line, orig_col, self->last_line, self->last_line->char_count, &data, &data_len, &data_nchars);
+    rc = _buffer_journal_write(self, MLBUF_BACTION_TYPE_INSERT, orig_last_line->line_index, orig_col, 0, data, data_len);
+    free(data);
+    if (rc != MLBUF_OK || fflush(self->journal) != 0) {
+        self->is_journal_failed = 1;
+        return MLBUF_ERR;
+    }
+
+    // Point header at the grown file
+    if (pread(fileno(self->journal), &header, sizeof(header), 0) != sizeof(header)) {
+        self->is_journal_failed = 1;
+        return MLBUF_ERR;
+    }
+    header.size = (uint64_t)self->st.st_size;
+    header.mtime_sec = (int64_t)self->st.st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t)self->st.st_mtim.tv_nsec;
+    if (pwrite(fileno(self->journal), &header, sizeof(header), 0) != sizeof(header)) {
+        self->is_journal_failed = 1;
+        return MLBUF_ERR;
+    }
+    return MLBUF_OK;
+}
+
+// Return 1 if the data of a journal record read back from disk is
+// well-formed for its type, i.e., permutations are permutations and join and
+// split line counts fit in the data.
+static int _buffer_journal_is_record_valid(struct buffer_journal_record_s* record, char* data) {
+    bint_t* values;
+    bint_t nvalues;
+    bint_t nlines;
+    char* seen;
+    bint_t i;
+    int is_valid;
+    values = (bint_t*)data;
+    nvalues = (bint_t)record->data_len / (bint_t)sizeof(bint_t);
+    if (record->type == MLBUF_BACTION_TYPE_PERMUTE) {
+        if (nvalues < 1 || record->data_len % sizeof(bint_t) != 0) {
+            return 0;
+        }
+        seen = calloc(nvalues, 1);
+        is_valid = 1;
+        for (i = 0; i < nvalues && is_valid; i++) {
+            if (values[i] < 0 || values[i] >= nvalues || seen[values[i]]) {
+                is_valid = 0;
+            } else {
+                seen[values[i]] = 1;
+            }
+        }
+        free(seen);
+        return is_valid;
+    } else if (record->type == MLBUF_BACTION_TYPE_JOIN || record->type == MLBUF_BACTION_TYPE_SPLIT) {
+        if (nvalues < 1) {
+            return 0;
+        }
+        nlines = values[0];
+        if (nlines < 1 || nlines > nvalues - 1) {
+            return 0;
+        }
+        for (i = 1; i <= nlines; i++) {
+            if (values[i] < 0) return 0;
+        }
+    }
+    return 1;
+}
+
+// Reaper thread body for buffer_destroy_async. Free lines in batches,
+// yielding in between so the reaper does not hog the allocator, then the
+// rest of the buffer.
+static void* _buffer_reap(void* arg) {
+    buffer_t* self;
+    bline_t* line;
+    bint_t i;
+    self = arg;
+    while (self->last_line) {
+        for (i = 0; self->last_line && i < MLBUF_REAP_BATCH_SIZE; i++) {
+            line = self->last_line;
+            self->last_line = line->prev;
+            _buffer_bline_free(line, NULL, 0);
+        }
+        sched_yield();
+    }
+    self->first_line = NULL;
+    buffer_destroy(self);
+
+    pthread_mutex_lock(&reap_lock);
+    reap_count -= 1;
+    pthread_cond_broadcast(&reap_cond);
+    pthread_mutex_unlock(&reap_lock);
+    return NULL;
+}
+
+// Drop all srule nodes without restyling, releasing marks used as ranges
+static void _buffer_detach_srules(buffer_t* self) {
+    srule_node_t* node;
+    srule_node_t* node_tmp;
+    DL_FOREACH_SAFE(self->single_srules, node, node_tmp) {
+        DL_DELETE(self->single_srules, node);
+        free(node);
+    }
+    DL_FOREACH_SAFE(self->multi_srules, node, node_tmp) {
+        if (node->srule->type == MLBUF_SRULE_TYPE_RANGE) {
+            node->srule->range_a->range_srule = NULL;
+            node->srule->range_b->range_srule = NULL;
+        }
+        DL_DELETE(self->multi_srules, node);
+        free(node);
+    }
+}
+
+// Worker thread body for buffer_save_as_async. Touches only the job.
+static void* _buffer_save_job_run(void* arg) {
+    buffer_save_job_t* job;
+    int fd;
+    int gz_fd;
+    gzFile gz;
+    int i;
+
+    job = arg;
+    job->rc = MLBUF_ERR;
+    job->nbytes = 0;
+    do {
+        if ((fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            break;
+        }
+        if (!job->is_gzip) {
+            job->rc = MLBUF_OK;
+            for (i = 0; i < job->iovcnt && job->rc == MLBUF_OK; i += MLBUF_IOV_MAX) {
+                job->rc = _buffer_writev_all(fd, job->iov + i, MLBUF_MIN(job->iovcnt - i, MLBUF_IOV_MAX), &job->nbytes);
+            }
+        } else if ((gz_fd = dup(fd)) >= 0) {
+            if ((gz = gzdopen(gz_fd, "wb")) != NULL) {
+                gzbuffer(gz, MLBUF_GZIP_BUFFER_SIZE);
+                job->rc = MLBUF_OK;
+                for (i = 0; i < job->iovcnt && job->rc == MLBUF_OK; i++) {
+                    job->rc = _buffer_gzwrite_all(gz, job->iov[i].iov_base, job->iov[i].iov_len);
+                    job->nbytes += job->iov[i].iov_len;
+                }
+                if (gzclose(gz) != Z_OK) job->rc = MLBUF_ERR;
+            } else {
+                close(gz_fd);
+            }
+        }
+        close(fd);
+    } while(0);
+
+    __atomic_store_n(&job->is_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Describe the buffer's contents as iovecs for buffer_save_as_async. Runs of
+// unedited lines are referenced in the mmap, with the newline after them if
+// the mmap has it. Everything else is copied to arena, with adjacent copies
+// sharing an iovec. If iov and arena are NULL, only count what they need.
+static void _buffer_snapshot(buffer_t* self, struct iovec* iov, char* arena, int* ret_iovcnt, size_t* ret_arena_len) {
+    bline_t* bline;
+    bline_t* run_end;
+    bint_t run_len;
+    size_t copy_len;
+    size_t arena_len;
+    int iovcnt;
+    int is_newline_done;
+    int is_last_copy;
+
+    iovcnt = 0;
+    arena_len = 0;
+    is_last_copy = 0;
+    for (bline = self->first_line; bline; bline = bline->next) {
+        run_len = _buffer_mmap_run(self, bline, &run_end);
+        is_newline_done = 0;
+        copy_len = 0;
+        if (run_len > 0) {
+            is_newline_done = run_end->next
+                && bline->data + run_len < self->mmap + self->mmap_len
+                && bline->data[run_len] == '\n';
+            if (iov) iov[iovcnt] = (struct iovec){ .iov_base = bline->data, .iov_len = (size_t)run_len + is_newline_done };
+            iovcnt += 1;
+            is_last_copy = 0;
+            bline = run_end;
+        } else {
+            copy_len = (size_t)bline->data_len;
+            if (arena && copy_len > 0) memcpy(arena + arena_len, bline->data, copy_len);
+        }
+        if (bline->next && !is_newline_done) {
+            if (arena) arena[arena_len + copy_len] = '\n';
+            copy_len += 1;
+        }
+        if (copy_len == 0) {
+            continue;
+        } else if (is_last_copy) {
+            if (iov) iov[iovcnt - 1].iov_len += copy_len;
+        } else {
+            if (iov) iov[iovcnt] = (struct iovec){ .iov_base = arena + arena_len, .iov_len = copy_len };
+            iovcnt += 1;
+            is_last_copy = 1;
+        }
+        arena_len += copy_len;
+    }
+    *ret_iovcnt = iovcnt;
+    *ret_arena_len = arena_len;
+}
+
 static int _buffer_baction_do(buffer_t* self, bline_t* bline, baction_t* action, int is_redo, bint_t* opt_repeat_offset) {
     int rc;
     bint_t col;
     bint_t offset;
+    bint_t nlines;
+    bint_t i;
+    bint_t* perm;
+    bline_t* end_line;
     self->_is_in_undo = 1;
-    col = opt_repeat_offset ? *opt_repeat_offset : action->start_col;
-    buffer_get_offset(self, bline, col, &offset);
+    if (action->type == MLBUF_BACTION_TYPE_PERMUTE) {
+        // Redo the permutation or apply its inverse
+        nlines = action->data_len / sizeof(bint_t);
+        perm = malloc(action->data_len);
+        for (i = 0; i < nlines; i++) {
+            if (is_redo) {
+                perm[i] = ((bint_t*)action->data)[i];
+            } else {
+                perm[((bint_t*)action->data)[i]] = i;
+            }
+        }
+        rc = _buffer_permute_lines(self, bline, nlines, perm);
+        self->_is_in_undo = 0;
+        return rc;
+    } else if (action->type == MLBUF_BACTION_TYPE_JOIN) {
+        // Split the line again or redo the join
+        nlines = ((bint_t*)action->data)[0];
+        if (is_redo) {
+            rc = _buffer_join_lines(self, bline, nlines, action->data + sizeof(bint_t) * (nlines + 1), action->data_len - sizeof(bint_t) * (nlines + 1));
+        } else {
+            rc = _buffer_split_line(self, bline, action->data, action->data_len);
+        }
+        self->_is_in_undo = 0;
+        return rc;
+    } else if (action->type == MLBUF_BACTION_TYPE_DELETE && -1 * action->line_delta >= MLBUF_DETACH_MIN_LINES && !opt_repeat_offset) {
+        // Link the detached lines back in or detach them again
+        if (is_redo) {
+            for (end_line = bline, i = 0; end_line && i < -1 * action->line_delta; i++) end_line = end_line->next;
+            rc = end_line ? _buffer_detach_lines(self, bline, action->start_col, end_line, action->maybe_end_col, -1 * action->char_delta, -1 * action->line_delta, action) : MLBUF_ERR;
+        } else {
+            rc = action->maybe_lines ? _buffer_attach_lines(self, bline, action) : MLBUF_ERR;
+        }
+        self->_is_in_undo = 0;
+        return rc;
+    }
+    // Edit at the action's line and col, or at a repeat offset from bline
+    if (opt_repeat_offset) {
+        buffer_get_offset(self, bline, *opt_repeat_offset, &offset);
+        buffer_get_bline_col(self, offset, &bline, &col);
+    } else {
+        col = action->start_col;
+    }
     if ((action->type == MLBUF_BACTION_TYPE_DELETE && is_redo)
         || (action->type == MLBUF_BACTION_TYPE_INSERT && !is_redo)
     ) {
-        rc = buffer_delete(self, offset, (bint_t)((is_redo ? -1 : 1) * action->char_delta));
+        rc = buffer_delete_w_bline(self, bline, col, (bint_t)((is_redo ? -1 : 1) * action->char_delta));
     } else {
-        rc = buffer_insert(self, offset, action->data, action->data_len, NULL);
+        rc = buffer_insert_w_bline(self, bline, col, action->data, action->data_len, NULL);
     }
     self->_is_in_undo = 0;
     return rc;
@@ -1157,27 +4642,52 @@ static int _buffer_update(buffer_t* self, baction_t* action) {
     // Adjust counts
     self->byte_count += action->byte_delta;
     self->line_count += action->line_delta;
-    self->is_data_dirty = 1;
+    if (!self->is_data_dirty && _buffer_update_data(self, action) != MLBUF_OK) {
+        self->is_data_dirty = 1;
+    }
+    self->is_data_read = 0;
+    self->version += 1;
 
     // Set unsaved
     self->is_unsaved = 1;
 
-    // Renumber lines
-    if (action->line_delta != 0) {
-        last_line = NULL;
-        new_line_index = action->start_line->line_index;
-        for (tmp_line = action->start_line->next; tmp_line != NULL; tmp_line = tmp_line->next) {
-            tmp_line->line_index = ++new_line_index;
-            last_line = tmp_line;
+    if (self->action_group) {
+        // In buffer_apply_edits, which renumbers, restyles, and notifies
+        // once at the end. Only keep last_line valid.
+        tmp_line = action->maybe_end_line ? action->maybe_end_line : action->start_line;
+        if (!tmp_line->next) self->last_line = tmp_line;
+    } else {
+        // Renumber lines
+        if (action->line_delta != 0) {
+            last_line = NULL;
+            new_line_index = action->start_line->line_index;
+            for (tmp_line = action->start_line->next; tmp_line != NULL; tmp_line = tmp_line->next) {
+                tmp_line->line_index = ++new_line_index;
+                last_line = tmp_line;
+            }
+            self->last_line = last_line ? last_line : action->start_line;
         }
-        self->last_line = last_line ? last_line : action->start_line;
+
+        // Restyle from start_line
+        buffer_apply_styles(self, action->start_line, action->type == MLBUF_BACTION_TYPE_PERMUTE
+            ? action->maybe_end_line_index - action->start_line_index
+            : action->line_delta
+        );
     }
 
-    // Restyle from start_line
-    buffer_apply_styles(self, action->start_line, action->line_delta);
+    // Append to journal
+    _buffer_journal_write(
+        self,
+        action->type,
+        action->start_line_index,
+        action->start_col,
+        -1 * action->char_delta,
+        action->type != MLBUF_BACTION_TYPE_DELETE ? action->data : NULL,
+        action->type != MLBUF_BACTION_TYPE_DELETE ? action->data_len : 0
+    );
 
     // Raise event on listener
-    if (self->callback && !self->is_in_callback) {
+    if (self->callback && !self->is_in_callback && !self->action_group) {
         self->is_in_callback = 1;
         self->callback(self, action, self->callback_udata);
         self->is_in_callback = 0;
@@ -1185,14 +4695,114 @@ static int _buffer_update(buffer_t* self, baction_t* action) {
 
     // Handle undo stack
     if (self->_is_in_undo) {
+        if (action->type == MLBUF_BACTION_TYPE_DELETE) {
+            // A detached chain belongs to the action being redone
+            action->maybe_lines = NULL;
+        }
         _baction_destroy(action);
     } else {
+        action->group = self->action_group;
         _buffer_add_to_undo_stack(self, action);
     }
 
     return MLBUF_OK;
 }
 
+// Apply action to the flattened contents in self->data with one memmove
+// instead of rebuilding them. The offset of action->start_line is found by
+// walking forward from the line of the previous edit, so nearby edits are
+// cheap. Slack at the end of self->data absorbs growth.
+static int _buffer_update_data(buffer_t* self, baction_t* action) {
+    bline_t* bline;
+    bline_t* tmp_line;
+    bint_t offset;
+    bint_t new_cap;
+    bint_t len;
+
+    // Find byte offset of start_line. Lines before it are unchanged.
+    if (self->data_hint_line && self->data_hint_line->line_index <= action->start_line->line_index) {
+        bline = self->data_hint_line;
+        offset = self->data_hint_offset;
+    } else {
+        bline = self->first_line;
+        offset = 0;
+    }
+    for (; bline && bline != action->start_line; bline = bline->next) {
+        offset += bline->data_len + 1;
+    }
+    if (!bline) {
+        return MLBUF_ERR;
+    }
+    self->data_hint_line = bline;
+    self->data_hint_offset = offset;
+
+    // If nobody has read the contents since the last edit, leave a large
+    // shift to the next buffer_get instead of paying for it on every edit
+    if (!self->is_data_read && self->data_len - offset > MLBUF_DATA_UPDATE_MAX_SHIFT) {
+        return MLBUF_ERR;
+    }
+
+    // Lines start_line thru maybe_end_line were relinked, joined or split,
+    // or reattached without a copy of their data.
+    // Shift the tail by byte_delta and rewrite them.
+    if (action->type == MLBUF_BACTION_TYPE_PERMUTE
+        || action->type == MLBUF_BACTION_TYPE_JOIN
+        || action->type == MLBUF_BACTION_TYPE_SPLIT
+        || (action->type == MLBUF_BACTION_TYPE_INSERT && !action->data)
+    ) {
+        len = 0;
+        for (tmp_line = bline; tmp_line; tmp_line = tmp_line->next) {
+            len += tmp_line->data_len;
+            if (tmp_line == action->maybe_end_line) break;
+            len += 1;
+        }
+        if (!tmp_line || offset + len - action->byte_delta > self->data_len) {
+            return MLBUF_ERR;
+        }
+        if (self->data_len + action->byte_delta + 1 > self->data_cap) {
+            new_cap = MLBUF_MAX(self->data_len + action->byte_delta + 1, self->data_cap * 2);
+            self->data = realloc(self->data, new_cap);
+            self->data_cap = new_cap;
+        }
+        memmove(self->data + offset + len, self->data + offset + len - action->byte_delta, self->data_len - (offset + len - action->byte_delta) + 1);
+        self->data_len += action->byte_delta;
+        for (; bline; bline = bline->next) {
+            if (bline->data_len > 0) memcpy(self->data + offset, bline->data, bline->data_len);
+            offset += bline->data_len;
+            if (bline == action->maybe_end_line) break;
+            self->data[offset++] = '\n';
+        }
+        return self->data_len == self->byte_count ? MLBUF_OK : MLBUF_ERR;
+    }
+
+    // Add index of start_col
+    MLBUF_BLINE_ENSURE_CHARS(bline);
+    offset += _buffer_bline_col_to_index(bline, action->start_col);
+    len = action->type == MLBUF_BACTION_TYPE_INSERT ? action->data_len : -1 * action->byte_delta;
+    if (offset > self->data_len) {
+        return MLBUF_ERR;
+    }
+
+    // Shift the tail, including the nul terminator, and fill in data
+    if (action->type == MLBUF_BACTION_TYPE_INSERT) {
+        if (self->data_len + len + 1 > self->data_cap) {
+            new_cap = MLBUF_MAX(self->data_len + len + 1, self->data_cap * 2);
+            self->data = realloc(self->data, new_cap);
+            self->data_cap = new_cap;
+        }
+        memmove(self->data + offset + len, self->data + offset, self->data_len - offset + 1);
+        memcpy(self->data + offset, action->data, len);
+        self->data_len += len;
+    } else {
+        if (offset + len > self->data_len) {
+            return MLBUF_ERR;
+        }
+        memmove(self->data + offset, self->data + offset + len, self->data_len - offset - len + 1);
+        self->data_len -= len;
+    }
+    return self->data_len == self->byte_count ? MLBUF_OK : MLBUF_ERR;
+}
+
 static int _buffer_truncate_undo_stack(buffer_t* self, baction_t* action_from) {
     baction_t* action_target;
     baction_t* action_tmp;
@@ -1238,6 +4848,7 @@ static int _buffer_apply_styles_singles(bline_t* start_line, bint_t min_nlines)
     styled_nlines = 0;
     while (cur_line && styled_nlines < min_nlines) {
         // Reset styles of cur_line
+        MLBUF_BLINE_ENSURE_CHARS(cur_line);
         for (i = 0; i < cur_line->data_cap; i++) {
             cur_line->chars[i].style = (sblock_t){0, 0};
         }
@@ -1432,6 +5043,9 @@ static bline_t* _buffer_bline_new(buffer_t* self) {
 static int _buffer_bline_free(bline_t* bline, bline_t* maybe_mark_line, bint_t col_delta) {
     mark_t* mark;
     mark_t* mark_tmp;
+    if (bline->buffer && bline->buffer->data_hint_line == bline) {
+        bline->buffer->data_hint_line = NULL;
+    }
     if (!bline->is_data_slabbed) {
         if (bline->data) free(bline->data);
         if (bline->chars) free(bline->chars);
@@ -1451,51 +5065,86 @@ static int _buffer_bline_free(bline_t* bline, bline_t* maybe_mark_line, bint_t c
     return MLBUF_OK;
 }
 
-static bline_t* _buffer_bline_break(bline_t* bline, bint_t col) {
+static bline_t* _buffer_bline_insert_lines(bline_t* bline, bint_t col, char* data, bint_t data_len, bint_t* ret_end_col, bint_t* ret_num_lines, bint_t* ret_num_chars) {
     bint_t index;
-    bint_t len;
+    bint_t head_len;
+    bint_t tail_len;
+    bint_t head_nchars;
+    bint_t tail_nchars;
+    bint_t seg_len;
+    bint_t num_lines;
+    bint_t num_chars;
+    bint_t end_col;
+    char* cursor;
+    char* stop;
+    char* newline;
+    bline_t* next_line;
+    bline_t* prev_line;
     bline_t* new_line;
-    bline_t* tmp_line;
     mark_t* mark;
     mark_t* mark_tmp;
 
     // Unslab if needed
     if (bline->is_data_slabbed) _buffer_bline_unslab(bline);
 
-    // Make new_line
-    new_line = _buffer_bline_new(bline->buffer);
-
     // Find byte index to break on
     index = _buffer_bline_col_to_index(bline, col);
-    len = bline->data_len - index;
-
-    if (len > 0) {
-        // Move data to new line
-        new_line->data = malloc(len);
-        memcpy(new_line->data, bline->data + index, len);
-        new_line->data_len = len;
-        new_line->data_cap = len;
-        bline_count_chars(new_line); // Update char widths
-
-        // Truncate orig line
-        bline->data_len -= len;
-        bline_count_chars(bline); // Update char widths
+    tail_len = bline->data_len - index;
+    head_nchars = MLBUF_MIN(col, bline->char_count);
+    tail_nchars = bline->char_count - head_nchars;
+
+    // Make a new line per remaining segment. The last one gets the tail.
+    head_len = (bint_t)((char*)memchr(data, '\n', data_len) - data);
+    stop = data + data_len;
+    cursor = data + head_len + 1;
+    next_line = bline->next;
+    prev_line = bline;
+    num_lines = 0;
+    num_chars = 0;
+    do {
+        newline = memchr(cursor, '\n', (size_t)(stop - cursor));
+        seg_len = (newline ? newline : stop) - cursor;
+        new_line = _buffer_bline_new(bline->buffer);
+        new_line->data_len = seg_len + (newline ? 0 : tail_len);
+        if (new_line->data_len > 0) {
+            new_line->data = malloc(new_line->data_len);
+            new_line->data_cap = new_line->data_len;
+            if (seg_len > 0) memcpy(new_line->data, cursor, seg_len);
+            if (!newline && tail_len > 0) memcpy(new_line->data + seg_len, bline->data + index, tail_len);
+            bline_count_chars(new_line);
+        }
+        num_chars += new_line->char_count + 1;
+        new_line->prev = prev_line;
+        prev_line->next = new_line;
+        prev_line = new_line;
+        num_lines += 1;
+        if (newline) cursor = newline + 1;
+    } while (newline);
+    new_line->next = next_line;
+    if (next_line) next_line->prev = new_line;
+    end_col = new_line->char_count - tail_nchars;
+    num_chars -= tail_nchars;
+
+    // Replace tail of orig line with first segment
+    if (index + head_len > bline->data_cap) {
+        bline->data = realloc(bline->data, index + head_len);
+        bline->data_cap = index + head_len;
     }
+    if (head_len > 0) memcpy(bline->data + index, data, head_len);
+    bline->data_len = index + head_len;
+    bline_count_chars(bline);
+    num_chars += bline->char_count - head_nchars;
 
-    // Insert new_line in linked list
-    tmp_line = bline->next;
-    bline->next = new_line;
-    new_line->next = tmp_line;
-    new_line->prev = bline;
-    if (tmp_line) tmp_line->prev = new_line;
-
-    // Move marks at or past col to new_line
+    // Move marks at or past col to the last line
     DL_FOREACH_SAFE(bline->marks, mark, mark_tmp) {
         if (mark->col >= col) {
-            _mark_mark_move_inner(mark, new_line, mark->col - col, 1, 0);
+            _mark_mark_move_inner(mark, new_line, mark->col - col + (mark_is_after_col_minus_lefties(mark, col) ? end_col : 0), 1, 0);
         }
     }
 
+    *ret_end_col = end_col;
+    *ret_num_lines = num_lines;
+    *ret_num_chars = num_chars;
     return new_line;
 }
 
@@ -1508,6 +5157,12 @@ static void _buffer_find_end_pos(bline_t* start_line, bint_t start_col, bint_t n
     end_col = start_col;
     num_chars_rem = num_chars;
     while (num_chars_rem > 0) {
+        if (end_line->is_chars_dirty && end_line->next && end_col == 0 && end_line->data_len < num_chars_rem) {
+            // Whole line is passed over, so count its chars without building them
+            num_chars_rem -= _buffer_count_chars(end_line->data, end_line->data_len) + 1;
+            end_line = end_line->next;
+            continue;
+        }
         MLBUF_BLINE_ENSURE_CHARS(end_line);
         if (end_line->char_count - end_col >= num_chars_rem) {
             end_col += num_chars_rem;
@@ -1671,6 +5326,20 @@ static bint_t _buffer_bline_delete(bline_t* bline, bint_t col, bint_t num_chars)
     return num_chars_deleted;
 }
 
+// Return byte length of start_line:start_col thru end_line:end_col
+static bint_t _buffer_substr_len(bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col) {
+    bline_t* tmp_line;
+    bint_t len;
+    if (start_line == end_line) {
+        return MLBUF_MAX(0, _buffer_bline_col_to_index(start_line, end_col) - _buffer_bline_col_to_index(start_line, start_col));
+    }
+    len = start_line->data_len - _buffer_bline_col_to_index(start_line, start_col) + 1;
+    for (tmp_line = start_line->next; tmp_line && tmp_line != end_line; tmp_line = tmp_line->next) {
+        len += tmp_line->data_len + 1;
+    }
+    return len + _buffer_bline_col_to_index(end_line, end_col);
+}
+
 static bint_t _buffer_bline_col_to_index(bline_t* bline, bint_t col) {
     bint_t index;
     MLBUF_BLINE_ENSURE_CHARS(bline);
@@ -1695,14 +5364,24 @@ static bint_t _buffer_bline_index_to_col(bline_t* bline, bint_t index) {
     return bline->chars[index].index_to_vcol;
 }
 
-// Close self->fd and self->mmap if needed
+// Close self->fd and self->mmap if needed. A background save may still be
+// reading the mmap, in which case the job takes it.
 static int _buffer_munmap(buffer_t* self) {
     if (self->mmap) {
-        munmap(self->mmap, self->mmap_len);
-        close(self->mmap_fd);
+        if (self->save_job && !self->save_job->mmap) {
+            self->save_job->mmap = self->mmap;
+            self->save_job->mmap_len = self->mmap_len;
+            self->save_job->mmap_fd = self->mmap_fd;
+        } else {
+            munmap(self->mmap, self->mmap_len);
+            close(self->mmap_fd);
+        }
         self->mmap = NULL;
         self->mmap_len = 0;
         self->mmap_fd = -1;
+        self->is_mmap_shared = 0;
+        self->mmap_dirty_start = 0;
+        self->mmap_dirty_end = 0;
     }
     return MLBUF_OK;
 }
@@ -1818,7 +5497,38 @@ static int _srule_multi_find_end(srule_t* rule, bline_t* bline, bint_t start_off
     return _srule_multi_find(rule, 1, bline, start_offset, &ignore, ret_stop);
 }
 
+// Get all of an action's data. For a DELETE of detached lines, which only
+// keeps the tail of start_line, the lines are flattened into data the
+// first time this is called.
+int baction_get_data(baction_t* self, char** ret_data, bint_t* ret_data_len) {
+    bline_t* bline;
+    bint_t data_len;
+    bint_t line_len;
+    char* cursor;
+    if (self->type == MLBUF_BACTION_TYPE_DELETE && self->maybe_lines && self->data_len < -1 * self->byte_delta) {
+        data_len = -1 * self->byte_delta;
+        self->data = realloc(self->data, data_len);
+        cursor = self->data + self->data_len;
+        for (bline = self->maybe_lines; bline && cursor < self->data + data_len; bline = bline->next) {
+            *cursor++ = '\n';
+            line_len = MLBUF_MIN(bline->data_len, (bint_t)(self->data + data_len - cursor));
+            if (line_len > 0) memcpy(cursor, bline->data, line_len);
+            cursor += line_len;
+        }
+        self->data_len = data_len;
+    }
+    *ret_data = self->data;
+    *ret_data_len = self->data_len;
+    return MLBUF_OK;
+}
+
 static int _baction_destroy(baction_t* action) {
+    bline_t* bline;
+    bline_t* bline_tmp;
+    for (bline = action->maybe_lines; bline; bline = bline_tmp) {
+        bline_tmp = bline->next;
+        _buffer_bline_free(bline, NULL, 0);
+    }
     if (action->data) free(action->data);
     free(action);
     return MLBUF_OK;
@@ -548,16 +548,16 @@ int mark_is_at_word_bound(mark_t* self, int side) {
     after  = self->col < self->bline->char_count ? self->bline->chars[self->col].ch : 0;
     if (side <= -1 || side == 0) {
         // If before is bol or non-word, and after is word
-        if ((before == 0 || !(isalnum(before) || before == '_'))
-            && (isalnum(after) || after == '_')
+        if ((before == 0 || !utf8_is_word_char(before))
+            && utf8_is_word_char(after)
         ) {
             return 1;
         }
     }
     if (side >= 1 || side == 0) {
         // If after is eol or non-word, and before is word
-        if ((after == 0 || !(isalnum(after) || after == '_'))
-            && (isalnum(before) || before == '_')
+        if ((after == 0 || !utf8_is_word_char(after))
+            && utf8_is_word_char(before)
         ) {
             return 1;
         }
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mlbuf.h"
+
+static int _markset_cmp(const void* a, const void* b);
+static void _markset_get_offsets(markset_t* self);
+static void _markset_move_offsets(markset_t* self);
+static int _markset_edit(markset_t* self, bint_t num_before, bint_t num_after, char* data, bint_t data_len);
+static int _markset_is_word_char(bline_t* bline, bint_t col);
+
+// Make a new, empty mark set
+markset_t* markset_new(buffer_t* buffer) {
+    markset_t* self;
+    self = calloc(1, sizeof(markset_t));
+    self->buffer = buffer;
+    return self;
+}
+
+// Add a mark to the set. The mark must be removed before it is destroyed.
+int markset_add(markset_t* self, mark_t* mark) {
+    if (mark->bline->buffer != self->buffer) {
+        return MLBUF_ERR;
+    }
+    if (self->marks_len >= self->marks_cap) {
+        self->marks_cap = self->marks_cap ? self->marks_cap * 2 : 16;
+        self->marks = realloc(self->marks, sizeof(mark_t*) * self->marks_cap);
+        self->offsets = realloc(self->offsets, sizeof(bint_t) * self->marks_cap);
+    }
+    self->marks[self->marks_len] = mark;
+    self->marks_len += 1;
+    return MLBUF_OK;
+}
+
+// Remove a mark from the set
+int markset_remove(markset_t* self, mark_t* mark) {
+    bint_t i;
+    for (i = 0; i < self->marks_len; i++) {
+        if (self->marks[i] == mark) {
+            memmove(self->marks + i, self->marks + i + 1, sizeof(mark_t*) * (self->marks_len - i - 1));
+            self->marks_len -= 1;
+            return MLBUF_OK;
+        }
+    }
+    return MLBUF_ERR;
+}
+
+// Free a mark set. Its marks are left in the buffer.
+int markset_destroy(markset_t* self) {
+    if (self->marks) free(self->marks);
+    if (self->offsets) free(self->offsets);
+    free(self);
+    return MLBUF_OK;
+}
+
+// Insert data before every mark
+int markset_insert_before(markset_t* self, char* data, bint_t data_len) {
+    return _markset_edit(self, 0, 0, data, data_len);
+}
+
+// Delete num_chars before every mark
+int markset_delete_before(markset_t* self, bint_t num_chars) {
+    return _markset_edit(self, num_chars, 0, NULL, 0);
+}
+
+// Delete num_chars after every mark
+int markset_delete_after(markset_t* self, bint_t num_chars) {
+    return _markset_edit(self, 0, num_chars, NULL, 0);
+}
+
+// Move every mark by a character delta
+int markset_move_by(markset_t* self, bint_t char_delta) {
+    bint_t i;
+    _markset_get_offsets(self);
+    for (i = 0; i < self->marks_len; i++) {
+        self->offsets[i] = MLBUF_MAX(0, self->offsets[i] + char_delta);
+    }
+    _markset_move_offsets(self);
+    return MLBUF_OK;
+}
+
+// Move every mark by a line delta
+int markset_move_vert(markset_t* self, bint_t line_delta) {
+    bint_t i;
+    for (i = 0; i < self->marks_len; i++) {
+        mark_move_vert(self->marks[i], line_delta);
+    }
+    return MLBUF_OK;
+}
+
+// Move every mark to the end of the current or next word, or to the next
+// line if already at eol
+int markset_move_next_word(markset_t* self) {
+    bint_t i;
+    bint_t col;
+    mark_t* mark;
+    bline_t* bline;
+    for (i = 0; i < self->marks_len; i++) {
+        mark = self->marks[i];
+        bline = mark->bline;
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        if (mark->col >= bline->char_count) {
+            if (bline->next) _mark_mark_move_inner(mark, bline->next, 0, 1, 1);
+            continue;
+        }
+        col = mark->col;
+        while (col < bline->char_count && !_markset_is_word_char(bline, col)) col++;
+        while (col < bline->char_count && _markset_is_word_char(bline, col)) col++;
+        _mark_mark_move_inner(mark, bline, col, 1, 1);
+    }
+    return MLBUF_OK;
+}
+
+// Move every mark to the start of the current or previous word, or to the
+// previous line if already at bol
+int markset_move_prev_word(markset_t* self) {
+    bint_t i;
+    bint_t col;
+    mark_t* mark;
+    bline_t* bline;
+    for (i = 0; i < self->marks_len; i++) {
+        mark = self->marks[i];
+        bline = mark->bline;
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        if (mark->col <= 0) {
+            if (bline->prev) {
+                MLBUF_BLINE_ENSURE_CHARS(bline->prev);
+                _mark_mark_move_inner(mark, bline->prev, bline->prev->char_count, 1, 1);
+            }
+            continue;
+        }
+        col = MLBUF_MIN(mark->col, bline->char_count);
+        while (col > 0 && !_markset_is_word_char(bline, col - 1)) col--;
+        while (col > 0 && _markset_is_word_char(bline, col - 1)) col--;
+        _mark_mark_move_inner(mark, bline, col, 1, 1);
+    }
+    return MLBUF_OK;
+}
+
+// Order marks by position in buffer
+static int _markset_cmp(const void* a, const void* b) {
+    mark_t* ma;
+    mark_t* mb;
+    ma = *(mark_t**)a;
+    mb = *(mark_t**)b;
+    if (ma->bline->line_index != mb->bline->line_index) {
+        return ma->bline->line_index < mb->bline->line_index ? -1 : 1;
+    } else if (ma->col != mb->col) {
+        return ma->col < mb->col ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sort marks into document order and fill in their offsets in one pass over
+// the buffer, stopping at the line of the last mark
+static void _markset_get_offsets(markset_t* self) {
+    bline_t* bline;
+    bint_t offset;
+    bint_t i;
+    qsort(self->marks, self->marks_len, sizeof(mark_t*), _markset_cmp);
+    offset = 0;
+    i = 0;
+    for (bline = self->buffer->first_line; bline && i < self->marks_len; bline = bline->next) {
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        for (; i < self->marks_len && self->marks[i]->bline == bline; i++) {
+            self->offsets[i] = offset + MLBUF_MIN(self->marks[i]->col, bline->char_count);
+        }
+        offset += bline->char_count + 1;
+    }
+}
+
+// Move marks to their (ascending) offsets in one pass over the buffer.
+// Offsets past the end are clamped to the end.
+static void _markset_move_offsets(markset_t* self) {
+    bline_t* bline;
+    bint_t offset;
+    bint_t i;
+    bline = self->buffer->first_line;
+    offset = 0;
+    for (i = 0; i < self->marks_len; i++) {
+        MLBUF_BLINE_ENSURE_CHARS(bline);
+        while (self->offsets[i] > offset + bline->char_count && bline->next) {
+            offset += bline->char_count + 1;
+            bline = bline->next;
+            MLBUF_BLINE_ENSURE_CHARS(bline);
+        }
+        _mark_mark_move_inner(self->marks[i], bline, self->offsets[i] - offset, 1, 1);
+    }
+}
+
+// Replace num_before chars before and num_after chars after every mark with
+// data as one batch of edits. Overlapping ranges are merged and marks that
+// share a position are edited once.
+static int _markset_edit(markset_t* self, bint_t num_before, bint_t num_after, char* data, bint_t data_len) {
+    buffer_edit_t* edits;
+    bint_t nedits;
+    bint_t start;
+    bint_t end;
+    bint_t prev_end;
+    bint_t i;
+    int rc;
+
+    if (self->marks_len < 1) {
+        return MLBUF_OK;
+    }
+    MLBUF_MAKE_GT_EQ0(num_before);
+    MLBUF_MAKE_GT_EQ0(num_after);
+    _markset_get_offsets(self);
+    edits = malloc(sizeof(buffer_edit_t) * self->marks_len);
+    nedits = 0;
+    prev_end = -1;
+    for (i = 0; i < self->marks_len; i++) {
+        start = MLBUF_MAX(0, self->offsets[i] - num_before);
+        end = self->offsets[i] + num_after;
+        if (nedits > 0 && start <= prev_end) {
+            if (data_len > 0 || end <= prev_end) continue;
+            start = prev_end;
+        }
+        if (start >= end && data_len < 1) continue;
+        edits[nedits].offset = start;
+        edits[nedits].num_chars = end - start;
+        edits[nedits].data = data;
+        edits[nedits].data_len = data_len;
+        nedits += 1;
+        prev_end = end;
+    }
+    rc = buffer_apply_edits(self->buffer, edits, nedits);
+    free(edits);
+    return rc;
+}
+
+// Return 1 if char at col is a word char
+static int _markset_is_word_char(bline_t* bline, bint_t col) {
+    return utf8_is_word_char(bline->chars[col].ch);
+}
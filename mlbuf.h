@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -15,12 +16,19 @@ typedef struct bline_s bline_t; // A line in a buffer
 typedef struct bline_char_s bline_char_t; // Metadata about a character in a bline
 typedef struct baction_s baction_t; // An insert or delete action (used for undo)
 typedef struct mark_s mark_t; // A mark in a buffer
+typedef struct markset_s markset_t; // A set of marks edited together (multi-cursor)
 typedef struct srule_s srule_t; // A style rule
 typedef struct srule_node_s srule_node_t; // A node in a list of style rules
 typedef struct sblock_s sblock_t; // A style of a particular character
 typedef struct str_s str_t; // A dynamically resizeable string
+typedef struct buffer_save_job_s buffer_save_job_t; // A background save (opaque)
+typedef struct buffer_export_header_s buffer_export_header_t; // Header of a memfd snapshot
+typedef struct buffer_edit_s buffer_edit_t; // A replacement for buffer_apply_edits
 typedef void (*buffer_callback_t)(buffer_t* buffer, baction_t* action, void* udata);
 typedef intmax_t bint_t;
+typedef void (*buffer_save_callback_t)(buffer_t* buffer, int rc, bint_t nbytes, void* udata);
+typedef int (*buffer_chunk_callback_t)(buffer_t* buffer, char* data, bint_t data_len, int is_eol, void* udata);
+typedef int (*buffer_line_cmp_t)(bline_t* a, bline_t* b, void* udata);
 
 // str_t
 struct str_s {
@@ -41,30 +49,68 @@ struct buffer_s {
     baction_t* actions;
     baction_t* action_tail;
     baction_t* action_undone;
+    bint_t action_group;
+    bint_t num_action_groups;
     str_t registers[26];
     mark_t* lettered_marks[26];
     char* path;
+    char* index_dir;
+    FILE* journal;
+    int is_journal_failed;
     struct stat st;
     int is_unsaved;
+    int is_gzip;
     char *data;
     bint_t data_len;
+    bint_t data_cap;
+    bline_t* data_hint_line;
+    bint_t data_hint_offset;
     int is_data_dirty;
+    int is_data_read;
+    bint_t version;
+    int export_fd;
+    bint_t export_version;
+    buffer_save_job_t* save_job;
     int ref_count;
     int tab_width;
     buffer_callback_t callback;
     void* callback_udata;
+    int open_strategy;
+    bint_t open_mmap_min_size;
     int mmap_fd;
     char* mmap;
     size_t mmap_len;
+    int is_mmap_shared;
+    size_t mmap_dirty_start;
+    size_t mmap_dirty_end;
     bline_char_t* slabbed_chars;
     bline_t* slabbed_blines;
     int num_applied_srules;
     int is_in_open;
+    int is_in_journal_replay;
     int is_in_callback;
     int is_style_disabled;
     int _is_in_undo;
 };
 
+// buffer_export_header_t
+struct buffer_export_header_s {
+    char magic[8];
+    uint64_t version;
+    uint64_t byte_count;
+    uint64_t line_count;
+    uint64_t line_offsets_offset;
+    uint64_t data_offset;
+};
+
+// buffer_edit_t
+struct buffer_edit_s {
+    bint_t offset;
+    bint_t num_chars;
+    char* data;
+    bint_t data_len;
+};
+
 // bline_t
 struct bline_s {
     buffer_t* buffer;
@@ -115,8 +161,10 @@ struct baction_s {
     bint_t byte_delta;
     bint_t char_delta;
     bint_t line_delta;
-    char* data;
+    char* data; // For PERMUTE, old position of each line; for JOIN/SPLIT, nlines, line char counts, sep
     bint_t data_len;
+    bline_t* maybe_lines; // For DELETE of MLBUF_DETACH_MIN_LINES+ lines, the detached lines (data is then the tail of start_line until baction_get_data)
+    bint_t group; // Nonzero if undone and redone together with neighbors
     baction_t* next;
     baction_t* prev;
 };
@@ -133,6 +181,15 @@ struct mark_s {
     int lefty;
 };
 
+// markset_t
+struct markset_s {
+    buffer_t* buffer;
+    mark_t** marks;
+    bint_t marks_len;
+    bint_t marks_cap;
+    bint_t* offsets;
+};
+
 // srule_t
 struct srule_s {
     int type; // MLBUF_SRULE_TYPE_*
@@ -162,18 +219,43 @@ mark_t* buffer_add_mark_ex(buffer_t* self, char letter, bline_t* maybe_line, bin
 int buffer_get_lettered_mark(buffer_t* self, char letter, mark_t** ret_mark);
 int buffer_destroy_mark(buffer_t* self, mark_t* mark);
 int buffer_open(buffer_t* self, char* path);
+int buffer_open_fd(buffer_t* self, int fd);
+int buffer_follow(buffer_t* self, bint_t* optret_nbytes);
 int buffer_save(buffer_t* self);
 int buffer_save_as(buffer_t* self, char* path, bint_t* optret_nbytes);
+int buffer_save_as_async(buffer_t* self, char* path, buffer_save_callback_t fn_cb, void* udata);
+int buffer_save_async_poll(buffer_t* self, int do_wait);
 int buffer_write_to_file(buffer_t* self, FILE* fp, size_t* optret_nbytes);
 int buffer_write_to_fd(buffer_t* self, int fd, size_t* optret_nbytes);
+int buffer_export_memfd(buffer_t* self, int* ret_fd);
 int buffer_get(buffer_t* self, char** ret_data, bint_t* ret_data_len);
+int buffer_foreach_chunk(buffer_t* self, bline_t* start_line, bint_t nlines, buffer_chunk_callback_t fn_cb, void* udata);
 int buffer_clear(buffer_t* self);
 int buffer_set(buffer_t* self, char* data, bint_t data_len);
 int buffer_set_mmapped(buffer_t* self, char* data, bint_t data_len);
+int buffer_set_index_dir(buffer_t* self, char* dir);
+int buffer_set_open_strategy(buffer_t* self, int strategy, bint_t mmap_min_size);
+int buffer_set_journal(buffer_t* self, char* path);
+int buffer_journal_flush(buffer_t* self, int do_sync);
+int buffer_journal_recover(buffer_t* self, char* path);
 int buffer_substr(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, char** ret_data, bint_t* ret_data_len, bint_t* ret_nchars);
+int buffer_substr_into(buffer_t* self, bline_t* start_line, bint_t start_col, bline_t* end_line, bint_t end_col, char* data, bint_t data_size, bint_t* ret_data_len, bint_t* ret_nchars);
 int buffer_insert(buffer_t* self, bint_t offset, char* data, bint_t data_len, bint_t* optret_num_chars);
 int buffer_delete(buffer_t* self, bint_t offset, bint_t num_chars);
 int buffer_replace(buffer_t* self, bint_t offset, bint_t num_chars, char* data, bint_t data_len);
+int buffer_apply_edits(buffer_t* self, buffer_edit_t* edits, bint_t nedits);
+int buffer_replace_all(buffer_t* self, pcre* cre, char* repl, bint_t* optret_num_replaced);
+int buffer_insert_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t vcol, char* data, bint_t data_len);
+int buffer_delete_block(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol);
+int buffer_sort_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, buffer_line_cmp_t cmp, void* udata);
+int buffer_sort_lines_by_cre(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre);
+int buffer_reverse_lines(buffer_t* self, bline_t* start_line, bline_t* end_line);
+int buffer_unique_lines(buffer_t* self, bline_t* start_line, bline_t* end_line);
+int buffer_filter_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, pcre* cre, int keep_matching);
+int buffer_move_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, bint_t line_delta);
+int buffer_duplicate_lines(buffer_t* self, bline_t* start_line, bline_t* end_line);
+int buffer_join_lines(buffer_t* self, bline_t* start_line, bline_t* end_line, char* sep, bint_t sep_len);
+int buffer_overwrite(buffer_t* self, bint_t offset, char* data, bint_t data_len);
 int buffer_insert_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, char* data, bint_t data_len, bint_t* optret_num_chars);
 int buffer_delete_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, bint_t num_chars);
 int buffer_replace_w_bline(buffer_t* self, bline_t* start_line, bint_t start_col, bint_t num_chars, char* data, bint_t data_len);
@@ -193,7 +275,10 @@ int buffer_register_append(buffer_t* self, char reg, char* data, size_t data_len
 int buffer_register_prepend(buffer_t* self, char reg, char* data, size_t data_len);
 int buffer_register_clear(buffer_t* self, char reg);
 int buffer_register_get(buffer_t* self, char reg, int dup, char** ret_data, size_t* ret_data_len);
+int buffer_register_set_block(buffer_t* self, char reg, bline_t* start_line, bline_t* end_line, bint_t start_vcol, bint_t end_vcol);
 int buffer_destroy(buffer_t* self);
+int buffer_destroy_async(buffer_t* self);
+int buffer_destroy_async_wait();
 
 // bline functions
 int bline_insert(bline_t* self, bint_t col, char* data, bint_t data_len, bint_t* ret_num_chars);
@@ -203,6 +288,9 @@ int bline_get_col(bline_t* self, bint_t index, bint_t* ret_col);
 int bline_get_col_from_vcol(bline_t* self, bint_t vcol, bint_t* ret_col);
 int bline_count_chars(bline_t* bline);
 
+// baction functions
+int baction_get_data(baction_t* self, char** ret_data, bint_t* ret_data_len);
+
 // mark functions
 int mark_clone(mark_t* self, mark_t** ret_mark);
 int mark_clone_w_letter(mark_t* self, char letter, mark_t** ret_mark);
@@ -268,6 +356,19 @@ int mark_replace(mark_t* self, bint_t num_chars, char* data, bint_t data_len);
 int mark_set_pcre_capture(int* rc, int* ovector, int ovector_size);
 int mark_swap_with_mark(mark_t* self, mark_t* other);
 
+// markset functions
+markset_t* markset_new(buffer_t* buffer);
+int markset_add(markset_t* self, mark_t* mark);
+int markset_remove(markset_t* self, mark_t* mark);
+int markset_destroy(markset_t* self);
+int markset_insert_before(markset_t* self, char* data, bint_t data_len);
+int markset_delete_before(markset_t* self, bint_t num_chars);
+int markset_delete_after(markset_t* self, bint_t num_chars);
+int markset_move_by(markset_t* self, bint_t char_delta);
+int markset_move_vert(markset_t* self, bint_t line_delta);
+int markset_move_next_word(markset_t* self);
+int markset_move_prev_word(markset_t* self);
+
 // srule functions
 srule_t* srule_new_single(char* re, bint_t re_len, int caseless, uint16_t fg, uint16_t bg);
 srule_t* srule_new_multi(char* re, bint_t re_len, char* re_end, bint_t re_end_len, uint16_t fg, uint16_t bg);
@@ -278,6 +379,7 @@ int srule_destroy(srule_t* srule);
 int utf8_char_length(char c);
 int utf8_char_to_unicode(uint32_t *out, const char *c, const char *stop);
 int utf8_unicode_to_char(char *out, uint32_t c);
+int utf8_is_word_char(uint32_t ch);
 
 // util functions
 void* recalloc(void* ptr, size_t orig_num, size_t new_num, size_t el_size);
@@ -300,14 +402,55 @@ void str_append_replace_with_backrefs(str_t* str, char* subj, char* repl, int pc
 // Macros
 #define MLBUF_DEBUG 1
 
-// #define MLBUF_LARGE_FILE_SIZE 10485760
-#define MLBUF_LARGE_FILE_SIZE 0
+#define MLBUF_LARGE_FILE_SIZE 10485760
+
+#define MLBUF_READ_CHUNK_SIZE 1048576
+
+#define MLBUF_GZIP_BUFFER_SIZE 131072
+
+#define MLBUF_URING_DEPTH 4
+
+#define MLBUF_COPY_RANGE_MIN_SIZE 65536
+
+#define MLBUF_DATA_UPDATE_MAX_SHIFT 65536
+
+#define MLBUF_REPLACE_ALL_OVECTOR_SIZE 30
+
+#define MLBUF_REAP_MIN_LINES 65536
+#define MLBUF_REAP_BATCH_SIZE 65536
+
+#define MLBUF_DETACH_MIN_LINES 1024
+
+#ifdef IOV_MAX
+#define MLBUF_IOV_MAX IOV_MAX
+#else
+#define MLBUF_IOV_MAX 1024
+#endif
+
+#define MLBUF_INDEX_MAGIC "mlbufix2"
+#define MLBUF_INDEX_SAMPLE_SIZE 64
+
+#define MLBUF_EXPORT_MAGIC "mlbufex1"
+
+#define MLBUF_JOURNAL_MAGIC "mlbufjn3"
+#define MLBUF_JOURNAL_BUFFER_SIZE 65536
 
 #define MLBUF_OK 0
 #define MLBUF_ERR 1
 
+#define MLBUF_OPEN_STRATEGY_AUTO 0
+#define MLBUF_OPEN_STRATEGY_READ 1
+#define MLBUF_OPEN_STRATEGY_MMAP 2
+#define MLBUF_OPEN_STRATEGY_MMAP_COPY 3
+#define MLBUF_OPEN_STRATEGY_MMAP_SHARED 4
+
 #define MLBUF_BACTION_TYPE_INSERT 0
 #define MLBUF_BACTION_TYPE_DELETE 1
+#define MLBUF_JOURNAL_TYPE_CLEAR 2
+#define MLBUF_BACTION_TYPE_BATCH 3
+#define MLBUF_BACTION_TYPE_PERMUTE 4
+#define MLBUF_BACTION_TYPE_JOIN 5
+#define MLBUF_BACTION_TYPE_SPLIT 6
 
 #define MLBUF_SRULE_TYPE_SINGLE 0
 #define MLBUF_SRULE_TYPE_MULTI 1
@@ -0,0 +1,64 @@
+#include "test.h"
+
+static int ncallbacks = 0;
+static int last_type = -1;
+
+static void callback_fn(buffer_t* buffer, baction_t* action, void* udata) {
+    ncallbacks += 1;
+    last_type = action->type;
+}
+
+static buffer_edit_t edits[] = {
+    { 0, 3, "ONE", 3 },        // one -> ONE
+    { 4, 0, "new\n", 4 },      // insert line before two
+    { 7, 7, "", 0 },           // join \nthree\n away
+    { 18, 0, "!", 1 },         // append at end
+};
+static buffer_edit_t past_end[] = {
+    { 100, 0, "?", 1 },
+};
+static buffer_edit_t bad[] = {
+    { 4, 3, "x", 1 },
+    { 5, 0, "y", 1 },
+};
+
+MAIN("one\ntwo\nthree\nfour",
+    char *data;
+    bint_t data_len;
+    mark_t* mark;
+
+    mark = buffer_add_mark(buf, buf->last_line, 2);
+    buffer_set_callback(buf, callback_fn, NULL);
+    ASSERT("rc", MLBUF_OK, buffer_apply_edits(buf, edits, 4));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp("ONE\nnew\ntwofour!", data, data_len));
+    ASSERT("len", 16, data_len);
+    ASSERT("line_count", 3, buf->line_count);
+    ASSERT("last_line", 2, buf->last_line->line_index);
+    ASSERT("last_line_next", 1, buf->last_line->next == NULL);
+    ASSERT("mark_line", buf->last_line, mark->bline);
+    ASSERT("mark_col", 5, mark->col);
+    ASSERT("ncallbacks", 1, ncallbacks);
+    ASSERT("batch_type", MLBUF_BACTION_TYPE_BATCH, last_type);
+
+    // One undo reverts the whole batch, one redo reapplies it
+    ASSERT("undo", MLBUF_OK, buffer_undo(buf));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo_data", 0, strncmp("one\ntwo\nthree\nfour", data, data_len));
+    ASSERT("undo_len", 18, data_len);
+    ASSERT("undo_last_line", 3, buf->last_line->line_index);
+    ASSERT("undo_ncallbacks", 2, ncallbacks);
+    ASSERT("undo_batch_type", MLBUF_BACTION_TYPE_BATCH, last_type);
+    ASSERT("redo", MLBUF_OK, buffer_redo(buf));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("redo_data", 0, strncmp("ONE\nnew\ntwofour!", data, data_len));
+    ASSERT("redo_last_line", 2, buf->last_line->line_index);
+    ASSERT("redo_ncallbacks", 3, ncallbacks);
+
+    ASSERT("overlap", MLBUF_ERR, buffer_apply_edits(buf, bad, 2));
+
+    // Offsets past the end are clamped
+    ASSERT("past_end", MLBUF_OK, buffer_apply_edits(buf, past_end, 1));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("past_end_data", 0, strncmp("ONE\nnew\ntwofour!?", data, data_len));
+)
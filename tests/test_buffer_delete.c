@@ -1,8 +1,26 @@
 #include "test.h"
 
+static char* deleted = NULL;
+static bint_t deleted_len = 0;
+
+static void delete_cb(buffer_t* buffer, baction_t* action, void* udata) {
+    char* data;
+    bint_t data_len;
+    if (action->type != MLBUF_BACTION_TYPE_DELETE) return;
+    baction_get_data(action, &data, &data_len);
+    deleted = realloc(deleted, data_len);
+    memcpy(deleted, data, data_len);
+    deleted_len = data_len;
+}
+
 MAIN("hello\nworld",
     char *data;
     bint_t data_len;
+    char* big;
+    bint_t i;
+    bline_t* line;
+    mark_t* mid;
+    mark_t* end;
 
     buffer_delete(buf, 0, 1);
     buffer_get(buf, &data, &data_len);
@@ -19,5 +37,57 @@ MAIN("hello\nworld",
     buffer_delete(buf, 0, 7);
     buffer_get(buf, &data, &data_len);
     ASSERT("all", 0, strncmp(data, "", data_len));
-)
 
+    // Deleting many lines detaches them and undo links them back in
+    big = malloc(MLBUF_DETACH_MIN_LINES * 6);
+    for (i = 0; i < MLBUF_DETACH_MIN_LINES * 2; i++) memcpy(big + i * 3, "ab\n", 3);
+    buffer_set(buf, big, MLBUF_DETACH_MIN_LINES * 6 - 1);
+    buffer_get_bline(buf, 5, &line);
+    mid = buffer_add_mark(buf, line, 1);
+    buffer_get_bline(buf, MLBUF_DETACH_MIN_LINES + 1, &line);
+    end = buffer_add_mark(buf, line, 2);
+    buffer_get(buf, &data, &data_len);
+    buffer_delete(buf, 1, (MLBUF_DETACH_MIN_LINES + 1) * 3);
+    ASSERT("detached", 1, buf->actions->prev->maybe_lines != NULL);
+    ASSERT("detach_lines", MLBUF_DETACH_MIN_LINES - 1, buf->line_count);
+    ASSERT("detach_bytes", MLBUF_DETACH_MIN_LINES * 3 - 4, buf->byte_count);
+    ASSERT("detach_mid", 1, mid->col);
+    ASSERT("detach_mid_line", buf->first_line, mid->bline);
+    ASSERT("detach_end", 2, end->col);
+    ASSERT("detach_end_line", buf->first_line, end->bline);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("detach_data", 0, strncmp(data, big + MLBUF_DETACH_MIN_LINES * 3 + 3, data_len));
+    buffer_undo(buf);
+    ASSERT("attached", 1, buf->actions->prev->maybe_lines == NULL);
+    ASSERT("attach_lines", MLBUF_DETACH_MIN_LINES * 2, buf->line_count);
+    ASSERT("attach_mid_line", MLBUF_DETACH_MIN_LINES + 1, mid->bline->line_index);
+    ASSERT("attach_end", 2, end->col);
+    ASSERT("attach_end_line", MLBUF_DETACH_MIN_LINES + 1, end->bline->line_index);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("attach_len", MLBUF_DETACH_MIN_LINES * 6 - 1, data_len);
+    ASSERT("attach_data", 0, strncmp(data, big, data_len));
+    buffer_redo(buf);
+    ASSERT("redetached", 1, buf->actions->prev->maybe_lines != NULL);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("redetach_data", 0, strncmp(data, big + MLBUF_DETACH_MIN_LINES * 3 + 3, data_len));
+
+    // A callback can get all of the detached text, and undo still works
+    buffer_set(buf, big, MLBUF_DETACH_MIN_LINES * 6 - 1);
+    buffer_set_callback(buf, delete_cb, NULL);
+    buffer_delete(buf, 1, (MLBUF_DETACH_MIN_LINES + 1) * 3);
+    ASSERT("cb_detached", 1, buf->actions->prev->maybe_lines != NULL);
+    ASSERT("cb_data_len", (MLBUF_DETACH_MIN_LINES + 1) * 3, deleted_len);
+    ASSERT("cb_data", 0, memcmp(deleted, big + 1, deleted_len));
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("cb_attach_len", MLBUF_DETACH_MIN_LINES * 6 - 1, data_len);
+    ASSERT("cb_attach_data", 0, strncmp(data, big, data_len));
+    deleted_len = 0;
+    buffer_redo(buf);
+    ASSERT("cb_redo_data_len", (MLBUF_DETACH_MIN_LINES + 1) * 3, deleted_len);
+    ASSERT("cb_redo_data", 0, memcmp(deleted, big + 1, deleted_len));
+    ASSERT("cb_redetached", 1, buf->actions->prev->maybe_lines != NULL);
+    buffer_set_callback(buf, NULL, NULL);
+    free(deleted);
+    free(big);
+)
@@ -0,0 +1,14 @@
+#include "test.h"
+
+MAIN("ab\tc\nx\nlonger",
+    char* data;
+    bint_t data_len;
+
+    ASSERT("rc", MLBUF_OK, buffer_delete_block(buf, buf->first_line, buf->last_line, 1, 4));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp(data, "ac\nx\nler", data_len));
+    ASSERT("len", 8, data_len);
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "ab\tc\nx\nlonger", data_len));
+)
@@ -0,0 +1,38 @@
+#include "test.h"
+
+MAIN("",
+    buffer_t* big;
+    str_t data = {0};
+    mark_t* a;
+    mark_t* b;
+    srule_t* single;
+    srule_t* range;
+    bint_t i;
+
+    for (i = 0; i < MLBUF_REAP_MIN_LINES * 2; i++) {
+        str_append_len(&data, "line\n", 5);
+    }
+    big = buffer_new();
+    buffer_set(big, data.data, (bint_t)data.len);
+    buffer_insert(big, 0, "x", 1, NULL);
+    a = buffer_add_mark(big, NULL, 0);
+    b = buffer_add_mark(big, big->last_line, 0);
+    single = srule_new_single("line", 4, 0, 1, 2);
+    range = srule_new_range(a, b, 3, 4);
+    buffer_add_srule(big, single);
+    buffer_add_srule(big, range);
+
+    // srules may be freed as soon as this returns
+    ASSERT("rc", MLBUF_OK, buffer_destroy_async(big));
+    srule_destroy(single);
+    srule_destroy(range);
+
+    // Small buffers are freed synchronously
+    big = buffer_new();
+    ASSERT("small", MLBUF_OK, buffer_destroy_async(big));
+
+    // Wait for the reaper. Anything it failed to free shows up as a leak.
+    ASSERT("wait", MLBUF_OK, buffer_destroy_async_wait());
+    ASSERT("wait_none", MLBUF_OK, buffer_destroy_async_wait());
+    str_free(&data);
+)
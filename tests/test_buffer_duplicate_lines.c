@@ -0,0 +1,22 @@
+#include "test.h"
+
+MAIN("one\nt\xe4\xb8\x96o\nthree",
+    char* data;
+    bint_t data_len;
+
+    ASSERT("rc", MLBUF_OK, buffer_duplicate_lines(buf, buf->first_line, buf->first_line->next));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp(data, "one\nt\xe4\xb8\x96o\none\nt\xe4\xb8\x96o\nthree", data_len));
+    ASSERT("lines", 5, buf->line_count);
+    ASSERT("chars", 3, buf->first_line->next->next->next->char_count);
+    ASSERT("idx", 3, buf->first_line->next->next->next->line_index);
+
+    // Duplicating the last line
+    buffer_duplicate_lines(buf, buf->last_line, buf->last_line);
+    ASSERT("last_idx", 5, buf->last_line->line_index);
+    buffer_undo(buf);
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "one\nt\xe4\xb8\x96o\nthree", data_len));
+    ASSERT("undo_lines", 3, buf->line_count);
+)
@@ -0,0 +1,50 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+#include "test.h"
+
+MAIN("hello\n\nworld",
+    int fd;
+    int fd2;
+    struct stat st;
+    struct stat st2;
+    char* map;
+    buffer_export_header_t* header;
+    uint64_t* line_offsets;
+    char* data;
+
+    ASSERT("rc", MLBUF_OK, buffer_export_memfd(buf, &fd));
+    ASSERT("fd", 1, fd >= 0);
+    ASSERT("sealed", 1, (fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE) != 0);
+    ASSERT("no_write", -1, (bint_t)write(fd, "x", 1));
+
+    fstat(fd, &st);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT("map", 1, map != MAP_FAILED);
+    header = (buffer_export_header_t*)map;
+    ASSERT("magic", 0, memcmp(MLBUF_EXPORT_MAGIC, header->magic, 8));
+    ASSERT("version", buf->version, (bint_t)header->version);
+    ASSERT("byte_count", 12, (bint_t)header->byte_count);
+    ASSERT("line_count", 3, (bint_t)header->line_count);
+    line_offsets = (uint64_t*)(map + header->line_offsets_offset);
+    data = map + header->data_offset;
+    ASSERT("offset0", 0, (bint_t)line_offsets[0]);
+    ASSERT("offset1", 6, (bint_t)line_offsets[1]);
+    ASSERT("offset2", 7, (bint_t)line_offsets[2]);
+    ASSERT("data", 0, strncmp("hello\n\nworld", data, 12));
+
+    // An unchanged buffer shares the same memfd, an edited one gets a new one
+    ASSERT("reuse_rc", MLBUF_OK, buffer_export_memfd(buf, &fd2));
+    fstat(fd2, &st2);
+    ASSERT("reuse_ino", 1, st.st_ino == st2.st_ino);
+    close(fd2);
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("edit_rc", MLBUF_OK, buffer_export_memfd(buf, &fd2));
+    fstat(fd2, &st2);
+    ASSERT("edit_ino", 1, st.st_ino != st2.st_ino);
+    ASSERT("edit_size", st.st_size + 1, st2.st_size);
+    ASSERT("old_data", 0, strncmp("hello\n\nworld", data, 12));
+    close(fd2);
+
+    munmap(map, st.st_size);
+    close(fd);
+)
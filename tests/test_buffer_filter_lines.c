@@ -0,0 +1,44 @@
+#include "test.h"
+
+MAIN("keep 1\ndrop\nkeep 2\ndrop\ndrop\nkeep 3",
+    char* data;
+    bint_t data_len;
+    pcre* cre;
+    const char* err;
+    int erroffset;
+
+    cre = pcre_compile("^keep", 0, &err, &erroffset, NULL);
+    ASSERT("rc", MLBUF_OK, buffer_filter_lines(buf, buf->first_line, buf->last_line, cre, 1));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("keep", 0, strncmp(data, "keep 1\nkeep 2\nkeep 3", data_len));
+    ASSERT("len", 20, data_len);
+    ASSERT("lines", 3, buf->line_count);
+    ASSERT("last", 2, buf->last_line->line_index);
+
+    // One undo restores dropped lines in place
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "keep 1\ndrop\nkeep 2\ndrop\ndrop\nkeep 3", data_len));
+    ASSERT("undo_lines", 6, buf->line_count);
+    buffer_redo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("redo", 0, strncmp(data, "keep 1\nkeep 2\nkeep 3", data_len));
+
+    // Drop matching lines, including the last line
+    buffer_undo(buf);
+    buffer_filter_lines(buf, buf->first_line->next, buf->last_line, cre, 0);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("drop", 0, strncmp(data, "keep 1\ndrop\ndrop\ndrop", data_len));
+
+    // Drop a tail range, then everything
+    buffer_filter_lines(buf, buf->first_line->next, buf->last_line, cre, 1);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("tail", 0, strncmp(data, "keep 1", data_len));
+    ASSERT("tail_len", 6, data_len);
+    buffer_set(buf, "x\ny", 3);
+    buffer_filter_lines(buf, buf->first_line, buf->last_line, cre, 1);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("all", 0, data_len);
+    ASSERT("all_lines", 1, buf->line_count);
+    pcre_free(cre);
+)
@@ -0,0 +1,40 @@
+#include "test.h"
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    bint_t nbytes;
+    char path[32];
+    int fd;
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (write(fd, "hello\nwor", 9) != 9) exit(EXIT_FAILURE);
+
+    buffer_open(buf, path);
+    cur = buffer_add_mark(buf, buf->last_line, 3);
+    buffer_insert(buf, 0, "> ", 2, NULL);
+
+    ASSERT("nochange", MLBUF_OK, buffer_follow(buf, &nbytes));
+    ASSERT("nochange_nbytes", 0, nbytes);
+
+    if (write(fd, "ld\nagain", 8) != 8) exit(EXIT_FAILURE);
+    ASSERT("grow", MLBUF_OK, buffer_follow(buf, &nbytes));
+    ASSERT("grow_nbytes", 8, nbytes);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("grow_data", 0, strncmp("> hello\nworld\nagain", data, data_len));
+    ASSERT("grow_line_count", 3, buf->line_count);
+    ASSERT("grow_mark_line", buf->last_line, cur->bline);
+    ASSERT("grow_mark_col", 5, cur->col);
+    ASSERT("grow_st_size", 17, buf->st.st_size);
+
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp("hello\nworld\nagain", data, data_len));
+
+    if (ftruncate(fd, 3) != 0) exit(EXIT_FAILURE);
+    ASSERT("truncated", MLBUF_ERR, buffer_follow(buf, &nbytes));
+
+    close(fd);
+    unlink(path);
+)
@@ -0,0 +1,57 @@
+#include "test.h"
+
+static int collect(buffer_t* buffer, char* data, bint_t data_len, int is_eol, void* udata) {
+    str_t* out = udata;
+    str_append_len(out, data, data_len);
+    if (is_eol) str_append_len(out, "\n", 1);
+    str_append_len(out, "|", 1);
+    return MLBUF_OK;
+}
+
+static int stop(buffer_t* buffer, char* data, bint_t data_len, int is_eol, void* udata) {
+    *(int*)udata += 1;
+    return MLBUF_ERR;
+}
+
+MAIN("hello\n\nworld",
+    str_t out = {0};
+    bline_t* bline;
+    char path[32];
+    int fd;
+    int ncalls;
+
+    ASSERT("rc", MLBUF_OK, buffer_foreach_chunk(buf, NULL, -1, collect, &out));
+    ASSERT("all", 0, strncmp("hello\n|\n|world|", out.data, out.len));
+    ASSERT("all_len", 15, (bint_t)out.len);
+
+    out.len = 0;
+    buffer_get_bline(buf, 1, &bline);
+    buffer_foreach_chunk(buf, bline, 1, collect, &out);
+    ASSERT("range", 0, strncmp("\n|", out.data, out.len));
+    ASSERT("range_len", 2, (bint_t)out.len);
+
+    ncalls = 0;
+    ASSERT("stop_rc", MLBUF_ERR, buffer_foreach_chunk(buf, NULL, -1, stop, &ncalls));
+    ASSERT("stop", 1, ncalls);
+
+    // Unedited mmapped lines come in one chunk
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (write(fd, "a\nb\nc\nd", 7) != 7) exit(EXIT_FAILURE);
+    close(fd);
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    buffer_open(buf, path);
+    buffer_insert(buf, 4, "x", 1, NULL);
+    out.len = 0;
+    buffer_foreach_chunk(buf, NULL, -1, collect, &out);
+    ASSERT("mmap", 0, strncmp("a\nb\n|xc\n|d|", out.data, out.len));
+    ASSERT("mmap_len", 11, (bint_t)out.len);
+
+    out.len = 0;
+    buffer_foreach_chunk(buf, buf->first_line, 1, collect, &out);
+    ASSERT("mmap_range", 0, strncmp("a\n|", out.data, out.len));
+    ASSERT("mmap_range_len", 3, (bint_t)out.len);
+
+    str_free(&out);
+    unlink(path);
+)
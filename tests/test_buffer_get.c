@@ -3,8 +3,34 @@
 MAIN("hello\nworld",
     char* data;
     bint_t data_len;
+    char* expected;
 
     buffer_get(buf, &data, &data_len);
     ASSERT("len", 11, data_len);
     ASSERT("get", 0, strncmp(data, "hello\nworld", data_len));
+
+    // Edits after a get update the contents in place
+    buffer_insert(buf, 11, "\nfoo", 4, NULL);
+    buffer_insert(buf, 0, "\xe4\xb8\x96", 3, NULL);
+    buffer_delete(buf, 3, 4);
+    buffer_replace(buf, 4, 6, "X\nY", 3);
+    buffer_undo(buf);
+    ASSERT("not_dirty", 0, buf->is_data_dirty);
+    buffer_get(buf, &data, &data_len);
+    expected = strndup(data, data_len);
+    buf->is_data_dirty = 1;
+    buffer_get(buf, &data, &data_len);
+    ASSERT("incr_len", (bint_t)strlen(expected), data_len);
+    ASSERT("incr", 0, strcmp(expected, data));
+    free(expected);
+
+    // Cols past the end of a line are clamped before updating the contents
+    buffer_set(buf, "a\nbcd", 5);
+    buffer_get(buf, &data, &data_len);
+    buffer_delete_w_bline(buf, buf->first_line, 2, 1);
+    buffer_insert_w_bline(buf, buf->first_line, 5, "X", 1, NULL);
+    ASSERT("clamp_not_dirty", 0, buf->is_data_dirty);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("clamp", 0, strncmp("abcdX", data, data_len));
+    ASSERT("clamp_len", 5, data_len);
 )
@@ -4,6 +4,8 @@ MAIN("hello\nworld",
     char *data;
     bint_t data_len;
     bint_t nchars;
+    mark_t* before;
+    mark_t* after;
 
     buffer_insert(buf, 0, "\xe4\xb8\x96\xe7\x95\x8c\n", 7, &nchars);
     buffer_get(buf, &data, &data_len);
@@ -23,5 +25,24 @@ MAIN("hello\nworld",
     buffer_insert(buf, 20, "!", 1, NULL);
     buffer_get(buf, &data, &data_len);
     ASSERT("oob", 0, strncmp(data, "\xe4\xb8\x96\xe7\x95\x8c\nshel\n\nlo\nworld!", data_len));
-)
 
+    // Multi-line paste mid-line moves the tail and marks past it once
+    buffer_set(buf, "abcd\nefgh", 9);
+    before = buffer_add_mark(buf, buf->first_line, 1);
+    after = buffer_add_mark(buf, buf->first_line, 2);
+    buffer_insert(buf, 2, "X\nYY\n\xe4\xb8\x96Z", 9, &nchars);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("paste", 0, strncmp(data, "abX\nYY\n\xe4\xb8\x96Zcd\nefgh", data_len));
+    ASSERT("pastelen", 18, data_len);
+    ASSERT("pastenchars", 7, nchars);
+    ASSERT("pastelines", 4, buf->line_count);
+    ASSERT("before", 1, before->col);
+    ASSERT("beforeline", buf->first_line, before->bline);
+    ASSERT("after", 2, after->col);
+    ASSERT("afterline", buf->first_line->next->next, after->bline);
+    ASSERT("tailline", 2, buf->first_line->next->next->line_index);
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("pasteundo", 0, strncmp(data, "abcd\nefgh", data_len));
+    ASSERT("pasteundolines", 2, buf->line_count);
+)
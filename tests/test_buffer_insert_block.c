@@ -0,0 +1,21 @@
+#include "test.h"
+
+MAIN("ab\tc\nx\nlonger\nlast",
+    char* data;
+    bint_t data_len;
+
+    ASSERT("rc", MLBUF_OK, buffer_insert_block(buf, buf->first_line, buf->first_line->next->next, 3, "|", 1));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp(data, "ab\t|c\nx  |\nlon|ger\nlast", data_len));
+    ASSERT("lines", 4, buf->line_count);
+
+    // One undo reverts every line
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "ab\tc\nx\nlonger\nlast", data_len));
+
+    // Range may be given bottom-up
+    buffer_insert_block(buf, buf->last_line, buf->last_line->prev, 0, ">", 1);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("rev", 0, strncmp(data, "ab\tc\nx\n>longer\n>last", data_len));
+)
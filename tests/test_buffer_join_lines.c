@@ -0,0 +1,38 @@
+#include "test.h"
+
+MAIN("a\nbb\n\xe4\xb8\x96\nccc\nd",
+    char* data;
+    bint_t data_len;
+    mark_t* mark;
+    bline_t* line;
+
+    line = buf->first_line->next;
+    mark = buffer_add_mark(buf, line->next->next, 2);
+    ASSERT("rc", MLBUF_OK, buffer_join_lines(buf, line->next->next, line, ", ", 2));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp(data, "a\nbb, \xe4\xb8\x96, ccc\nd", data_len));
+    ASSERT("not_dirty", 0, buf->is_data_dirty);
+    ASSERT("lines", 3, buf->line_count);
+    ASSERT("chars", 10, line->char_count);
+    ASSERT("mark_line", line, mark->bline);
+    ASSERT("mark_col", 9, mark->col);
+    ASSERT("last_idx", 2, buf->last_line->line_index);
+
+    // Undo splits the line and puts marks back
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "a\nbb\n\xe4\xb8\x96\nccc\nd", data_len));
+    ASSERT("undo_lines", 5, buf->line_count);
+    ASSERT("undo_mark_idx", 3, mark->bline->line_index);
+    ASSERT("undo_mark_col", 2, mark->col);
+    buffer_redo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("redo", 0, strncmp(data, "a\nbb, \xe4\xb8\x96, ccc\nd", data_len));
+
+    // Join everything with no separator
+    buffer_join_lines(buf, buf->first_line, buf->last_line, "", 0);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("all", 0, strncmp(data, "abb, \xe4\xb8\x96, cccd", data_len));
+    ASSERT("all_lines", 1, buf->line_count);
+    ASSERT("all_last", buf->first_line, buf->last_line);
+)
@@ -0,0 +1,34 @@
+#include "test.h"
+
+MAIN("a\nb\nc\nd\ne",
+    char* data;
+    bint_t data_len;
+    bline_t* b;
+    bline_t* c;
+    mark_t* mark;
+
+    b = buf->first_line->next;
+    c = b->next;
+    mark = buffer_add_mark(buf, c, 1);
+    buffer_get(buf, &data, &data_len);
+
+    // Move b-c down two lines
+    ASSERT("down", MLBUF_OK, buffer_move_lines(buf, b, c, 2));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("down_data", 0, strncmp(data, "a\nd\ne\nb\nc", data_len));
+    ASSERT("mark", c, mark->bline);
+    ASSERT("c_idx", 4, c->line_index);
+    ASSERT("last", c, buf->last_line);
+
+    // Moves are clamped to the buffer
+    buffer_move_lines(buf, c, b, -10);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("up_data", 0, strncmp(data, "b\nc\na\nd\ne", data_len));
+    ASSERT("first", b, buf->first_line);
+
+    buffer_undo(buf);
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "a\nb\nc\nd\ne", data_len));
+    ASSERT("undo_idx", 2, c->line_index);
+)
@@ -0,0 +1,59 @@
+#include <zlib.h>
+#include "test.h"
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    char path[32];
+    char out[64];
+    int fd;
+    FILE* fp;
+    gzFile gz;
+    long gz_len;
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (!(gz = gzdopen(fd, "wb"))) exit(EXIT_FAILURE);
+    if (gzwrite(gz, "hello\nworld", 11) != 11) exit(EXIT_FAILURE);
+    gzclose(gz);
+
+    // gzip files are decompressed on open, even if mmap is requested
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    ASSERT("open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("gzip", 1, buf->is_gzip);
+    ASSERT("mmap", 1, buf->mmap == NULL);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("len", 11, data_len);
+    ASSERT("data", 0, strncmp("hello\nworld", data, data_len));
+    ASSERT("line_count", 2, buf->line_count);
+
+    // Saving recompresses
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("save", MLBUF_OK, buffer_save(buf));
+    if (!(gz = gzopen(path, "rb"))) exit(EXIT_FAILURE);
+    ASSERT("save_len", 12, gzread(gz, out, sizeof(out)));
+    gzclose(gz);
+    ASSERT("save_data", 0, strncmp("xhello\nworld", out, 12));
+
+    // A truncated gzip stream fails the open
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    fseek(fp, 0, SEEK_END);
+    gz_len = ftell(fp);
+    fclose(fp);
+    if (truncate(path, gz_len - 8) != 0) exit(EXIT_FAILURE);
+    ASSERT("truncated", MLBUF_ERR, buffer_open(buf, path));
+
+    ASSERT("follow", MLBUF_ERR, buffer_follow(buf, NULL));
+
+    // Plain files clear the flag
+    if (!(fp = fopen(path, "wb"))) exit(EXIT_FAILURE);
+    fputs("plain", fp);
+    fclose(fp);
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_AUTO, MLBUF_LARGE_FILE_SIZE);
+    ASSERT("reopen", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("plain", 0, buf->is_gzip);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("plain_data", 0, strncmp("plain", data, data_len));
+
+    unlink(path);
+)
@@ -0,0 +1,33 @@
+#include "test.h"
+
+MAIN("hello\nworld",
+    char *data;
+    bint_t data_len;
+    int fds[2];
+    char* input = "one\ntwo\n\xe4\xb8\x96\nfour";
+
+    if (pipe(fds) != 0) exit(EXIT_FAILURE);
+    if (write(fds[1], input, strlen(input)) != (ssize_t)strlen(input)) exit(EXIT_FAILURE);
+    close(fds[1]);
+
+    ASSERT("rc", MLBUF_OK, buffer_open_fd(buf, fds[0]));
+    close(fds[0]);
+
+    buffer_get(buf, &data, &data_len);
+    ASSERT("len", (bint_t)strlen(input), data_len);
+    ASSERT("data", 0, strncmp(input, data, data_len));
+    ASSERT("line_count", 4, buf->line_count);
+    ASSERT("byte_count", (bint_t)strlen(input), buf->byte_count);
+    ASSERT("last_line_index", 3, buf->last_line->line_index);
+    ASSERT("mark_line", buf->last_line, cur->bline);
+    ASSERT("unsaved", 0, buf->is_unsaved);
+    ASSERT("bad_fd", MLBUF_ERR, buffer_open_fd(buf, -1));
+
+    // A failed open leaves contents and undo history alone
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("bad_fd_bytes", (bint_t)strlen(input) + 1, buf->byte_count);
+    ASSERT("bad_fd_actions", 1, buf->actions != NULL);
+    ASSERT("dir", MLBUF_ERR, buffer_open(buf, "/tmp"));
+    ASSERT("dir_bytes", (bint_t)strlen(input) + 1, buf->byte_count);
+    ASSERT("dir_actions", 1, buf->actions != NULL);
+)
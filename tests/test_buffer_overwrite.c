@@ -0,0 +1,66 @@
+#include "test.h"
+
+MAIN("hello\nworld",
+    char *data;
+    bint_t data_len;
+    char path[32];
+    char out[32];
+    int fd;
+    FILE* fp;
+    bline_t* bline;
+
+    // Without a shared mmap this is a same-size replace
+    ASSERT("heap", MLBUF_OK, buffer_overwrite(buf, 1, "EL", 2));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("heap_data", 0, strncmp("hELlo\nworld", data, data_len));
+    ASSERT("newline", MLBUF_ERR, buffer_overwrite(buf, 0, "a\nb", 3));
+    ASSERT("multiline", MLBUF_ERR, buffer_overwrite(buf, 4, "abc", 3));
+    ASSERT("size", MLBUF_ERR, buffer_overwrite(buf, 0, "\xe4\xb8\x96", 3));
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (write(fd, "hello\nworld", 11) != 11) exit(EXIT_FAILURE);
+    close(fd);
+
+    // Overwrite goes into the shared mapping without unslabbing
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP_SHARED, 0);
+    ASSERT("open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("shared", 1, buf->is_mmap_shared);
+    buffer_get_bline(buf, 1, &bline);
+    ASSERT("overwrite", MLBUF_OK, buffer_overwrite(buf, 7, "OR", 2));
+    ASSERT("slabbed", 1, bline->is_data_slabbed);
+    ASSERT("data_ptr", 1, bline->data == buf->mmap + 6);
+    ASSERT("char_count", 5, bline->char_count);
+    ASSERT("unsaved", 1, buf->is_unsaved);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp("hello\nwORld", data, data_len));
+
+    // Save syncs the mapping in place
+    ASSERT("save", MLBUF_OK, buffer_save(buf));
+    ASSERT("saved", 0, buf->is_unsaved);
+    ASSERT("still_shared", 1, buf->is_mmap_shared);
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    ASSERT("file_len", 11, (bint_t)fread(out, 1, sizeof(out), fp));
+    fclose(fp);
+    ASSERT("file_data", 0, strncmp("hello\nwORld", out, 11));
+
+    // Undo unslabs, so the next save is a full rewrite
+    ASSERT("undo", MLBUF_OK, buffer_undo(buf));
+    ASSERT("save_full", MLBUF_OK, buffer_save(buf));
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    ASSERT("full_len", 11, (bint_t)fread(out, 1, sizeof(out), fp));
+    fclose(fp);
+    ASSERT("full_data", 0, strncmp("hello\nworld", out, 11));
+
+    // NUL bytes are kept and one undo reverts the whole overwrite
+    ASSERT("nul_open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("nul", MLBUF_OK, buffer_overwrite(buf, 7, "s\0c", 3));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("nul_data", 0, memcmp("hello\nws\0cd", data, data_len));
+    ASSERT("nul_undo", MLBUF_OK, buffer_undo(buf));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("nul_undo_len", 11, data_len);
+    ASSERT("nul_undo_data", 0, memcmp("hello\nworld", data, data_len));
+
+    unlink(path);
+)
@@ -0,0 +1,12 @@
+#include "test.h"
+
+MAIN("ab\tc\nx\nlonger",
+    char* data;
+    size_t data_len;
+
+    ASSERT("rc", MLBUF_OK, buffer_register_set_block(buf, 'a', buf->first_line, buf->last_line, 2, 5));
+    buffer_register_get(buf, 'a', 0, &data, &data_len);
+    ASSERT("len", 7, data_len);
+    ASSERT("data", 0, strncmp(data, "\tc\n\nnge", data_len));
+    ASSERT("bad_reg", MLBUF_ERR, buffer_register_set_block(buf, '0', buf->first_line, buf->last_line, 2, 5));
+)
@@ -0,0 +1,41 @@
+#include "test.h"
+
+MAIN("age 35, age 7\nfoo \xe4\xb8\x96 bar\n\nage 9",
+    pcre* cre;
+    const char* err;
+    int erroffset;
+    char* data;
+    bint_t data_len;
+    bint_t num_replaced;
+
+    cre = pcre_compile("age ([0-9]+)", PCRE_CASELESS, &err, &erroffset, NULL);
+    ASSERT("rc", MLBUF_OK, buffer_replace_all(buf, cre, "$1y", &num_replaced));
+    ASSERT("num", 3, num_replaced);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data", 0, strncmp(data, "35y, 7y\nfoo \xe4\xb8\x96 bar\n\n9y", data_len));
+    ASSERT("lines", 4, buf->line_count);
+    pcre_free(cre);
+
+    // Replacements may add lines
+    cre = pcre_compile(" ", 0, &err, &erroffset, NULL);
+    buffer_replace_all(buf, cre, "$n", &num_replaced);
+    ASSERT("num2", 3, num_replaced);
+    ASSERT("lines2", 7, buf->line_count);
+    ASSERT("last", 6, buf->last_line->line_index);
+    pcre_free(cre);
+
+    // Empty matches advance by one char
+    cre = pcre_compile("x*", 0, &err, &erroffset, NULL);
+    buffer_set(buf, "a\xe4\xb8\x96", 4);
+    buffer_replace_all(buf, cre, "-", &num_replaced);
+    ASSERT("num3", 3, num_replaced);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("data3", 0, strncmp(data, "-a-\xe4\xb8\x96-", data_len));
+
+    // One undo reverts everything
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo_len", 4, data_len);
+    ASSERT("undo", 0, strncmp(data, "a\xe4\xb8\x96", data_len));
+    pcre_free(cre);
+)
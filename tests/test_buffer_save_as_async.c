@@ -0,0 +1,89 @@
+#include "test.h"
+
+static int cb_called = 0;
+static int cb_rc = -1;
+static bint_t cb_nbytes = -1;
+
+static void save_cb(buffer_t* buffer, int rc, bint_t nbytes, void* udata) {
+    cb_called += 1;
+    cb_rc = rc;
+    cb_nbytes = nbytes;
+}
+
+MAIN("hello\nworld",
+    char path[32];
+    char path2[32];
+    char out[64];
+    int fd;
+    FILE* fp;
+    size_t out_len;
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    close(fd);
+
+    // Clean save updates state
+    ASSERT("start", MLBUF_OK, buffer_save_as_async(buf, path, save_cb, NULL));
+    ASSERT("busy", MLBUF_ERR, buffer_save_as_async(buf, path, save_cb, NULL));
+    ASSERT("poll", 1, buffer_save_async_poll(buf, 1));
+    ASSERT("cb_called", 1, cb_called);
+    ASSERT("cb_rc", MLBUF_OK, cb_rc);
+    ASSERT("cb_nbytes", 11, cb_nbytes);
+    ASSERT("unsaved", 0, buf->is_unsaved);
+    ASSERT("path", 0, strcmp(path, buf->path));
+    ASSERT("poll_none", 0, buffer_save_async_poll(buf, 1));
+
+    // Edit during save writes the snapshot and leaves buffer unsaved
+    ASSERT("start2", MLBUF_OK, buffer_save_as_async(buf, path, save_cb, NULL));
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("poll2", 1, buffer_save_async_poll(buf, 1));
+    ASSERT("cb_called2", 2, cb_called);
+    ASSERT("unsaved2", 1, buf->is_unsaved);
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    out_len = fread(out, 1, sizeof(out), fp);
+    fclose(fp);
+    ASSERT("file_len", 11, (bint_t)out_len);
+    ASSERT("file_data", 0, strncmp("hello\nworld", out, out_len));
+
+    // Errors are reported through the callback
+    ASSERT("start3", MLBUF_OK, buffer_save_as_async(buf, "/nonexistent/dir/file", save_cb, NULL));
+    ASSERT("poll3", 1, buffer_save_async_poll(buf, 1));
+    ASSERT("cb_rc3", MLBUF_ERR, cb_rc);
+    ASSERT("path3", 0, strcmp(path, buf->path));
+
+    // Reopening finishes a pending save first, so the save does not
+    // replace the path of the newly opened file
+    ASSERT("start5", MLBUF_OK, buffer_save_as_async(buf, "/dev/null", save_cb, NULL));
+    ASSERT("reopen", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("reopen_cb_called", 4, cb_called);
+    ASSERT("reopen_path", 0, strcmp(path, buf->path));
+    ASSERT("reopen_poll_none", 0, buffer_save_async_poll(buf, 1));
+
+    // Unedited mmapped lines are written from the mmap, which outlives
+    // buffer_set until the save is polled
+    if (!(fp = fopen(path, "wb"))) exit(EXIT_FAILURE);
+    fputs("one\ntwo\nthree\nfour", fp);
+    fclose(fp);
+    sprintf(path2, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path2)) < 0) exit(EXIT_FAILURE);
+    close(fd);
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    ASSERT("mmap_open", MLBUF_OK, buffer_open(buf, path));
+    buffer_insert_w_bline(buf, buf->first_line->next, 3, "!", 1, NULL);
+    ASSERT("mmap_start", MLBUF_OK, buffer_save_as_async(buf, path2, save_cb, NULL));
+    buffer_set(buf, "", 0);
+    ASSERT("mmap_poll", 1, buffer_save_async_poll(buf, 1));
+    ASSERT("mmap_cb_rc", MLBUF_OK, cb_rc);
+    ASSERT("mmap_cb_nbytes", 19, cb_nbytes);
+    if (!(fp = fopen(path2, "rb"))) exit(EXIT_FAILURE);
+    out_len = fread(out, 1, sizeof(out), fp);
+    fclose(fp);
+    ASSERT("mmap_file_len", 19, (bint_t)out_len);
+    ASSERT("mmap_file_data", 0, strncmp("one\ntwo!\nthree\nfour", out, out_len));
+    unlink(path2);
+
+    // Pending save is finished on destroy
+    ASSERT("start4", MLBUF_OK, buffer_save_as_async(buf, "/dev/null", NULL, NULL));
+
+    unlink(path);
+)
@@ -6,4 +6,28 @@ MAIN("hello\nworld",
     buffer_set(buf, "goodbye\nvoid", 12);
     buffer_get(buf, &data, &data_len);
     ASSERT("set", 0, strncmp("goodbye\nvoid", data, data_len));
+    ASSERT("line_count", 2, buf->line_count);
+    ASSERT("byte_count", 12, buf->byte_count);
+    ASSERT("last_line", buf->first_line->next, buf->last_line);
+    ASSERT("line_index", 1, buf->last_line->line_index);
+    ASSERT("mark_line", buf->last_line, cur->bline);
+    ASSERT("mark_col", 4, cur->col);
+    ASSERT("no_undo", MLBUF_ERR, buffer_undo(buf));
+
+    buffer_set(buf, "a\n\nb\n", 5);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("set_nl", 0, strncmp("a\n\nb\n", data, data_len));
+    ASSERT("line_count_nl", 4, buf->line_count);
+
+    buffer_insert(buf, 0, "x", 1, NULL);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("insert", 0, strncmp("xa\n\nb\n", data, data_len));
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp("a\n\nb\n", data, data_len));
+
+    buffer_set(buf, "", 0);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("empty", 0, data_len);
+    ASSERT("empty_lines", 1, buf->line_count);
 )
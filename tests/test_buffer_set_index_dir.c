@@ -0,0 +1,90 @@
+#include "test.h"
+#include <dirent.h>
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    char dir[32];
+    char path[64];
+    char index_path[512];
+    struct dirent* ent;
+    DIR* dh;
+    FILE* fp;
+    char index[512];
+    size_t index_len;
+    size_t header_len;
+    uint64_t offset;
+    uint64_t nlines;
+    buffer_t* buf2;
+    buffer_t* buf3;
+
+    sprintf(dir, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if (!mkdtemp(dir)) exit(EXIT_FAILURE);
+    sprintf(path, "%s/file", dir);
+    if (!(fp = fopen(path, "wb"))) exit(EXIT_FAILURE);
+    fputs("hello\nworld\n!", fp);
+    fclose(fp);
+
+    // Open with index_dir set writes an index
+    buffer_set_index_dir(buf, dir);
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    ASSERT("open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("line_count", 3, buf->line_count);
+    index_path[0] = '\0';
+    dh = opendir(dir);
+    while ((ent = readdir(dh)) != NULL) {
+        if (strstr(ent->d_name, ".idx")) sprintf(index_path, "%s/%s", dir, ent->d_name);
+    }
+    closedir(dh);
+    ASSERT("index_exists", 1, index_path[0] != '\0');
+
+    // Reopen uses index
+    buf2 = buffer_new();
+    buffer_set_index_dir(buf2, dir);
+    buffer_set_open_strategy(buf2, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    ASSERT("reopen", MLBUF_OK, buffer_open(buf2, path));
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("reopen_data", 0, strncmp("hello\nworld\n!", data, data_len));
+    ASSERT("reopen_line_count", 3, buf2->line_count);
+    ASSERT("reopen_last_line", 1, buf2->last_line->data_len);
+    buffer_destroy(buf2);
+
+    // Prove that line offsets come from index by rewriting it to skip a line
+    if (!(fp = fopen(index_path, "rb"))) exit(EXIT_FAILURE);
+    index_len = fread(index, 1, sizeof(index), fp);
+    fclose(fp);
+    header_len = index_len - 3 * sizeof(uint64_t);
+    nlines = 2;
+    memcpy(index + header_len - sizeof(uint64_t), &nlines, sizeof(nlines));
+    offset = 0;
+    memcpy(index + header_len, &offset, sizeof(offset));
+    offset = 12;
+    memcpy(index + header_len + sizeof(offset), &offset, sizeof(offset));
+    if (!(fp = fopen(index_path, "wb"))) exit(EXIT_FAILURE);
+    fwrite(index, 1, header_len + 2 * sizeof(uint64_t), fp);
+    fclose(fp);
+    buf3 = buffer_new();
+    buffer_set_index_dir(buf3, dir);
+    buffer_set_open_strategy(buf3, MLBUF_OPEN_STRATEGY_MMAP_COPY, 0);
+    ASSERT("from_index_open", MLBUF_OK, buffer_open(buf3, path));
+    ASSERT("from_index", 2, buf3->line_count);
+    buffer_destroy(buf3);
+
+    // An index with an offset that does not follow a newline is ignored
+    if (!(fp = fopen(index_path, "r+b"))) exit(EXIT_FAILURE);
+    fseek(fp, -1 * (long)sizeof(uint64_t), SEEK_END);
+    offset = 11;
+    fwrite(&offset, sizeof(offset), 1, fp);
+    fclose(fp);
+    buf3 = buffer_new();
+    buffer_set_index_dir(buf3, dir);
+    buffer_set_open_strategy(buf3, MLBUF_OPEN_STRATEGY_MMAP_COPY, 0);
+    ASSERT("bad_index_open", MLBUF_OK, buffer_open(buf3, path));
+    ASSERT("bad_index_line_count", 3, buf3->line_count);
+    ASSERT("bad_index_last_line", 1, buf3->last_line->data_len);
+    buffer_destroy(buf3);
+
+    unlink(index_path);
+    unlink(path);
+    rmdir(dir);
+)
@@ -0,0 +1,125 @@
+#include "test.h"
+
+// Journal records (type, line_index, col, nchars, data_len) and their data
+static int64_t bad_permute[] = { MLBUF_BACTION_TYPE_PERMUTE, 0, 0, 0, 16, 0, 0 };
+static int64_t bad_join[] = { MLBUF_BACTION_TYPE_JOIN, 0, 0, 0, 16, 1000, 0 };
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    char path[32];
+    char journal_path[32];
+    int fd;
+    FILE* fp;
+    buffer_t* buf2;
+    char* expected;
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (write(fd, "hello\nworld", 11) != 11) exit(EXIT_FAILURE);
+    close(fd);
+    sprintf(journal_path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(journal_path)) < 0) exit(EXIT_FAILURE);
+    close(fd);
+
+    // Record some edits
+    buffer_open(buf, path);
+    ASSERT("set", MLBUF_OK, buffer_set_journal(buf, journal_path));
+    buffer_insert(buf, 6, "big\n", 4, NULL);
+    buffer_delete(buf, 0, 1);
+    buffer_replace(buf, 3, 2, "p!", 2);
+    buffer_undo(buf);
+    buffer_insert(buf, 0, "\xe4\xb8\x96", 3, NULL);
+    buffer_delete(buf, 1, 2);
+    buffer_reverse_lines(buf, buf->first_line, buf->last_line);
+    buffer_join_lines(buf, buf->first_line, buf->last_line, " ", 1);
+    buffer_undo(buf);
+    ASSERT("flush", MLBUF_OK, buffer_journal_flush(buf, 1));
+
+    // Replay them onto the original file
+    buf2 = buffer_new_open(path);
+    ASSERT("recover", MLBUF_OK, buffer_journal_recover(buf2, journal_path));
+    buffer_get(buf, &data, &data_len);
+    expected = strndup(data, data_len);
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("len", buf->byte_count, data_len);
+    ASSERT("data", 0, strncmp(expected, data, data_len));
+    ASSERT("unsaved", 1, buf2->is_unsaved);
+
+    // Saving compacts the journal and changes its base
+    ASSERT("save", MLBUF_OK, buffer_save(buf));
+    buffer_destroy(buf2);
+    buf2 = buffer_new_open(path);
+    ASSERT("recover_empty", MLBUF_OK, buffer_journal_recover(buf2, journal_path));
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("data_saved", 0, strncmp(expected, data, data_len));
+    ASSERT("unsaved_saved", 0, buf2->is_unsaved);
+
+    // buffer_set is journaled as a clear and insert
+    buffer_set(buf, "new", 3);
+    buffer_journal_flush(buf, 0);
+    ASSERT("recover_set", MLBUF_OK, buffer_journal_recover(buf2, journal_path));
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("data_set", 0, strncmp("new", data, data_len));
+    buffer_destroy(buf2);
+
+    // Following the file rebases the journal on the grown file
+    buffer_insert(buf, 0, "> ", 2, NULL);
+    if (!(fp = fopen(path, "ab"))) exit(EXIT_FAILURE);
+    fputs("\nmore", fp);
+    fclose(fp);
+    ASSERT("follow", MLBUF_OK, buffer_follow(buf, NULL));
+    ASSERT("follow_flush", MLBUF_OK, buffer_journal_flush(buf, 0));
+    buf2 = buffer_new_open(path);
+    ASSERT("recover_follow", MLBUF_OK, buffer_journal_recover(buf2, journal_path));
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("data_follow", 0, strncmp("> new\nmore", data, data_len));
+    ASSERT("len_follow", 10, data_len);
+    buffer_destroy(buf2);
+
+    // Edits between follows, including ones that move the last line
+    buffer_reverse_lines(buf, buf->first_line, buf->last_line);
+    if (!(fp = fopen(path, "ab"))) exit(EXIT_FAILURE);
+    fputs("\nagain", fp);
+    fclose(fp);
+    ASSERT("follow2", MLBUF_OK, buffer_follow(buf, NULL));
+    ASSERT("follow2_flush", MLBUF_OK, buffer_journal_flush(buf, 0));
+    buf2 = buffer_new_open(path);
+    ASSERT("recover_follow2", MLBUF_OK, buffer_journal_recover(buf2, journal_path));
+    buffer_get(buf2, &data, &data_len);
+    ASSERT("data_follow2", 0, strncmp("more\n> new\nagain", data, data_len));
+    ASSERT("len_follow2", 16, data_len);
+    buffer_destroy(buf2);
+
+    // Records with bad data are rejected
+    if (!(fp = fopen(journal_path, "ab"))) exit(EXIT_FAILURE);
+    fwrite(bad_permute, sizeof(bad_permute), 1, fp);
+    fclose(fp);
+    buf2 = buffer_new_open(path);
+    ASSERT("bad_permute", MLBUF_ERR, buffer_journal_recover(buf2, journal_path));
+    buffer_destroy(buf2);
+    buffer_set_journal(buf, journal_path);
+    ASSERT("save_bad", MLBUF_OK, buffer_save(buf));
+    if (!(fp = fopen(journal_path, "ab"))) exit(EXIT_FAILURE);
+    fwrite(bad_join, sizeof(bad_join), 1, fp);
+    fclose(fp);
+    buf2 = buffer_new_open(path);
+    ASSERT("bad_join", MLBUF_ERR, buffer_journal_recover(buf2, journal_path));
+    buffer_destroy(buf2);
+
+    // Records that cannot be written are reported by flush
+    buffer_set_journal(buf, "/dev/full");
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("flush_full", MLBUF_ERR, buffer_journal_flush(buf, 0));
+
+    // Journal for another version of the file is rejected
+    buffer_set_journal(buf, NULL);
+    buf2 = buffer_new();
+    ASSERT("mismatch", MLBUF_ERR, buffer_journal_recover(buf2, journal_path));
+    ASSERT("flush_none", MLBUF_ERR, buffer_journal_flush(buf2, 0));
+    buffer_destroy(buf2);
+
+    free(expected);
+    unlink(path);
+    unlink(journal_path);
+)
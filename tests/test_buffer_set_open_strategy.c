@@ -0,0 +1,62 @@
+#include "test.h"
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    char path[32];
+    int fd;
+    FILE* fp;
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    if (write(fd, "hello\nworld", 11) != 11) exit(EXIT_FAILURE);
+    close(fd);
+
+    // Small files are read by default
+    ASSERT("default_open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("default", 1, buf->mmap == NULL);
+
+    ASSERT("bad", MLBUF_ERR, buffer_set_open_strategy(buf, 42, 0));
+
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_AUTO, 1024);
+    buffer_open(buf, path);
+    ASSERT("auto_small", 1, buf->mmap == NULL);
+
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_AUTO, 0);
+    buffer_open(buf, path);
+    ASSERT("auto_large", 1, buf->mmap != NULL);
+
+    // Auto maps a copy, so truncating the file does not pull lines from
+    // under us
+    if (truncate(path, 0) != 0) exit(EXIT_FAILURE);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("auto_copy_data", 0, strncmp("hello\nworld", data, data_len));
+    ASSERT("auto_copy_len", 11, data_len);
+    if (!(fp = fopen(path, "wb"))) exit(EXIT_FAILURE);
+    fputs("hello\nworld", fp);
+    fclose(fp);
+
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_READ, 0);
+    buffer_open(buf, path);
+    ASSERT("read", 1, buf->mmap == NULL);
+
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP_COPY, 0);
+    buffer_open(buf, path);
+    ASSERT("mmap_copy", 1, buf->mmap != NULL);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("mmap_copy_data", 0, strncmp("hello\nworld", data, data_len));
+    ASSERT("mmap_copy_len", 11, data_len);
+
+    // Saving over a directly mmapped file keeps slabbed lines intact
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    buffer_open(buf, path);
+    ASSERT("mmap", 1, buf->mmap != NULL);
+    buffer_insert(buf, 0, "x", 1, NULL);
+    ASSERT("save", MLBUF_OK, buffer_save(buf));
+    buffer_open(buf, path);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("save_data", 0, strncmp("xhello\nworld", data, data_len));
+    ASSERT("save_len", 12, data_len);
+
+    unlink(path);
+)
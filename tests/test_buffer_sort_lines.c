@@ -0,0 +1,59 @@
+#include "test.h"
+
+static int cmp_len(bline_t* a, bline_t* b, void* udata) {
+    return (int)(a->data_len - b->data_len);
+}
+
+MAIN("head\ncherry\napple\nfig\nbanana\napple\ntail",
+    char* data;
+    bint_t data_len;
+    bline_t* start;
+    bline_t* end;
+    bline_t* fig;
+    mark_t* mark;
+    pcre* cre;
+    const char* err;
+    int erroffset;
+
+    start = buf->first_line->next;
+    end = buf->last_line->prev;
+    fig = start->next->next;
+    mark = buffer_add_mark(buf, fig, 1);
+    buffer_get(buf, &data, &data_len);
+
+    ASSERT("rc", MLBUF_OK, buffer_sort_lines(buf, start, end, NULL, NULL));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("sorted", 0, strncmp(data, "head\napple\napple\nbanana\ncherry\nfig\ntail", data_len));
+    ASSERT("not_dirty", 0, buf->is_data_dirty);
+    ASSERT("idx", 5, fig->line_index);
+    ASSERT("mark", fig, mark->bline);
+    ASSERT("last", 6, buf->last_line->line_index);
+
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "head\ncherry\napple\nfig\nbanana\napple\ntail", data_len));
+    ASSERT("undo_idx", 3, fig->line_index);
+    buffer_redo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("redo", 0, strncmp(data, "head\napple\napple\nbanana\ncherry\nfig\ntail", data_len));
+
+    // Stable sort by comparator
+    buffer_sort_lines(buf, buf->first_line, buf->last_line, cmp_len, NULL);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("cmp", 0, strncmp(data, "fig\nhead\ntail\napple\napple\nbanana\ncherry", data_len));
+    ASSERT("first", 0, buf->first_line->line_index);
+    ASSERT("first_data", 0, strncmp(buf->first_line->data, "fig", 3));
+
+    // Sort by regex key
+    buffer_set(buf, "b 3\na 1\nc 2\nnone", 16);
+    cre = pcre_compile("([0-9]+)", 0, &err, &erroffset, NULL);
+    buffer_sort_lines_by_cre(buf, buf->last_line, buf->first_line, cre);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("cre", 0, strncmp(data, "none\na 1\nc 2\nb 3", data_len));
+    pcre_free(cre);
+
+    // Reverse
+    buffer_reverse_lines(buf, buf->first_line, buf->last_line);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("rev", 0, strncmp(data, "b 3\nc 2\na 1\nnone", data_len));
+)
@@ -0,0 +1,18 @@
+#include "test.h"
+
+MAIN("hello\n\xe4\xb8\x96\nworld",
+    char data[16];
+    bint_t data_len;
+    bint_t nchars;
+
+    ASSERT("small", MLBUF_ERR, buffer_substr_into(buf, buf->first_line, 4, buf->last_line, 1, data, 7, &data_len, &nchars));
+    ASSERT("needed", 7, data_len);
+
+    ASSERT("rc", MLBUF_OK, buffer_substr_into(buf, buf->first_line, 4, buf->last_line, 1, data, 8, &data_len, &nchars));
+    ASSERT("datalen", 7, data_len);
+    ASSERT("nchars", 5, nchars);
+    ASSERT("substr", 0, strcmp("o\n\xe4\xb8\x96\nw", data));
+
+    buffer_substr_into(buf, buf->last_line, 1, buf->last_line, 3, data, sizeof(data), &data_len, &nchars);
+    ASSERT("single", 0, strcmp("or", data));
+)
@@ -0,0 +1,15 @@
+#include "test.h"
+
+MAIN("a\na\nb\na\na\na\nc\nc",
+    char* data;
+    bint_t data_len;
+
+    ASSERT("rc", MLBUF_OK, buffer_unique_lines(buf, buf->first_line, buf->last_line));
+    buffer_get(buf, &data, &data_len);
+    ASSERT("uniq", 0, strncmp(data, "a\nb\na\nc", data_len));
+    ASSERT("len", 7, data_len);
+    ASSERT("lines", 4, buf->line_count);
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "a\na\nb\na\na\na\nc\nc", data_len));
+)
@@ -0,0 +1,69 @@
+#include "test.h"
+
+MAIN("",
+    char *data;
+    bint_t data_len;
+    char path[32];
+    char* expected;
+    char* actual;
+    size_t nbytes;
+    bint_t i;
+    int fd;
+    FILE* fp;
+
+    // Enough lines to span several writev batches, with some empty ones
+    for (i = 0; i < MLBUF_IOV_MAX * 3; i++) {
+        buffer_insert(buf, buf->byte_count, (i % 3 == 0) ? "\n" : "line\n", (i % 3 == 0) ? 1 : 5, NULL);
+    }
+    buffer_insert(buf, buf->byte_count, "end", 3, NULL);
+    buffer_get(buf, &data, &data_len);
+    expected = strndup(data, data_len);
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    ASSERT("rc", MLBUF_OK, buffer_write_to_fd(buf, fd, &nbytes));
+    close(fd);
+    ASSERT("nbytes", data_len, (bint_t)nbytes);
+
+    actual = calloc(1, data_len + 1);
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    ASSERT("file_len", data_len, (bint_t)fread(actual, 1, data_len + 1, fp));
+    fclose(fp);
+    ASSERT("file_data", 0, memcmp(expected, actual, data_len));
+
+    ASSERT("bad_fd", MLBUF_ERR, buffer_write_to_fd(buf, -1, &nbytes));
+
+    // Untouched runs of a large mmapped file are copied from the file. Make
+    // it 4x the copy threshold so the runs on either side of an edit in the
+    // middle are both over it.
+    if (!(fp = fopen(path, "wb"))) exit(EXIT_FAILURE);
+    for (i = 0; i < MLBUF_COPY_RANGE_MIN_SIZE / 2; i++) {
+        fprintf(fp, "%07jd\n", i);
+    }
+    fclose(fp);
+    buffer_set_open_strategy(buf, MLBUF_OPEN_STRATEGY_MMAP, 0);
+    ASSERT("mmap_open", MLBUF_OK, buffer_open(buf, path));
+    ASSERT("mmap", 1, buf->mmap != NULL);
+    ASSERT("mmap_size", MLBUF_COPY_RANGE_MIN_SIZE * 4, buf->byte_count);
+    buffer_insert(buf, buf->byte_count / 2, "edit", 4, NULL);
+    buffer_get(buf, &data, &data_len);
+    free(expected);
+    expected = strndup(data, data_len);
+    unlink(path);
+
+    sprintf(path, "%s", "/tmp/mlbuf-test-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) exit(EXIT_FAILURE);
+    ASSERT("mmap_rc", MLBUF_OK, buffer_write_to_fd(buf, fd, &nbytes));
+    close(fd);
+    ASSERT("mmap_nbytes", data_len, (bint_t)nbytes);
+    free(actual);
+    actual = calloc(1, data_len + 1);
+    if (!(fp = fopen(path, "rb"))) exit(EXIT_FAILURE);
+    ASSERT("mmap_file_len", data_len, (bint_t)fread(actual, 1, data_len + 1, fp));
+    fclose(fp);
+    ASSERT("mmap_file_data", 0, memcmp(expected, actual, data_len));
+
+    free(expected);
+    free(actual);
+    unlink(path);
+)
@@ -45,4 +45,10 @@ MAIN("obj->method() yes bob",
     ASSERT("l_eow2", 0, mark_is_at_word_bound(cur, -1));
     ASSERT("x_eow2", 1, mark_is_at_word_bound(cur, 0));
     ASSERT("r_eow2", 1, mark_is_at_word_bound(cur, 1));
+
+    buffer_set(buf, "caf\xc3\xa9 x", 7);
+    mark_move_to(cur, 0, 3);  // caf|é x
+    ASSERT("x_utf8_mid", 0, mark_is_at_word_bound(cur, 0));
+    mark_move_to(cur, 0, 4);  // café| x
+    ASSERT("r_utf8_eow", 1, mark_is_at_word_bound(cur, 1));
 )
@@ -0,0 +1,34 @@
+#include "test.h"
+
+MAIN("hello\nworld",
+    markset_t* set;
+    mark_t* a;
+    char* data;
+    bint_t data_len;
+
+    set = markset_new(buf);
+    a = buffer_add_mark(buf, buf->first_line, 4);
+    markset_add(set, cur);
+    markset_add(set, a);
+    markset_delete_after(set, 3);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("after", 0, strncmp(data, "lorld", data_len));
+    ASSERT("lines", 1, buf->line_count);
+
+    // Overlapping ranges are merged
+    buffer_set(buf, "abcdef", 6);
+    mark_move_col(cur, 2);
+    mark_move_col(a, 3);
+    markset_delete_before(set, 2);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("before", 0, strncmp(data, "def", data_len));
+    ASSERT("cur_col", 0, cur->col);
+    ASSERT("a_col", 0, a->col);
+
+    // Deletes past the end are clamped
+    mark_move_col(a, 2);
+    markset_delete_after(set, 5);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("len", 0, data_len);
+    markset_destroy(set);
+)
@@ -0,0 +1,51 @@
+#include "test.h"
+
+MAIN("one\ntwo\nthree",
+    markset_t* set;
+    mark_t* a;
+    mark_t* b;
+    mark_t* c;
+    char* data;
+    bint_t data_len;
+
+    set = markset_new(buf);
+    a = buffer_add_mark(buf, buf->first_line->next->next, 0);
+    b = buffer_add_mark(buf, buf->first_line, 3);
+    c = buffer_add_mark(buf, buf->first_line->next, 1);
+    markset_add(set, a);
+    markset_add(set, b);
+    markset_add(set, c);
+    markset_add(set, cur);
+    markset_insert_before(set, "ab", 2);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("len", 21, data_len);
+    ASSERT("data", 0, strncmp(data, "aboneab\ntabwo\nabthree", data_len));
+    ASSERT("a_col", 2, a->col);
+    ASSERT("b_col", 7, b->col);
+    ASSERT("c_col", 3, c->col);
+    ASSERT("cur_col", 2, cur->col);
+
+    // Inserted newlines move later marks down
+    markset_insert_before(set, "\n", 1);
+    ASSERT("lines", 7, buf->line_count);
+    ASSERT("a_line", 6, a->bline->line_index);
+    ASSERT("a_col2", 0, a->col);
+    ASSERT("c_line", 4, c->bline->line_index);
+
+    // One undo reverts the batch
+    buffer_undo(buf);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("undo", 0, strncmp(data, "aboneab\ntabwo\nabthree", data_len));
+
+    // Marks at the same position insert once
+    markset_remove(set, a);
+    markset_remove(set, b);
+    markset_remove(set, c);
+    mark_move_beginning(cur);
+    mark_move_beginning(a);
+    markset_add(set, a);
+    markset_insert_before(set, "x", 1);
+    buffer_get(buf, &data, &data_len);
+    ASSERT("dup", 0, strncmp(data, "xaboneab", 8));
+    markset_destroy(set);
+)
@@ -0,0 +1,58 @@
+#include "test.h"
+
+MAIN("foo bar\nbaz_1 qux",
+    markset_t* set;
+    mark_t* a;
+
+    set = markset_new(buf);
+    a = buffer_add_mark(buf, buf->first_line->next, 2);
+    markset_add(set, a);
+    markset_add(set, cur);
+    markset_move_by(set, 6);
+    ASSERT("cur_col", 6, cur->col);
+    ASSERT("a_line", 1, a->bline->line_index);
+    ASSERT("a_col", 8, a->col);
+    markset_move_by(set, 3);
+    ASSERT("cur_line", 1, cur->bline->line_index);
+    ASSERT("cur_col2", 1, cur->col);
+    ASSERT("a_col2", 9, a->col);
+    markset_move_by(set, -100);
+    ASSERT("cur_col3", 0, cur->col);
+    ASSERT("cur_line3", 0, cur->bline->line_index);
+
+    // Words
+    mark_move_to(a, 1, 0);
+    markset_move_next_word(set);
+    ASSERT("next_cur", 3, cur->col);
+    ASSERT("next_a", 5, a->col);
+    markset_move_next_word(set);
+    ASSERT("next_cur2", 7, cur->col);
+    markset_move_next_word(set);
+    ASSERT("next_cur3", 1, cur->bline->line_index);
+    ASSERT("next_cur3_col", 0, cur->col);
+    markset_move_prev_word(set);
+    ASSERT("prev_a", 6, a->col);
+    ASSERT("prev_cur", 0, cur->bline->line_index);
+    ASSERT("prev_cur_col", 7, cur->col);
+    markset_move_prev_word(set);
+    ASSERT("prev_a2", 0, a->col);
+    ASSERT("prev_cur2", 4, cur->col);
+
+    // Lines
+    markset_move_vert(set, 1);
+    ASSERT("vert_cur", 1, cur->bline->line_index);
+
+    // Non-ASCII letters are word chars, CJK punctuation is not
+    buffer_set(buf, "h\xc3\xa9llo w\xc3\xb6rld, \xe4\xb8\x96\xe7\x95\x8c\xe3\x80\x82", 24);
+    mark_move_to(cur, 0, 0);
+    mark_move_to(a, 0, 0);
+    markset_move_next_word(set);
+    ASSERT("utf8_next", 5, cur->col);
+    markset_move_next_word(set);
+    ASSERT("utf8_next2", 11, cur->col);
+    markset_move_next_word(set);
+    ASSERT("utf8_next3", 15, cur->col);
+    markset_move_prev_word(set);
+    ASSERT("utf8_prev", 13, cur->col);
+    markset_destroy(set);
+)
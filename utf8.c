@@ -1,5 +1,6 @@
 // Adapted from https://github.com/nsf/termbox/blob/a0e450500b3f07ddd172ac64e48a59129a8878fb/src/utf8.c
 
+#include <ctype.h>
 #include <stdint.h>
 
 #include "mlbuf.h"
@@ -15,6 +16,20 @@ static const unsigned char utf8_length[256] = {
   3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,5,5,5,5,6,6,1,1
 };
 
+// Blocks of non-ASCII spaces, punctuation, and symbols. Other code points
+// past Latin-1 punctuation are taken to be word chars.
+static const uint32_t utf8_non_word_ranges[][2] = {
+    { 0x0080, 0x00a9 }, { 0x00ab, 0x00b4 }, { 0x00b6, 0x00b9 }, { 0x00bb, 0x00bf },
+    { 0x00d7, 0x00d7 }, { 0x00f7, 0x00f7 },
+    { 0x2000, 0x2bff }, // General punctuation thru misc symbols and arrows
+    { 0x2e00, 0x2e7f }, // Supplemental punctuation
+    { 0x3000, 0x303f }, // CJK symbols and punctuation
+    { 0xfe10, 0xfe1f }, { 0xfe30, 0xfe6f }, // Vertical, CJK compat, and small forms
+    { 0xff00, 0xff0f }, { 0xff1a, 0xff20 }, { 0xff3b, 0xff3e }, { 0xff40, 0xff40 }, { 0xff5b, 0xff65 },
+    { 0xfff0, 0xffff }, // Specials
+    { 0x1f000, 0x1faff }, // Emoji and other pictographs
+};
+
 static const unsigned char utf8_mask[6] = {
     0x7F,
     0x1F,
@@ -82,3 +97,18 @@ int utf8_unicode_to_char(char *out, uint32_t c) {
 
     return len;
 }
+
+// Return 1 if ch is a word char, i.e., alphanumeric or underscore in ASCII,
+// or outside the non-ASCII space, punctuation, and symbol blocks
+int utf8_is_word_char(uint32_t ch) {
+    size_t i;
+    if (ch < 0x80) {
+        return isalnum((int)ch) || ch == '_' ? 1 : 0;
+    }
+    for (i = 0; i < sizeof(utf8_non_word_ranges) / sizeof(utf8_non_word_ranges[0]); i++) {
+        if (ch >= utf8_non_word_ranges[i][0] && ch <= utf8_non_word_ranges[i][1]) {
+            return 0;
+        }
+    }
+    return 1;
+}